@@ -0,0 +1,689 @@
+/*
+ * Name: cache.c
+ * Auth: Andrew Swaim
+ * Date: November 2019
+ * Desc: Caches: the directory index kept current by inotify with its listings, and the file
+ *       cache shared by all workers.
+ */
+
+#include "ftpserver.h"
+
+static unsigned long long dirGens = 0; // generations handed out, shared so no two workers' indexes have the same one
+static int zipping = 0;                // cache entries being compressed, under the cache lock
+static struct cacheMiss loads[LOAD_THREADS]; // files that missed being loaded, under the cache lock
+
+// Name: dirInit()
+// Desc: Builds the reactor's index of the root directory and starts watching it for changes.
+// Arg : r - the reactor to build the index for.
+// Pre : The reactor's epoll instance was created.
+// Post: The index holds the directory's regular files and inotify keeps it current. Without inotify
+//       the directory is scanned again for every listing, and no directory handles are cached.
+void dirInit(struct reactor* r) {
+
+    struct dirIndex* d = &r->dir;
+
+    d->w.kind = W_NOTIFY;
+    d->w.conn = NULL;
+    if ((d->w.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1
+            || (d->wd = inotify_add_watch(d->w.fd, cfg.root, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO
+                                                              | IN_DELETE_SELF | IN_MOVE_SELF)) == -1) {
+        LOG_ERRNO(L_WARN, "WARNING, watching root directory, listings will not be cached\n\n");
+        if (d->w.fd != -1) { close(d->w.fd); d->w.fd = -1; }
+    } else {
+        watchFd(r, &d->w, EPOLLIN);
+    }
+    d->rescan = TRUE;
+    r->paths.notify = d->w.fd;
+    r->paths.rootWd = d->wd;
+}
+
+// Name: dirScan()
+// Desc: Rebuilds the index from scratch in one pass over the directory.
+// Arg1: d - the index.
+// Arg2: dirfd - the directory, left open.
+// Pre : None.
+// Post: The arena holds the name of every regular file in the directory, under a new generation.
+// Rtrn: 0 on success, -1 if the directory could not be read.
+int dirScan(struct dirIndex* d, int dirfd) {
+
+    // Opening and ready directory contents from official manpage
+    // http://man7.org/linux/man-pages/man3/readdir.3.html
+    DIR* dir;
+    struct dirent* dirEnt;
+    int fd;
+
+    LOG(L_DEBUG, "Opening directory to get contents...\n\n");
+    if ((fd = openat(dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1 || (dir = fdopendir(fd)) == NULL) {
+        LOG_ERRNO(L_ERROR, "ERROR, opening directory\n\n");
+        if (fd != -1) { close(fd); }
+        return -1;
+    }
+
+    // Append the names of the regular files to the arena as they come
+    d->len = 0;
+    d->count = 0;
+    d->rescan = FALSE;
+    d->gen = __atomic_add_fetch(&dirGens, 1, __ATOMIC_RELAXED);
+    while ((dirEnt = readdir(dir)) != NULL) {
+        if (dirEnt->d_type == DT_REG && !isPutTemp(dirEnt->d_name) && dirAppend(d, dirEnt->d_name) == -1) {
+            LOG_ERRNO(L_ERROR, "ERROR, growing directory index\n\n");
+            d->rescan = TRUE;
+            closedir(dir);
+            return -1;
+        }
+    }
+    closedir(dir);
+    LOG(L_INFO, "Directory indexed: %d files, %lld bytes\n\n", d->count, d->len);
+
+    return 0;
+}
+
+// Name: dirAppend()
+// Desc: Adds a name to the end of the index's arena, doubling the arena when it is full.
+// Arg1: d - the index.
+// Arg2: name - the filename.
+// Pre : The name is not in the index yet.
+// Post: The name and a newline are appended and the cached listing is dropped.
+// Rtrn: 0 on success, -1 if out of memory.
+int dirAppend(struct dirIndex* d, const char* name) {
+
+    long long n = strlen(name);
+    long long cap;
+    char* grown;
+
+    if (d->len + n + 1 > d->cap) {
+        for (cap = d->cap ? d->cap : DIR_ARENA; cap < d->len + n + 1; cap *= 2) {}
+        if ((grown = realloc(d->names, cap)) == NULL) { return -1; }
+        d->names = grown;
+        d->cap = cap;
+    }
+    memcpy(d->names + d->len, name, n);
+    d->names[d->len + n] = '\n';
+    d->len += n + 1;
+    d->count++;
+    dirDrop(d);
+    return 0;
+}
+
+// Name: dirFind()
+// Desc: Finds a name in the index's arena.
+// Arg1: d - the index.
+// Arg2: name - the filename.
+// Pre : None.
+// Post: None.
+// Rtrn: The offset of the name in the arena, or -1 if it is not there.
+long long dirFind(struct dirIndex* d, const char* name) {
+
+    long long n = strlen(name);
+    char *p, *nl, *end = d->names + d->len;
+
+    for (p = d->names; p < end; p = nl + 1) {
+        nl = memchr(p, '\n', end - p);
+        if (nl - p == n && memcmp(p, name, n) == 0) { return p - d->names; }
+    }
+    return -1;
+}
+
+// Name: dirNotify()
+// Desc: Applies the changes inotify reports to the index.
+// Arg : r - the reactor owning the index.
+// Pre : The inotify instance is readable.
+// Post: Created and moved in regular files are added, deleted and moved out ones removed, which
+//       moves the entries after them back and so starts a new generation of the index. If events
+//       were lost, or the directory itself went away, the next listing rescans it. A directory
+//       handle that was moved or removed drops every handle of the worker.
+void dirNotify(struct reactor* r) {
+
+    // Reading inotify events from official manpage
+    // http://man7.org/linux/man-pages/man7/inotify.7.html
+    struct dirIndex* d = &r->dir;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event* ev;
+    struct stat st;
+    long long off, n;
+    ssize_t len;
+    char* p;
+
+    while (1) {
+        if ((len = read(d->w.fd, buf, sizeof(buf))) == -1) {
+            if (errno == EINTR) { continue; }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) { LOG_ERRNO(L_ERROR, "ERROR, reading directory changes\n\n"); d->rescan = TRUE; }
+            return;
+        }
+
+        for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len) {
+            ev = (const struct inotify_event*)p;
+            if (ev->mask & IN_Q_OVERFLOW) { d->rescan = TRUE; pathFlush(&r->paths); continue; }
+            if (ev->wd != d->wd) { // a handle's watch, one going away after a flush needs nothing
+                if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) { pathFlush(&r->paths); }
+                continue;
+            }
+            if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) { d->rescan = TRUE; continue; }
+            if (d->rescan || ev->len == 0 || (ev->mask & IN_ISDIR) || isPutTemp(ev->name)) { continue; }
+
+            off = dirFind(d, ev->name);
+            if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+                // a file renamed over another one is already listed, and only regular files are listed
+                if (off != -1 || fstatat(rootFd, ev->name, &st, AT_SYMLINK_NOFOLLOW) == -1 || !S_ISREG(st.st_mode)) { continue; }
+                if (dirAppend(d, ev->name) == -1) { d->rescan = TRUE; }
+            } else if (off != -1) {
+                n = strlen(ev->name) + 1;
+                memmove(d->names + off, d->names + off + n, d->len - off - n);
+                d->len -= n;
+                d->count--;
+                d->gen = __atomic_add_fetch(&dirGens, 1, __ATOMIC_RELAXED);
+                dirDrop(d);
+            }
+        }
+    }
+}
+
+// Name: dirListing()
+// Desc: Gets the directory listing to send, built from the index only when it changed.
+// Arg : r - the reactor owning the index.
+// Pre : dirInit() was called.
+// Post: The caller holds a reference to the listing and gives it back with listingPut().
+// Rtrn: The listing, or NULL if the directory could not be read.
+struct listing* dirListing(struct reactor* r) {
+
+    struct dirIndex* d = &r->dir;
+    struct listing* l;
+
+    if ((d->rescan || d->w.fd == -1) && dirScan(d, rootFd) == -1) { return NULL; }
+    if (d->w.fd == -1) { dirDrop(d); } // nothing tells us when it goes stale
+
+    if (d->cached == NULL) {
+        // If there were no regular files in the directory just put a blank
+        if ((l = malloc(sizeof(*l) + (d->len ? d->len : 1))) == NULL) { return NULL; }
+        l->refs = 1;
+        l->len = d->len ? d->len : 1;
+        if (d->len) { memcpy(l->data, d->names, d->len); } else { l->data[0] = ' '; }
+        d->cached = l;
+        LOG(L_INFO, "Directory listing built: %d files, %lld bytes\n\n", d->count, l->len);
+    } else {
+        LOG(L_DEBUG, "Sending cached directory listing: %d files, %lld bytes\n\n", d->count, d->cached->len);
+    }
+
+    d->cached->refs++;
+    return d->cached;
+}
+
+// Name: dirPage()
+// Desc: Builds one page of the directory listing in a pass over the index.
+// Arg1: r - the reactor owning the index.
+// Arg2: dir - a directory under the root to list instead, or NULL for the root.
+// Arg3: start - the number of the index entry to start from.
+// Arg4: gen - the generation start was given in, 0 for none. Set to the generation of this page.
+// Arg5: limit - the most files to list, -1 for no limit.
+// Arg6: match - glob pattern the names must match, or NULL for every name.
+// Arg7: longFmt - TRUE to list the type, size and mtime (ns) before each name.
+// Arg8: next - where to store the number of the entry the next page starts at.
+// Arg9: buf - a pointer to the address of an uninitialized buffer to hold the page.
+// Pre : dirInit() was called.
+// Post: The page is stored in allocated memory in the buffer. Files created since are appended to the
+//       index, so a client asking from next later on gets only the new ones. A file deleted since,
+//       or another worker's index, would move the entries under start, so a start from another
+//       generation is refused rather than skipping names. Another directory is not indexed, it is
+//       scanned for each page into an index of its own and its generation is the directory's mtime.
+// Rtrn: The length of the page or -1 if there was an error, with errno ESTALE if gen is not current.
+long long dirPage(struct reactor* r, char* dir, long long start, unsigned long long* gen, long long limit, char* match, bool longFmt, long long* next, char** buf) {
+
+    struct dirIndex sub = { { 0 } };
+    struct dirIndex* d = &r->dir;
+    char name[NAME_MAX + 1];
+    char *p, *nl, *end;
+    long long len = 0, entry = 0, listed = 0, n;
+    unsigned long long cur;
+    struct stat st;
+    int fd = rootFd;
+
+    if (dir != NULL) {
+        d = &sub;
+        if ((fd = pathOpen(dir, O_PATH | O_DIRECTORY)) == -1 || dirScan(d, fd) == -1) {
+            if (fd != -1) { close(fd); }
+            free(d->names);
+            return -1;
+        }
+    } else if ((d->rescan || d->w.fd == -1) && dirScan(d, rootFd) == -1) {
+        return -1;
+    }
+    if (dir == NULL && d->w.fd != -1) {
+        cur = d->gen;
+    } else if (fstat(fd, &st) == -1) {
+        if (dir != NULL) { close(fd); free(d->names); }
+        return -1;
+    } else {
+        cur = MTIME_NS(st); // a scan is in readdir order, which only holds while nothing changes
+    }
+    if (*gen != 0 && *gen != cur) {
+        LOG(L_INFO, "Refusing page cursor of an older listing: %llu:%lld\n\n", *gen, start);
+        if (dir != NULL) { close(fd); free(d->names); }
+        errno = ESTALE;
+        return -1;
+    }
+    *gen = cur;
+
+    // no line is longer than its name plus the long format fields
+    if (((*buf) = malloc(d->len + (longFmt ? (long long)d->count * LONG_LINE : 0) + 1)) == NULL) {
+        if (dir != NULL) { close(fd); free(d->names); }
+        return -1;
+    }
+
+    end = d->names + d->len;
+    for (p = d->names; p < end && (limit == -1 || listed < limit); p = nl + 1, entry++) {
+        nl = memchr(p, '\n', end - p);
+        if (entry < start) { continue; }
+        n = nl - p;
+        memcpy(name, p, n);
+        name[n] = '\0';
+        if (match != NULL && fnmatch(match, name, 0) != 0) { continue; }
+
+        if (longFmt) {
+            if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1) { continue; } // gone since
+            len += sprintf((*buf) + len, "%c %lld %lld ", S_ISREG(st.st_mode) ? 'f' : '?',
+                           (long long)st.st_size, MTIME_NS(st));
+        }
+        memcpy((*buf) + len, name, n);
+        (*buf)[len + n] = '\n';
+        len += n + 1;
+        listed++;
+    }
+    (*next) = entry;
+    if (dir != NULL) { close(fd); free(d->names); }
+    LOG(L_INFO, "Directory page built: %lld files from entry %lld, next page at %lld\n\n", listed, start, entry);
+
+    return len;
+}
+
+// Name: dirDrop()
+// Desc: Drops the cached listing after the index changed.
+// Arg : d - the index.
+// Pre : None.
+// Post: The next listing is built again, transfers still sending the old one keep it until they finish.
+void dirDrop(struct dirIndex* d) {
+
+    if (d->cached != NULL) { listingPut(d->cached); d->cached = NULL; }
+}
+
+// Name: listingPut()
+// Desc: Gives back a reference to a directory listing.
+// Arg : l - the listing.
+// Pre : The caller holds a reference from dirListing().
+// Post: The listing is freed once nothing refers to it.
+void listingPut(struct listing* l) {
+
+    if (--l->refs == 0) { free(l); }
+}
+
+// Name: cacheFind()
+// Desc: Looks a file up in the file cache.
+// Arg1: name - the name of the file.
+// Arg2: b - the name's hash bucket.
+// Arg3: st - the file's status, as it is now.
+// Pre : The cache lock is held.
+// Post: An entry of the name that no longer matches the file is evicted.
+// Rtrn: The entry, or NULL on a miss.
+static struct cacheEntry* cacheFind(char* name, unsigned int b, struct stat* st) {
+
+    struct cacheEntry* e;
+
+    // a hit only counts if the file is still the one that was loaded
+    for (e = cache.table[b]; e != NULL; e = e->next) {
+        if (strcmp(e->name, name) != 0) { continue; }
+        if (e->dev == st->st_dev && e->ino == st->st_ino && e->size == st->st_size && e->mtime == MTIME_NS(*st)) { return e; }
+        cacheEvict(e); // changed on disk
+        break;
+    }
+    return NULL;
+}
+
+// Name: cacheFill()
+// Desc: Loads a file that missed into the file cache.
+// Arg1: name - the name of the file.
+// Arg2: b - the name's hash bucket.
+// Arg3: st - the status of the file that missed.
+// Pre : None.
+// Post: The file is read without the cache lock, so the other workers' hits do not wait for it; if
+//       another thread loaded the same file meanwhile its entry is used and this copy dropped.
+// Rtrn: The cache entry, with a reference held for the caller, or NULL if the file could not be loaded.
+static struct cacheEntry* cacheFill(char* name, unsigned int b, struct stat* st) {
+
+    struct cacheEntry *e = NULL, *hit, **link;
+    unsigned int crc;
+    char* data;
+    long long n;
+
+    if ((data = cacheLoad(name, st, &crc)) == NULL || (e = calloc(1, sizeof(*e))) == NULL || (e->name = strdup(name)) == NULL) {
+        LOG_ERRNO(L_WARN, "WARNING, loading file into cache\n\n");
+        if (data != NULL) { munmap(data, st->st_size); }
+        if (e != NULL) { free(e); }
+        return NULL;
+    }
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->size = st->st_size;
+    e->mtime = MTIME_NS(*st);
+    e->data = data;
+    e->crc = crc;
+    e->refs = 2; // the cache's and the caller's
+
+    pthread_mutex_lock(&cache.lock);
+    if ((hit = cacheFind(name, b, st)) != NULL) {
+        hit->used = TRUE;
+        hit->refs++;
+        e->refs = 1;
+        cacheRelease(e);
+        pthread_mutex_unlock(&cache.lock);
+        return hit;
+    }
+
+    // make room first
+    cacheTrim(st->st_size);
+    if (cache.count == cache.cap) {
+        n = cache.cap ? cache.cap * 2 : 64;
+        if ((link = realloc(cache.ring, n * sizeof(*link))) == NULL) {
+            e->refs = 1;
+            cacheRelease(e);
+            pthread_mutex_unlock(&cache.lock);
+            return NULL;
+        }
+        cache.ring = link;
+        cache.cap = n;
+    }
+    e->next = cache.table[b];
+    cache.table[b] = e;
+    e->slot = cache.count;
+    cache.ring[cache.count++] = e;
+    cache.bytes += e->size;
+    pthread_mutex_unlock(&cache.lock);
+    LOG(L_INFO, "File loaded into cache: %s (%lld of %lld bytes used)\n\n", name, cache.bytes, cfg.cacheSize);
+    return e;
+}
+
+// Name: loadRun()
+// Desc: Thread entry point that loads a file that missed into the file cache.
+// Arg : arg - the load, its slot in loads held for the thread.
+// Pre : cacheStart() started the thread.
+// Post: The file is cached unless it could not be read, and the load's slot is free again.
+// Rtrn: Nothing.
+static void* loadRun(void* arg) {
+
+    struct cacheMiss* m = arg;
+    struct cacheEntry* e;
+
+    if ((e = cacheFill(m->name, cacheHash(m->name) % CACHE_BUCKETS, &m->st)) != NULL) { cachePut(e); }
+    pthread_mutex_lock(&cache.lock);
+    free(m->name);
+    m->name = NULL;
+    pthread_mutex_unlock(&cache.lock);
+    return NULL;
+}
+
+// Name: cacheStart()
+// Desc: Starts loading a file that missed into the file cache on a thread of its own.
+// Arg1: name - the name of the file.
+// Arg2: st - the status of the file that missed.
+// Pre : None.
+// Post: A thread loads the file, unless it is being loaded already or LOAD_THREADS loads are under way,
+//       in which case a later miss tries again.
+static void cacheStart(char* name, struct stat* st) {
+
+    struct cacheMiss* m = NULL;
+    pthread_t thread;
+    pthread_attr_t attr;
+    int i;
+
+    pthread_mutex_lock(&cache.lock);
+    for (i = 0; i < LOAD_THREADS; i++) {
+        if (loads[i].name != NULL && strcmp(loads[i].name, name) == 0) { pthread_mutex_unlock(&cache.lock); return; }
+        if (loads[i].name == NULL && m == NULL) { m = &loads[i]; }
+    }
+    if (m != NULL && (m->name = strdup(name)) != NULL) {
+        m->st = *st;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&thread, &attr, loadRun, m) != 0) {
+            free(m->name);
+            m->name = NULL;
+        }
+        pthread_attr_destroy(&attr);
+    }
+    pthread_mutex_unlock(&cache.lock);
+}
+
+// Name: cacheGet()
+// Desc: Gets a file's contents from the file cache, loading the file into it on a miss.
+// Arg1: name - the name of the file.
+// Arg2: st - where to store the status of the file the entry was checked against.
+// Arg3: wait - TRUE to load a miss before returning, else it is loaded on a thread of its own.
+// Pre : --cache-size is set.
+// Post: The entry is marked recently used and the caller holds a reference, given back with cachePut().
+//       A hit costs one fstatat() of the name from the worker's handle of its directory, and no
+//       open or read. A miss not waited for never reads on the calling worker, the request is served
+//       from the file and the next one after the load finishes hits.
+// Rtrn: The cache entry, or NULL on a miss not waited for, or if the file is missing, empty, too big
+//       for the cache or unreadable.
+struct cacheEntry* cacheGet(char* name, struct stat* st, bool wait) {
+
+    struct cacheEntry* e;
+    unsigned int b;
+
+    if (pathStat(name, st) == -1 || !S_ISREG(st->st_mode) || st->st_size == 0 || st->st_size > cfg.cacheSize) { return NULL; }
+    b = cacheHash(name) % CACHE_BUCKETS;
+
+    pthread_mutex_lock(&cache.lock);
+    if ((e = cacheFind(name, b, st)) != NULL) {
+        e->used = TRUE;
+        e->refs++;
+        pthread_mutex_unlock(&cache.lock);
+        LOG(L_DEBUG, "Serving file from cache: %s\n\n", name);
+        return e;
+    }
+    pthread_mutex_unlock(&cache.lock);
+
+    if (wait) { return cacheFill(name, b, st); }
+    cacheStart(name, st);
+    return NULL;
+}
+
+// Name: cacheLoad()
+// Desc: Reads a file into read-only memory for the file cache.
+// Arg1: name - the name of the file.
+// Arg2: st - the status of the file the entry is keyed by.
+// Arg3: crc - where to store the CRC32C of the contents, taken as they are read.
+// Pre : None.
+// Post: The contents are copied into anonymous memory rather than mapping the file itself, so a file
+//       truncated while it is being sent can not fault the server. The file opened is checked to be
+//       the one st describes, so a file renamed over the name since is never cached as the old one.
+// Rtrn: The memory, freed with munmap(), or NULL if the file could not be read whole.
+char* cacheLoad(char* name, struct stat* st, unsigned int* crc) {
+
+    struct stat now;
+    char* data;
+    int file;
+    long long size = st->st_size, got = 0;
+    ssize_t n = 0;
+
+    if ((file = pathOpen(name, O_RDONLY)) == -1) { return NULL; }
+    if (fstat(file, &now) == -1) { close(file); return NULL; }
+    if (now.st_dev != st->st_dev || now.st_ino != st->st_ino || now.st_size != st->st_size || MTIME_NS(now) != MTIME_NS(*st)) {
+        close(file);
+        errno = ESTALE; // replaced since it was looked up
+        return NULL;
+    }
+    if ((data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+        close(file);
+        return NULL;
+    }
+    while (got < size) {
+        if ((n = pread(file, data + got, size - got, got)) == -1 && errno == EINTR) { continue; }
+        if (n <= 0) { break; } // error or the file shrank
+        (*crc) = crc32c(got ? *crc : 0, data + got, n);
+        got += n;
+    }
+    close(file);
+    if (got < size || mprotect(data, size, PROT_READ) == -1) {
+        if (n == 0) { errno = EIO; }
+        munmap(data, size);
+        return NULL;
+    }
+    return data;
+}
+
+// Name: cachePut()
+// Desc: Gives back a reference to a cache entry.
+// Arg : e - the entry.
+// Pre : The caller holds a reference from cacheGet().
+// Post: The entry's memory is freed once it has been evicted and no transfer is sending it.
+void cachePut(struct cacheEntry* e) {
+
+    pthread_mutex_lock(&cache.lock);
+    cacheRelease(e);
+    pthread_mutex_unlock(&cache.lock);
+}
+
+// Name: cacheEvict()
+// Desc: Removes an entry from the cache.
+// Arg : e - the entry.
+// Pre : The cache lock is held.
+// Post: The entry is out of the table and the clock, and freed unless a transfer is still sending it.
+void cacheEvict(struct cacheEntry* e) {
+
+    struct cacheEntry** link;
+
+    for (link = &cache.table[cacheHash(e->name) % CACHE_BUCKETS]; *link != e; link = &(*link)->next) {}
+    *link = e->next;
+
+    // the last entry of the clock takes the evicted one's slot
+    cache.ring[e->slot] = cache.ring[--cache.count];
+    cache.ring[e->slot]->slot = e->slot;
+    if (cache.hand >= cache.count) { cache.hand = 0; }
+    cache.bytes -= e->size + e->zlen;
+    LOG(L_INFO, "File evicted from cache: %s\n\n", e->name);
+    cacheRelease(e);
+}
+
+// Name: cacheTrim()
+// Desc: Evicts entries until there is room for more bytes within the --cache-size budget.
+// Arg : room - the bytes to make room for, 0 to only fit the budget after it shrank.
+// Pre : The cache lock is held.
+// Post: The clock hand evicted whatever it found unused, or everything if the budget is too small.
+void cacheTrim(long long room) {
+
+    struct cacheEntry* e;
+
+    while (cache.bytes + room > cfg.cacheSize && cache.count > 0) {
+        e = cache.ring[cache.hand];
+        if (e->used) { e->used = FALSE; cache.hand = (cache.hand + 1) % cache.count; continue; }
+        cacheEvict(e);
+    }
+}
+
+// Name: cacheNames()
+// Desc: Lists the names of the files in the cache, for a new process to load before it takes over.
+// Arg : buf - set to the names, one per line, freed by the caller.
+// Pre : None.
+// Post: None.
+// Rtrn: The length of the list, or -1 if out of memory.
+long long cacheNames(char** buf) {
+
+    long long len = 0;
+    int i;
+
+    pthread_mutex_lock(&cache.lock);
+    for (i = 0; i < cache.count; i++) { len += strlen(cache.ring[i]->name) + 1; }
+    if ((*buf = malloc(len + 1)) == NULL) { pthread_mutex_unlock(&cache.lock); return -1; }
+    for (len = 0, i = 0; i < cache.count; i++) { len += sprintf(*buf + len, "%s\n", cache.ring[i]->name); }
+    pthread_mutex_unlock(&cache.lock);
+    return len;
+}
+
+// Name: cacheRelease()
+// Desc: Drops a reference to a cache entry.
+// Arg : e - the entry.
+// Pre : The cache lock is held.
+// Post: The entry is freed when the last reference goes.
+void cacheRelease(struct cacheEntry* e) {
+
+    if (--e->refs > 0) { return; }
+    munmap(e->data, e->size);
+    free(e->zdata);
+    free(e->name);
+    free(e);
+}
+
+// Name: zipRun()
+// Desc: Thread entry point that compresses a cache entry's contents into zlib blocks.
+// Arg : arg - the entry, with a reference held for the thread.
+// Pre : cacheZip() started the thread.
+// Post: e->zdata holds the compressed contents, counted against the cache budget, which is
+//       trimmed to fit them. The thread's reference is given back.
+// Rtrn: Nothing.
+static void* zipRun(void* arg) {
+
+    struct cacheEntry* e = arg;
+    char* z = NULL;
+    long long zlen = zipBlocks(e->data, e->size, &z);
+
+    if (zlen != -1) { LOG(L_INFO, "Compressed copy cached: %s (%lld of %lld bytes)\n\n", e->name, zlen, e->size); }
+    pthread_mutex_lock(&cache.lock);
+    if (zlen != -1) {
+        e->zdata = z;
+        e->zlen = zlen;
+        if (e->slot < cache.count && cache.ring[e->slot] == e) { // still cached
+            cache.bytes += zlen;
+            cacheTrim(0);
+        }
+    }
+    e->zipping = FALSE;
+    zipping--;
+    cacheRelease(e);
+    pthread_mutex_unlock(&cache.lock);
+    return NULL;
+}
+
+// Name: cacheZip()
+// Desc: Gets the entry's contents as zlib blocks, which are compressed once for every client.
+// Arg : e - the entry.
+// Pre : The caller holds a reference from cacheGet().
+// Post: The first time, a thread starts compressing the contents, unless ZIP_THREADS others
+//       already are. The worker never waits for it, transfers until it is done compress as they
+//       send.
+// Rtrn: TRUE if e->zdata is there.
+bool cacheZip(struct cacheEntry* e) {
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    bool done;
+
+    pthread_mutex_lock(&cache.lock);
+    done = (e->zdata != NULL);
+    if (!done && !e->zipping && zipping < ZIP_THREADS) {
+        e->refs++;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&thread, &attr, zipRun, e) == 0) {
+            e->zipping = TRUE;
+            zipping++;
+        } else {
+            e->refs--;
+        }
+        pthread_attr_destroy(&attr);
+    }
+    pthread_mutex_unlock(&cache.lock);
+    return done;
+}
+
+// Name: cacheHash()
+// Desc: Hashes a filename for the cache table (FNV-1a).
+// Arg : name - the filename.
+// Pre : None.
+// Post: None.
+// Rtrn: The hash.
+unsigned int cacheHash(const char* name) {
+
+    unsigned int h = 2166136261u;
+
+    while (*name) { h = (h ^ (unsigned char)*name++) * 16777619u; }
+    return h;
+}
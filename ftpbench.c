@@ -0,0 +1,574 @@
+/*
+ * Name: ftpbench
+ * Auth: Andrew Swaim
+ * Date: November 2019
+ * Desc: Load generator for ftpserver. Runs N sessions at once, one thread each, every one
+ *       sending a mix of -l and -g requests in passive mode and throwing the data away as it
+ *       arrives. At the end it reports requests and bytes per second, the p50, p99 and p99.9
+ *       latency of a request (command sent to last byte received) and the CPU time the server
+ *       spent per GB sent, read from /proc for the server process given with --pid.
+ *
+ *       Fixed scenarios make runs comparable:
+ *       tiny  - 1000 files of 1 KB to 16 KB, 64 sessions, mostly -g
+ *       large - one 1 GB file, 4 sessions
+ *       dir   - 100000 empty files, 16 sessions, half of the requests listing the directory
+ *       --setup creates a scenario's files in the current directory, for the server to run in.
+ *       --files, --size, --sessions, --requests and --list override a scenario's numbers.
+ *       --tls runs every connection over TLS, each data connection resuming the session of its
+ *       control connection the way a real client would. The certificate is not checked.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <openssl/ssl.h>
+
+typedef enum { FALSE, TRUE } bool;   // bool type for C89/C99 compilation
+
+#define LINE_LEN 1024           // longest reply line read from the server
+#define RECV_LEN (1 << 20)      // each session's receive buffer, the data is thrown away
+#define FILL_LEN (1 << 20)      // bytes written at a time when creating a scenario's files
+#define NAME_FMT "bench.%06d"   // names of a scenario's files
+
+#define USAGE "USAGE: %s [--scenario tiny|large|dir] [--sessions N] [--requests N] [--list PCT]\n" \
+              "       [--files N] [--size LO[-HI]] [--pid PID] [--tls] host port\n" \
+              "       %s --setup tiny|large|dir [--files N] [--size LO[-HI]]\n\n"
+
+// The numbers a run is made of, a scenario gives all of them.
+struct scenario {
+    const char* name;
+    int files;              // files named bench.000000 on up
+    long long sizeLo;       // size of each file, drawn log-uniform between sizeLo and sizeHi
+    long long sizeHi;
+    int sessions;           // sessions run at once
+    int requests;           // requests each session sends
+    int listPct;            // percent of the requests that are -l, the rest are -g
+};
+
+// A connection to the server, with its TLS session under --tls.
+struct link {
+    int fd;
+    SSL* ssl;               // NULL without --tls
+};
+
+// One session's thread, and what it measured.
+struct session {
+    pthread_t thread;
+    int id;
+    unsigned int seed;      // rand_r() state, so every session picks its own files
+    double* lat;            // latency of each request (us)
+    int done;               // requests that completed
+    int failed;             // requests the server refused or that broke off
+    long long bytes;        // data bytes received
+    int resumed;            // data connections that resumed the control connection's TLS session
+    int moved;              // times a draining server asked the session to reconnect
+};
+
+struct scenario scenarios[] = {
+    { "tiny", 1000, 1 << 10, 16 << 10, 64, 200, 5 },
+    { "large", 1, 1LL << 30, 1LL << 30, 4, 2, 0 },
+    { "dir", 100000, 0, 0, 16, 20, 50 }
+};
+
+struct scenario sc;         // the scenario being run
+char* host;
+char* port;
+SSL_CTX* tlsCtx = NULL;     // NULL without --tls
+
+// function declarations
+void setup(void);
+void* sessionRun(void* arg);
+int request(struct session* s, struct link* ctrl, char* buf);
+int dial(struct link* l, const char* host, const char* port, struct link* resume);
+void hangUp(struct link* l);
+ssize_t recvSome(struct link* l, char* buf, int len);
+bool sendLine(struct link* l, const char* line);
+long long recvLine(struct link* l, char* buf, int len, int* extra);
+long long parseSize(char* str);
+long long serverCpu(int pid);
+int compareDouble(const void* a, const void* b);
+double nowUs(void);
+
+
+// Name: main()
+// Desc: Parses the options, then either creates a scenario's files or runs its sessions
+//       against the server and reports what they measured.
+// Arg1: argc - number of arguments.
+// Arg2: argv - the arguments.
+// Pre : For a run, the server is listening on host port in the directory set up for the scenario.
+// Post: The results are printed.
+// Rtrn: 0 if every request succeeded, 1 if not.
+int main(int argc, char *argv[]) {
+
+    struct session* sessions;
+    double start, secs, *lat;
+    long long bytes = 0, cpu0 = -1, cpu1 = -1, lo, hi;
+    int opt, i, j, pid = 0, done = 0, failed = 0, files = -1, sessionCount = -1, requests = -1, list = -1, resumed = 0, moved = 0;
+    bool setupOnly = FALSE, tls = FALSE;
+    char* scenario = "tiny";
+    char* size = NULL;
+    struct rusage ru;
+    static struct option opts[] = {
+        { "scenario", required_argument, NULL, 's' },
+        { "setup", required_argument, NULL, 'S' },
+        { "sessions", required_argument, NULL, 'n' },
+        { "requests", required_argument, NULL, 'r' },
+        { "list", required_argument, NULL, 'l' },
+        { "files", required_argument, NULL, 'f' },
+        { "size", required_argument, NULL, 'z' },
+        { "pid", required_argument, NULL, 'p' },
+        { "tls", no_argument, NULL, 'T' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    // Parse options
+    while ((opt = getopt_long(argc, argv, "s:S:n:r:l:f:z:p:T", opts, NULL)) != -1) {
+        switch (opt) {
+        case 'S': setupOnly = TRUE; // fall through
+        case 's': scenario = optarg; break;
+        case 'n': sessionCount = atoi(optarg); break;
+        case 'r': requests = atoi(optarg); break;
+        case 'l': list = atoi(optarg); break;
+        case 'f': files = atoi(optarg); break;
+        case 'z': size = optarg; break;
+        case 'p': pid = atoi(optarg); break;
+        case 'T': tls = TRUE; break;
+        default:
+            fprintf(stderr, USAGE, argv[0], argv[0]);
+            exit(1);
+        }
+    }
+    for (i = 0; i < (int)(sizeof(scenarios) / sizeof(scenarios[0])); i++) {
+        if (strcmp(scenarios[i].name, scenario) == 0) { sc = scenarios[i]; }
+    }
+    if (sc.name == NULL) {
+        fprintf(stderr, "ERROR, invalid scenario: %s\n\n", scenario);
+        exit(1);
+    }
+    if (files != -1) { sc.files = files; }
+    if (sessionCount != -1) { sc.sessions = sessionCount; }
+    if (requests != -1) { sc.requests = requests; }
+    if (list != -1) { sc.listPct = list; }
+    if (size != NULL) {
+        char* dash = strchr(size, '-');
+        if (dash != NULL) { *dash = '\0'; }
+        lo = parseSize(size);
+        hi = (dash != NULL) ? parseSize(dash + 1) : lo;
+        if (lo < 0 || hi < lo) {
+            fprintf(stderr, "ERROR, invalid size: %s\n\nUse a size like 4K or a range like 1K-1M\n\n", size);
+            exit(1);
+        }
+        sc.sizeLo = lo; sc.sizeHi = hi;
+    }
+    if (sc.files < 1 || sc.sessions < 1 || sc.requests < 1 || sc.listPct < 0 || sc.listPct > 100) {
+        fprintf(stderr, "ERROR, files, sessions and requests must be at least 1 and --list a percent\n\n");
+        exit(1);
+    }
+    if (setupOnly) {
+        setup();
+        return 0;
+    }
+    if (argc - optind != 2) {
+        fprintf(stderr, USAGE, argv[0], argv[0]);
+        exit(1);
+    }
+    host = argv[optind];
+    port = argv[optind + 1];
+    if (tls && ((tlsCtx = SSL_CTX_new(TLS_client_method())) == NULL)) {
+        fprintf(stderr, "ERROR, setting up TLS\n\n");
+        exit(1);
+    }
+
+    // Run every session at once
+    printf("Scenario %s: %d sessions x %d requests, %d%% listings, %d files of %lld-%lld bytes\n\n",
+           sc.name, sc.sessions, sc.requests, sc.listPct, sc.files, sc.sizeLo, sc.sizeHi);
+    if ((sessions = calloc(sc.sessions, sizeof(*sessions))) == NULL ||
+        (lat = malloc(sizeof(*lat) * sc.sessions * sc.requests)) == NULL) {
+        perror("ERROR, allocating sessions\n\n");
+        exit(1);
+    }
+    if (pid > 0 && (cpu0 = serverCpu(pid)) == -1) {
+        fprintf(stderr, "WARNING, cannot read CPU time of process %d\n\n", pid);
+    }
+    start = nowUs();
+    for (i = 0; i < sc.sessions; i++) {
+        sessions[i].id = i;
+        sessions[i].seed = i + 1;
+        sessions[i].lat = lat + (long long)i * sc.requests;
+        if (pthread_create(&sessions[i].thread, NULL, sessionRun, &sessions[i]) != 0) {
+            perror("ERROR, starting session\n\n");
+            exit(1);
+        }
+    }
+    for (i = 0; i < sc.sessions; i++) { pthread_join(sessions[i].thread, NULL); }
+    secs = (nowUs() - start) / 1e6;
+    if (cpu0 != -1) { cpu1 = serverCpu(pid); }
+
+    // Gather the latencies of the requests that completed
+    for (i = 0; i < sc.sessions; i++) {
+        for (j = 0; j < sessions[i].done; j++) { lat[done++] = sessions[i].lat[j]; }
+        failed += sessions[i].failed;
+        bytes += sessions[i].bytes;
+        resumed += sessions[i].resumed;
+        moved += sessions[i].moved;
+    }
+    qsort(lat, done, sizeof(*lat), compareDouble);
+
+    // Report
+    printf("Requests: %d ok, %d failed in %.2f s (%.0f requests/s)\n", done, failed, secs, done / secs);
+    printf("Throughput: %lld bytes (%.1f MB/s)\n", bytes, bytes / 1e6 / secs);
+    if (done > 0) {
+        printf("Latency: p50 %.0f us, p99 %.0f us, p99.9 %.0f us, max %.0f us\n",
+               lat[(int)(done * 0.5)], lat[(int)(done * 0.99)], lat[(int)(done * 0.999)], lat[done - 1]);
+    }
+    if (tlsCtx != NULL) { printf("TLS: %d of %d data connections resumed a session\n", resumed, done); }
+    if (moved > 0) { printf("Reconnects: %d sessions moved off a draining server\n", moved); }
+    if (cpu1 != -1 && bytes > 0) {
+        printf("Server CPU: %.2f s (%.3f s per GB)\n", cpu1 / 1000.0, cpu1 == cpu0 ? 0.0 : (cpu1 - cpu0) / 1000.0 / (bytes / 1e9));
+    }
+    getrusage(RUSAGE_SELF, &ru);
+    printf("Bench CPU: %.2f s\n\n", ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6);
+
+    free(lat);
+    free(sessions);
+    return failed > 0;
+}
+
+// Name: setup()
+// Desc: Creates the scenario's files in the current directory.
+// Pre : The options were parsed into sc.
+// Post: bench.000000 on up exist with sizes drawn the way a run expects them, files that
+//       already have their size are left alone so a second setup is quick.
+void setup(void) {
+
+    static char fill[FILL_LEN];
+    unsigned int seed = 1;
+    char name[64];
+    long long size, left;
+    ssize_t n;
+    struct stat st;
+    int i, fd;
+
+    for (i = 0; i < FILL_LEN; i++) { fill[i] = rand_r(&seed); } // not all zeros, so nothing compresses it away
+    for (i = 0; i < sc.files; i++) {
+        sprintf(name, NAME_FMT, i);
+        size = (sc.sizeHi > sc.sizeLo && sc.sizeLo > 0) ?
+               (long long)exp(log(sc.sizeLo) + (log(sc.sizeHi) - log(sc.sizeLo)) * rand_r(&seed) / RAND_MAX) : sc.sizeLo;
+        if (stat(name, &st) == 0 && st.st_size == size) { continue; }
+        if ((fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+            perror("ERROR, creating file\n\n");
+            exit(1);
+        }
+        for (left = size; left > 0; left -= n) {
+            if ((n = write(fd, fill, left < FILL_LEN ? left : FILL_LEN)) == -1) {
+                perror("ERROR, writing file\n\n");
+                exit(1);
+            }
+        }
+        close(fd);
+    }
+    printf("Scenario %s: %d files ready\n\n", sc.name, sc.files);
+}
+
+// Name: sessionRun()
+// Desc: Thread entry point of a session, sends its requests one after another on one control connection.
+// Arg : arg - the session.
+// Pre : host and port are set.
+// Post: The session's counters and latencies are filled in.
+// Rtrn: Nothing.
+void* sessionRun(void* arg) {
+
+    struct session* s = arg;
+    struct link ctrl;
+    char* buf;
+    double start;
+    int i, ret;
+
+    if ((buf = malloc(RECV_LEN)) == NULL || dial(&ctrl, host, port, NULL) == -1) {
+        fprintf(stderr, "ERROR, session %d could not connect to %s port %s\n\n", s->id, host, port);
+        s->failed = sc.requests;
+        free(buf);
+        return NULL;
+    }
+    for (i = 0; i < sc.requests; i++) {
+        start = nowUs();
+        while ((ret = request(s, &ctrl, buf)) == 1) {
+            // the server is draining, the request goes again on a new session
+            hangUp(&ctrl);
+            s->moved++;
+            if (dial(&ctrl, host, port, NULL) == -1) { ret = -1; break; }
+        }
+        if (ret == -1) {
+            s->failed += sc.requests - i; // the control connection is gone with the request
+            break;
+        }
+        s->lat[s->done++] = nowUs() - start;
+    }
+    if (i == sc.requests) { sendLine(&ctrl, "QUIT\n"); }
+    hangUp(&ctrl);
+    free(buf);
+    return NULL;
+}
+
+// Name: request()
+// Desc: Sends one -l or -g request in passive mode and receives its data.
+// Arg1: s - the session.
+// Arg2: ctrl - the session's control connection.
+// Arg3: buf - RECV_LEN bytes to receive the data into.
+// Pre : The control connection is open and idle.
+// Post: The data is received and acknowledged, and counted in the session.
+// Rtrn: 0 on success, 1 if the server asked to reconnect without serving it, -1 if the session
+//       cannot go on.
+int request(struct session* s, struct link* ctrl, char* buf) {
+
+    char line[LINE_LEN], dataPort[16];
+    long long len, got;
+    ssize_t n;
+    struct link data;
+    int extra;
+
+    if ((int)(rand_r(&s->seed) % 100) < sc.listPct) {
+        strcpy(line, "-l PASV\n");
+    } else {
+        sprintf(line, "-g " NAME_FMT " PASV\n", (int)(rand_r(&s->seed) % sc.files));
+    }
+    if (!sendLine(ctrl, line) || recvLine(ctrl, line, sizeof(line), NULL) == -1) { return -1; }
+    if (strcmp(line, "RECONNECT") == 0) { return 1; }
+    if (strncmp(line, "OK ", 3) != 0 || sscanf(line + 3, "%15s", dataPort) != 1) {
+        fprintf(stderr, "ERROR, session %d request refused: %s\n\n", s->id, line);
+        s->failed++;
+        return 0;
+    }
+
+    // The length line comes first on the data connection, the data right behind it
+    if (dial(&data, host, dataPort, ctrl) == -1) { return -1; }
+    if (data.ssl != NULL && SSL_session_reused(data.ssl)) { s->resumed++; }
+    if ((len = recvLine(&data, buf, RECV_LEN, &extra)) == -1) { hangUp(&data); return -1; }
+    len = strtoll(buf, NULL, 10);
+    for (got = extra; got < len; got += n) {
+        if ((n = recvSome(&data, buf, RECV_LEN)) <= 0) {
+            if (n == -1 && errno == EINTR) { n = 0; continue; }
+            hangUp(&data);
+            return -1;
+        }
+    }
+    hangUp(&data);
+    s->bytes += len;
+    return sendLine(ctrl, "OK\n") ? 0 : -1;
+}
+
+// Name: dial()
+// Desc: Opens a TCP connection, and its TLS session under --tls.
+// Arg1: l - filled with the connection.
+// Arg2: host - host name or IP to connect to.
+// Arg3: port - port to connect to.
+// Arg4: resume - the connection whose TLS session to resume, or NULL for a full handshake.
+// Pre : None.
+// Post: The connection has Nagle off, replies and acks are small.
+// Rtrn: The connected socket, or -1 if it could not connect.
+int dial(struct link* l, const char* host, const char* port, struct link* resume) {
+
+    struct addrinfo hints, *res, *p;
+    SSL_SESSION* sess;
+    int fd = -1, one = 1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0) { return -1; }
+    for (p = res; p != NULL; p = p->ai_next) {
+        if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) { continue; }
+        if (connect(fd, p->ai_addr, p->ai_addrlen) == 0) { break; }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    l->fd = fd;
+    l->ssl = NULL;
+    if (fd == -1) { return -1; }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (tlsCtx == NULL) { return fd; }
+
+    // the control connection's session is resumable once its ticket arrived with the first reply
+    if ((l->ssl = SSL_new(tlsCtx)) == NULL || SSL_set_fd(l->ssl, fd) != 1) { hangUp(l); return -1; }
+    if (resume != NULL && (sess = SSL_get1_session(resume->ssl)) != NULL) {
+        SSL_set_session(l->ssl, sess);
+        SSL_SESSION_free(sess);
+    }
+    if (SSL_connect(l->ssl) != 1) { hangUp(l); return -1; }
+    return fd;
+}
+
+// Name: hangUp()
+// Desc: Closes a connection.
+// Arg : l - the connection.
+// Pre : dial() opened it.
+// Post: The TLS session is freed and the socket closed. A session freed without a close_notify
+//       would be taken as broken and never resumed again.
+void hangUp(struct link* l) {
+
+    if (l->ssl != NULL) {
+        SSL_shutdown(l->ssl);
+        SSL_free(l->ssl);
+        l->ssl = NULL;
+    }
+    if (l->fd != -1) { close(l->fd); l->fd = -1; }
+}
+
+// Name: recvSome()
+// Desc: recv() on a connection, through its TLS session if it has one.
+// Arg1: l - the connection.
+// Arg2: buf - where to receive.
+// Arg3: len - the size of buf.
+// Pre : The connection is open.
+// Post: See recv().
+// Rtrn: The bytes received, 0 if the server closed the connection, or -1 on error.
+ssize_t recvSome(struct link* l, char* buf, int len) {
+
+    size_t n;
+
+    if (l->ssl == NULL) { return recv(l->fd, buf, len, 0); }
+    if (SSL_read_ex(l->ssl, buf, len, &n) == 1) { return n; }
+    return (SSL_get_error(l->ssl, 0) == SSL_ERROR_ZERO_RETURN) ? 0 : -1;
+}
+
+// Name: sendLine()
+// Desc: Sends a whole line on a connection.
+// Arg1: l - the connection.
+// Arg2: line - the line, ending in a newline.
+// Pre : The connection is open.
+// Post: The line is sent.
+// Rtrn: TRUE on success, FALSE if the connection failed.
+bool sendLine(struct link* l, const char* line) {
+
+    size_t len = strlen(line), off;
+    ssize_t n;
+
+    if (l->ssl != NULL) { return SSL_write_ex(l->ssl, line, len, &off) == 1; } // blocking, all or nothing
+    for (off = 0; off < len; off += n) {
+        if ((n = send(l->fd, line + off, len - off, MSG_NOSIGNAL)) == -1) {
+            if (errno == EINTR) { n = 0; continue; }
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+// Name: recvLine()
+// Desc: Receives a line, the server sends every reply and length as one line.
+// Arg1: l - the connection.
+// Arg2: buf - where to receive it, holds the line without its newline.
+// Arg3: len - the size of buf.
+// Arg4: extra - with NULL the line is read a byte at a time so nothing past it is taken off the
+//       connection, else it is read in blocks and set to how many bytes came after the line.
+// Pre : The connection is open.
+// Post: The line ends in a NUL where the newline was.
+// Rtrn: The length of the line, or -1 if the connection failed or the line is too long.
+long long recvLine(struct link* l, char* buf, int len, int* extra) {
+
+    char* nl;
+    ssize_t n;
+    int got = 0;
+
+    while (got < len - 1) {
+        if ((n = recvSome(l, buf + got, extra == NULL ? 1 : len - 1 - got)) <= 0) {
+            if (n == -1 && errno == EINTR) { continue; }
+            return -1;
+        }
+        got += n;
+        buf[got] = '\0';
+        if ((nl = strchr(buf + got - n, '\n')) != NULL) {
+            *nl = '\0';
+            if (extra != NULL) { *extra = got - (nl + 1 - buf); }
+            return nl - buf;
+        }
+    }
+    return -1;
+}
+
+// Name: parseSize()
+// Desc: Parses a size in bytes with an optional K, M or G suffix.
+// Arg : str - the size string, like 65536 or 1M.
+// Pre : None.
+// Post: None.
+// Rtrn: The size in bytes, or -1 if the string is not a size.
+long long parseSize(char* str) {
+
+    char* end;
+    long long size = strtoll(str, &end, 10);
+
+    if (end == str || size < 0) { return -1; }
+    switch (*end) {
+    case 'k': case 'K': size <<= 10; end++; break;
+    case 'm': case 'M': size <<= 20; end++; break;
+    case 'g': case 'G': size <<= 30; end++; break;
+    }
+    return (*end == '\0') ? size : -1;
+}
+
+// Name: serverCpu()
+// Desc: Gets the CPU time a process has used, user and system, from /proc/PID/stat.
+// Arg : pid - the process.
+// Pre : None.
+// Post: None.
+// Rtrn: The CPU time in milliseconds, or -1 if it cannot be read.
+long long serverCpu(int pid) {
+
+    char path[64], buf[LINE_LEN];
+    unsigned long long utime, stime;
+    char* p;
+    FILE* f;
+    size_t n;
+
+    sprintf(path, "/proc/%d/stat", pid);
+    if ((f = fopen(path, "r")) == NULL) { return -1; }
+    n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+
+    // the command name can hold spaces, the fields are counted from the ) after it
+    if ((p = strrchr(buf, ')')) == NULL ||
+        sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2) {
+        return -1;
+    }
+    return (long long)((utime + stime) * 1000 / sysconf(_SC_CLK_TCK));
+}
+
+// Name: compareDouble()
+// Desc: qsort() comparison of two doubles, smallest first.
+// Arg1: a - the first.
+// Arg2: b - the second.
+// Rtrn: Less than, equal to or greater than 0 as a is below, equal to or above b.
+int compareDouble(const void* a, const void* b) {
+
+    double x = *(const double*)a, y = *(const double*)b;
+
+    return (x > y) - (x < y);
+}
+
+// Name: nowUs()
+// Desc: Gets the current time of the monotonic clock.
+// Rtrn: The time in microseconds.
+double nowUs(void) {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
@@ -7,502 +7,437 @@
  *       client to send the servers directory contents or a specific file's contents.
  *       If successful, the server will then open a second TCP data connection to send
  *       the data on to client.
+ *
+ *       This file holds the startup: the options from the command line and --config, the
+ *       globals every module shares, and the workers and helper threads it starts. The
+ *       features are described in README.md and each module's header.
  */
 
-#include <stdio.h>
-#include <stdlib.h>
-#include <unistd.h>
-#include <string.h>
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <netdb.h>
-#include <signal.h>
-#include <dirent.h>
-
-typedef enum { FALSE, TRUE } bool;   // bool type for C89/C99 compilation
-
-#define BUF_LEN 128
-
-/*
- * Declarations
- */
-int startup(char* port);
-int ctrlListen(char* port);
-int dataConnect(char* host, char* port);
-void handleRequest(int ctrlConn, char* host); 
-int getDir(char** buf);
-int getFile(char** buf, char *name);
-int sendAll(int conn, char* str, int len);
-void* getInAddr(struct sockaddr *client);
-void bye(int signum);
+#include "ftpserver.h"
+
+struct config cfg = { NULL, SOMAXCONN, 1, T_SENDFILE, CHUNK_SIZE, PASV_POOL, 0, 0, 0, Z_DEFAULT_COMPRESSION, L_INFO, NULL,
+                      0, 0, TRUE, TRUE, NULL, 0, 0, QUANTUM, 0, 0, 0, 0, 0, NULL, NULL, ".",
+                      NULL, DRAIN_TIMEOUT, NULL };
+struct config cfgArgs;      // the defaults and the command line without --config, what a reload starts from
+struct fileCache cache = { PTHREAD_MUTEX_INITIALIZER };
+struct ipTable ipTable = { PTHREAD_MUTEX_INITIALIZER };
+long long globalTat = 0;    // the --max-rate bucket
+int admitted = 0;           // sessions holding a --max-sessions slot
+SSL_CTX* tlsCtx = NULL;     // shared by every worker, NULL without --tls-cert
+struct tlsFd* tlsFds = NULL; // the TLS state of each socket, by descriptor
+int tlsMax = 0;             // size of tlsFds
+unsigned int crcTable[256]; // software CRC32C, one byte at a time
+bool crcHw = FALSE;         // the CPU has the SSE4.2 crc32 instruction
+struct worker* workerList;  // every worker, for the logger and the statistics
+__thread struct logRing* logMine = NULL; // the calling worker's log ring
+__thread struct pathCache* pathMine = NULL; // the calling worker's directory handles
+int rootFd = -1;            // the --root directory
+bool haveOpenat2 = TRUE;    // the kernel has openat2() and RESOLVE_BENEATH
+bool draining = FALSE;      // SIGINT, SIGTERM or a handoff started a drain
+long long drainDeadline = 0; // when the drain cuts off the transfers still going (ms)
+int metricsSock = -1;       // the --metrics-port listener, -1 without one
+static char* configText = NULL; // the --config file as read at startup, its string options point into it
+
+// the long options, also the names of the settings in a --config file
+#define OPTSTRING "b:w:t:c:p:P:C:z:L:M:S:R:B:N:K:G:W:F:q:l:i:m:x:T:k:r:f:d:H:"
+static struct option opts[] = {
+    { "backlog", required_argument, NULL, 'b' },
+    { "workers", required_argument, NULL, 'w' },
+    { "transfer", required_argument, NULL, 't' },
+    { "chunk-size", required_argument, NULL, 'c' },
+    { "pasv-pool", required_argument, NULL, 'p' },
+    { "pasv-ports", required_argument, NULL, 'P' },
+    { "cache-size", required_argument, NULL, 'C' },
+    { "compress-level", required_argument, NULL, 'z' },
+    { "log-level", required_argument, NULL, 'L' },
+    { "metrics-port", required_argument, NULL, 'M' },
+    { "sndbuf", required_argument, NULL, 'S' },
+    { "rcvbuf", required_argument, NULL, 'R' },
+    { "bdp", required_argument, NULL, 'B' },
+    { "nodelay", required_argument, NULL, 'N' },
+    { "cork", required_argument, NULL, 'K' },
+    { "congestion", required_argument, NULL, 'G' },
+    { "notsent-lowat", required_argument, NULL, 'W' },
+    { "fastopen", required_argument, NULL, 'F' },
+    { "quantum", required_argument, NULL, 'q' },
+    { "session-rate", required_argument, NULL, 'l' },
+    { "ip-rate", required_argument, NULL, 'i' },
+    { "max-rate", required_argument, NULL, 'm' },
+    { "max-sessions", required_argument, NULL, 'x' },
+    { "tls-cert", required_argument, NULL, 'T' },
+    { "tls-key", required_argument, NULL, 'k' },
+    { "root", required_argument, NULL, 'r' },
+    { "config", required_argument, NULL, 'f' },
+    { "drain-timeout", required_argument, NULL, 'd' },
+    { "handoff", required_argument, NULL, 'H' },
+    { NULL, 0, NULL, 0 }
+};
 
 /*
  * Main
  */
 int main(int argc, char *argv[]) {
 
-    int port, sock, conn;
-    struct sockaddr_storage client;
-    socklen_t clientSize;
-    char clientHost[INET6_ADDRSTRLEN];
+    int port, opt, i;
+    struct worker* workers;
+    pthread_t logger, metrics;
+    // Parse options, then the --config file, which has the last word
+    while ((opt = getopt_long(argc, argv, OPTSTRING, opts, NULL)) != -1) {
+        if (!setOption(&cfg, opt, optarg)) {
+            if (opt == '?') { fprintf(stderr, USAGE, argv[0]); }
+            exit(1);
+        }
+    }
+    cfgArgs = cfg;
+    if (cfg.config != NULL && (configText = readConfig(&cfg, cfg.config)) == NULL) { exit(1); }
 
     // Validate num of command line args
-    if (argc != 2) {
-        fprintf(stderr, "USAGE: %s port\n\n", argv[0]); 
+    if (argc - optind != 1) {
+        fprintf(stderr, USAGE, argv[0]);
         exit(1);
     }
+    cfg.port = argv[optind];
+
     // Validate port num
-    port = atoi(argv[1]);
+    port = atoi(cfg.port);
     if (port < 1024 || port > 65535) {
-        fprintf(stderr, "ERROR, invalid port: %d\n\nUse a port between 1024 and 65535", port); 
+        fprintf(stderr, "ERROR, invalid port: %d\n\nUse a port between 1024 and 65535", port);
         exit(1);
     }
     if (port < 50000) {
         printf("WARNING, recommended to use port number above 50000\n\n");
     }
 
-    sock = startup(argv[1]);
+    if ((workers = calloc(cfg.workers, sizeof(*workers))) == NULL) {
+        perror("ERROR, allocating workers\n\n");
+        exit(1);
+    }
+    workerList = workers;
+    startup(cfg.port, workers);
 
     printf("Welcome to ftpserver! (press CTRL-C at any time to exit)\n\n");
-    while (1) {
-        printf("Waiting for connection...\n\n");
-
-        // Accept client connection.
-        clientSize = sizeof(client);
-        if ((conn = accept(sock, (struct sockaddr *)&client, &clientSize)) == -1) {
-            perror("ERROR, accepting client connection\n\n");
-            continue;
+    printf("Waiting for connections on %d worker(s)...\n\n", cfg.workers);
+    fflush(stdout); // from here on the logger thread writes the output
+    if (cfg.logLevel != L_OFF && pthread_create(&logger, NULL, logRun, NULL) != 0) {
+        perror("ERROR, starting logger\n\n");
+        exit(1);
+    }
+    if (cfg.metricsPort != NULL && pthread_create(&metrics, NULL, metricsRun, NULL) != 0) {
+        perror("ERROR, starting metrics endpoint\n\n");
+        exit(1);
+    }
+    for (i = 1; i < cfg.workers; i++) {
+        if (pthread_create(&workers[i].thread, NULL, workerRun, &workers[i]) != 0) {
+            perror("ERROR, starting worker\n\n");
+            exit(1);
         }
-        printf("Client connection established!\n\n");
-
-        // get the client host
-        inet_ntop(client.ss_family, getInAddr((struct sockaddr*)&client), clientHost, sizeof(clientHost));
-        printf("Client host: %s\n\n", clientHost);
-
-        handleRequest(conn, clientHost);
-        close(conn);
-        printf("Client connection closed.\n\n");
     }
+    handoffListen(&workers[0].r);
+    workerRun(&workers[0]); // the main thread is the first worker
 
-    perror("ERROR: program did not exit normally\n\n");
-    return -1;
+    // it only returns once a drain is over, and the other workers end with it
+    for (i = 1; i < cfg.workers; i++) { pthread_join(workers[i].thread, NULL); }
+    bye(0);
+    return 0;
 }
 
-/*
- * Definitions
- */
-
 // Name: startup()
-// Desc: Setups up the SIGINT signal handler the control connection listener
-// Arg : port - the port number to setup the control connection on
+// Desc: Setups up the signal handlers and the control connection listener of every worker, taking
+//       the listeners over from the server running on the --handoff socket if there is one
+// Arg1: port - the port number to setup the control connection on
+// Arg2: workers - the workers to setup, cfg.workers of them
 // Pre : A port number is specified on the command line
-// Post: The signal handler is setup and the control connection is setup and listening
-// Rtrn: The socket file descriptor of the control connection
-int startup(char* port) {
+// Post: The signal handlers are setup, every worker's reactor is listening for control connections
+//       and the caches are warmed with what the old server had in them
+void startup(char* port, struct worker* workers) {
 
-    // Setup signal handler.
+    // Setup signal handler, until the workers are there to drain.
     // Signal handling from Beej's guide
     // on the page titled '3. Signals'
     // https://beej.us/guide/bgipc/html/multi/signals.html
     struct sigaction sa;
+    struct rlimit lim;
+    bool shard = (cfg.workers > 1), one = FALSE;
+    int socks[HANDOFF_FDS], extra[HANDOFF_FDS], sock = -1, inherited, i, j, n;
     sa.sa_handler = bye;
     sigemptyset(&sa.sa_mask);
     sa.sa_flags = 0;
     if (sigaction(SIGINT, &sa, NULL) == -1) { perror("sigaction"); exit(1); }
 
-    return ctrlListen(port);
-}
+    // A client that goes away mid transfer should only end its own connection.
+    sa.sa_handler = SIG_IGN;
+    if (sigaction(SIGPIPE, &sa, NULL) == -1) { perror("sigaction"); exit(1); }
 
-// Name: ctrlListen()
-// Desc: Gets the server info, sets up the socket, and tries to bind and listen on a port number.
-// Arg : The port number to try to bind and listen on.
-// Pre : A port number were declared on the command line and passed as the arg.
-// Post: The server either successfully binds, listens, and returns the socket file descriptor or exits.
-// Rtrn: The socket file descriptor for the connection.
-int ctrlListen(char *port) {
-    
-    // Socket setup and connection from Beej's guide
-    // in the section 'A Simple Stream Server'
-    // https://beej.us/guide/bgnet/html/#a-simple-stream-server
-    int sock, yes=1;
-    struct addrinfo addr, *serv, *ptr;
-
-    // setup server address struct
-    memset(&addr, 0, sizeof(addr));
-    addr.ai_family = AF_UNSPEC;
-    addr.ai_socktype = SOCK_STREAM;
-    addr.ai_flags = AI_PASSIVE;
-
-    // get address info of the server host
-    if (getaddrinfo(NULL, port, &addr, &serv) != 0) {
-        fprintf(stderr, "ERROR, could not get address info on port: %s\n\n", port);
-        exit(1);
+    // Every connection holds up to two sockets, allow as many as the system will.
+    if (getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur < lim.rlim_max) {
+        lim.rlim_cur = lim.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &lim);
     }
-
-    // loop through all possible connections and try to set socket options and bind.
-    for (ptr = serv; ptr != NULL; ptr = ptr->ai_next) {
-        
-        if ((sock = socket(ptr->ai_family, ptr->ai_socktype, ptr->ai_protocol)) >= 0) { // socket found
-            
-            if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
-                perror("ERROR, setting socket options\n\n"); exit(1); // critical error setting options
-            }
-            else if (bind(sock, ptr->ai_addr, ptr->ai_addrlen) == -1) {
-                close(sock); // if bind unsuccessful be sure to close socket.
-            }
-            else { break; } // setting socket options and binding successful - exit loop.
-        }
+    crcInit();
+    tuneCheck();
+    tlsInit();
+    pathInit();
+
+    // One listening socket per worker when the kernel can shard between them,
+    // otherwise a single socket that wakes only one worker per connection.
+    // A server already running on the --handoff socket gives its own sockets over instead.
+    inherited = handoffTake(socks, &shard);
+    for (i = 0; i < cfg.workers; i++) {
+        workers[i].id = i;
+        if (i < inherited) { sock = socks[i]; }
+        else if (shard || sock == -1) { sock = ctrlListen(port, &shard); } // joins the inherited ones
+        reactorInit(&workers[i].r, sock, cfg.workers > 1 && !shard);
     }
-    freeaddrinfo(serv); // not needed anymore
 
-    // If pointer looped to the end then binding was unsuccessful
-    if (ptr == NULL) {
-        fprintf(stderr, "ERROR, failed to bind socket on port: %s\n\n", port);
-        exit(1);
+    // an old server with more workers had more sockets, each one is served by one of the workers
+    for (i = 0; i < cfg.workers && inherited > cfg.workers; i++) {
+        for (n = 0, j = cfg.workers + i; j < inherited; j += cfg.workers) { extra[n++] = socks[j]; }
+        if (n > 0) { reactorAdopt(&workers[i].r, extra, n); }
     }
-
-    // Try to start listening
-    if (listen(sock, 1) == -1) {
-        fprintf(stderr, "ERROR, listening on port: %s\n\n", port);
-        exit(1);
+    if (inherited > cfg.workers) {
+        printf("%d inherited listening socket(s) more than the workers, served by them as well\n\n", inherited - cfg.workers);
     }
-
-    return sock;
-}
-
-// Name: dataConnect()
-// Desc: Gets the client info, sets up the socket, and tries to connect to the client.
-// Arg1: The host address of the client to try to connect to.
-// Arg2: The port number to try to connect to the client on.
-// Pre : A host name was extracted from the control connection, and a port number was supplied by the client.
-// Post: The server either successfully connects and returns the socket file descriptor or exits.
-// Rtrn: The socket file descriptor for the data connection.
-int dataConnect(char *host, char *port) {
-    
-    // Socket setup and connection from Beej's guide
-    // in the section 'A Simple Stream Client'
-    // https://beej.us/guide/bgnet/html/#a-simple-stream-client
-    int sock;
-    struct addrinfo addr, *serv, *ptr;
-
-    // setup server address struct
-    memset(&addr, 0, sizeof(addr));
-    addr.ai_family = AF_UNSPEC;
-    addr.ai_socktype = SOCK_STREAM;
-
-    // get address info of the server host
-    if (getaddrinfo(host, port, &addr, &serv) != 0) {
-        fprintf(stderr, "ERROR, could not get address info for host: %s port: %s\n\n", host, port);
-        return -1;
+    if (cfg.workers > 1 && !shard) {
+        printf("WARNING, SO_REUSEPORT not supported, workers share one listening socket\n\n");
     }
+    if (cfg.metricsPort != NULL && metricsSock == -1) { metricsSock = ctrlListen(cfg.metricsPort, &one); }
+    handoffWarm(workers);
 
-    // loop through all possible connections and try to connect
-    for (ptr = serv; ptr != NULL; ptr = ptr->ai_next) {
-        
-        if ((sock = socket(ptr->ai_family, ptr->ai_socktype, ptr->ai_protocol)) >= 0) {
-            
-            if (connect(sock, ptr->ai_addr, ptr->ai_addrlen) == -1) {
-                close(sock); // make sure to close connection if connect resulted in err
-            }
-            else { break; } // connection successful, exit loop
-        }
-    }
-    freeaddrinfo(serv); // not needed anymore
-
-    // If pointer looped to the end then connecting was unsuccessful
-    if (ptr == NULL) {
-        fprintf(stderr, "ERROR, failed to connect to host: %s on port: %s\n\n", host, port);
-        return -1;
+    // From here on the first SIGINT or SIGTERM drains the server and SIGHUP reloads --config
+    sa.sa_handler = onSignal;
+    if (sigaction(SIGINT, &sa, NULL) == -1 || sigaction(SIGTERM, &sa, NULL) == -1 || sigaction(SIGHUP, &sa, NULL) == -1) {
+        perror("sigaction");
+        exit(1);
     }
-
-    return sock;
 }
 
-// Name: handleRequest()
-// Desc: handles a command/request from the client
-// Arg1: ctrlConn - the socket file descriptor for the established control connection.
-// Arg2: host - the host name/IP 
-// Pre : The control connection is setup and the host IP address is obtained
-// Post: A request is received from the client and processed.
-void handleRequest(int ctrlConn, char* host) {
-
-    // Socket variables
-    int dataConn;
-    struct sockaddr_storage client;
-    socklen_t clientSize;
-
-    // command and message variables
-    char cmd[BUF_LEN];  // to hold the full command from the client
-    char name[BUF_LEN]; // to hold a filename
-    char* msg;
-    char lenStr[BUF_LEN];
-    int len;
-    char* token;
-
-    // response constant variables
-    const char CMD_OK[]  = "OK";
-    const char BAD_CMD[] = "INVALID COMMAND";
-    const char BAD_DIR[] = "ERROR READING DIRECTORY";
-    const char BAD_FIL[] = "FILE NOT FOUND";
-
-    // Get command
-    memset(cmd, '\0', sizeof(cmd));
-    if (recv(ctrlConn, cmd, sizeof(cmd)-1, 0) <= 0) {
-        perror("ERROR, receiving command from client\n\n");
-        return;
-    }
-    printf("Command received from client: %s\n\n", cmd);
-
-    // Parse command
-    token = strtok(cmd, " ");
-    printf("Handling flag: %s\n\n", token);
-    if (strcmp(token, "-l") == 0) { // get directory contents command
-
-        // Try to get the directory contents
-        if ((len = getDir(&msg)) == -1) {
-            
-            // error reading directory contents
-            printf("Sending ERROR READING DIRECTORY error to client...\n\n");
-            if (send(ctrlConn, BAD_DIR, sizeof(BAD_DIR)-1, 0) <= 0) {
-                perror("ERROR, ERROR READING DIRECTORY error not sent to client\n\n");
-            }
-            return;
+// Name: setOption()
+// Desc: Sets one option, from the command line or a --config file.
+// Arg1: c - the configuration to set it in.
+// Arg2: opt - the option's short name, as getopt_long() returns it.
+// Arg3: arg - the option's value.
+// Pre : None.
+// Post: The option is set if its value is valid, otherwise the error is printed.
+// Rtrn: TRUE if the option was set, FALSE if the value is invalid or the option unknown.
+bool setOption(struct config* c, int opt, char* arg) {
+
+    long long size;
+    double mbits, rttMs;
+
+    switch (opt) {
+    case 'b':
+        if ((c->backlog = atoi(arg)) < 1) {
+            fprintf(stderr, "ERROR, invalid backlog: %s\n\n", arg);
+            return FALSE;
         }
-
-    } else if (strcmp(token, "-g") == 0) { // get file contents command
-        
-        // Get the filename
-        token = strtok(NULL, " ");
-        memset(name, '\0', sizeof(name));
-        strcpy(name, token);
-
-        // Try to get the file contents
-        if ((len = getFile(&msg, name)) == -1) {
-
-            // could not find file to open
-            printf("Sending FILE NOT FOUND error to client...\n\n");
-            if (send(ctrlConn, BAD_FIL, sizeof(BAD_FIL)-1, 0) <= 0) {
-                perror("ERROR, FILE NOT FOUND error not sent to client\n\n");
-            }
-            return;
+        break;
+    case 'w':
+        // 0 means one worker per online core
+        if ((c->workers = atoi(arg)) < 0) {
+            fprintf(stderr, "ERROR, invalid number of workers: %s\n\n", arg);
+            return FALSE;
         }
-        
-        
-    } else { // invalid command
-        printf("Sending INVALID COMMAND error to client...\n\n");
-        if (send(ctrlConn, BAD_CMD, sizeof(BAD_CMD)-1, 0) <= 0) { 
-            perror("ERROR, INVALID COMMAND error not sent to client\n\n");
+        if (c->workers == 0) { c->workers = sysconf(_SC_NPROCESSORS_ONLN); }
+        break;
+    case 't':
+        if (strcmp(arg, "buffer") == 0) { c->transfer = T_BUFFER; }
+        else if (strcmp(arg, "sendfile") == 0) { c->transfer = T_SENDFILE; }
+        else if (strcmp(arg, "splice") == 0) { c->transfer = T_SPLICE; }
+        else if (strcmp(arg, "chunked") == 0) { c->transfer = T_CHUNKED; }
+        else if (strcmp(arg, "uring") == 0) { c->transfer = T_URING; }
+        else {
+            fprintf(stderr, "ERROR, invalid transfer mode: %s\n\n", arg);
+            return FALSE;
         }
-        return;
-    }
-
-    // command [and filename] good, send acknowledgment
-    printf("Command OK, sending acknowledgment to client...\n\n");
-    if (send(ctrlConn, CMD_OK, sizeof(CMD_OK)-1, 0) <= 0) {
-        perror("ERROR, OK response not sent to client\n\n");
-        return;
-    }
-    // Server is too fast, give client a chance to setup the data connection
-    sleep(2);
-
-    // Get the length of the message as a string
-    memset(lenStr, '\0', sizeof(lenStr));
-    sprintf(lenStr, "%d", len);
-    strcat(lenStr, "\n"); // finish with newline to mark end of string
-
-    // Get the port number and open data connection with client host
-    token = strtok(NULL, " ");
-    printf("Opening data connection with client: %s on port: %s\n\n", host, token);
-    if ((dataConn = dataConnect(host, token)) == -1) { return; } // Error connecting
-    printf("Data connection established!\n\n");
-
-    // Send buffer length and then buffer contents.
-    printf("Sending data length to client: %s\n", lenStr);
-    if (send(dataConn, lenStr, strlen(lenStr), 0) <= 0) {
-        perror("ERROR, could not send message length, aborting\n\n");
-        close(dataConn);
-        return;
-    }
-   
-    // Server too fast
-    sleep(2);
-
-    printf("Sending data to client...\n\n");
-    if (sendAll(dataConn, msg, len) < len) { 
-        perror("WARNING, entire message not sent\n\n"); 
-    }
-    printf("Transfer complete! Waiting for acknowledgment of receipt...\n\n");
-
-    // Get acknowledgment of receipt from client before closing
-    memset(cmd, '\0', sizeof(cmd));
-    if (recv(ctrlConn, cmd, sizeof(cmd)-1, 0) <= 0) {
-        perror("ERROR, getting acknowledgment back from client\n");
-    }
-    printf("Acknowledgment of receipt received: %s\n\nClosing connection...\n\n", cmd);
-
-    close(dataConn);
-    free(msg);
-}
-
-
-// Name: sendAll()
-// Desc: Handles the sending of a long message to the client.
-// Arg1: conn - the socket file descriptor to send the data on.
-// Arg2: str - the message string to send.
-// Arg3: len - the length of the message string to send.
-// Pre : A message is sent to the client (either a directory or file contents).
-// Post: The entire message up to the provided length is sent to the client.
-// Rtrn: The total length sent if successful, or -1 if an error is encountered.
-int sendAll(int conn, char *str, int len) {
-    
-    // Handling partial sends taken from Beej's guide
-    // in the section 'Handling Partial send()s'
-    // https://beej.us/guide/bgnet/html/#sendall
-    int total = 0;
-    int rem = len;
-    int n;
-
-    while (total < len) {
-        n = send(conn, str+total, rem, 0);
-        if (n == -1) { break; }
-        total += n;
-        rem -= n;
-    }
-
-    return ((n == -1) ? -1 : total);
-}
-
-// Name: get_in_addr()
-// Desc: Get an IPv4 or IPv6 address of a client using a sockaddr struct
-// Arg : client - the socket address struct containing information about the client.
-// Pre : A connection with the client is established and a sockaddr struct w/ client info is obatined.
-// Post: An IPv4 or IPv6 address of the client is obtained.
-// Rtrn: The IPv4 or IPv6 address of the client.
-void* getInAddr(struct sockaddr* client) {
-
-    // Getting IPv4 or IPv6 sockaddr rom Beej's guide 
-    // in the section 'A Simple Stream Server'
-    // https://beej.us/guide/bgnet/html/#a-simple-stream-server
-    if (client->sa_family == AF_INET) {
-        return &(((struct sockaddr_in*)client)->sin_addr);
-    }
-
-    return &(((struct sockaddr_in6*)client)->sin6_addr);
-}
-
-// Name: getDir()
-// Desc: Gets the list of files in the current working directory of the server.
-// Arg : buf - a pointer to the address of an  uninitialized buffer to hold the data.
-// Pre : A pointer to a buffer is declared and passed as an argument.
-// Post: The information about the directory is obtained and is stored in allocated memory in the buffer.
-// Rtrn: The size of the allocated buffer or -1 if there was an error.
-int getDir(char** buf) {
-
-    // Opening and ready directory contents from official manpage
-    // http://man7.org/linux/man-pages/man3/readdir.3.html
-    DIR* dir;
-    struct dirent* dirEnt;
-    int i = 0;
-    int count = 0; // number of file names
-    int size = 0; // total size of all filenames + newlines
-    char files[BUF_LEN][BUF_LEN]; // 2D array to hold file names before concatenation
-
-    printf("Opening directory to get contents...\n\n");
-    if ((dir = opendir(".")) == NULL) { 
-        perror("ERROR, opening current directory\n\n");
-        return -1; 
-    }
-
-    // Loop through the directory and get the names of the regular files.
-    while ((dirEnt = readdir(dir)) != NULL) {
-        if (dirEnt->d_type == DT_REG) {
-            memset(files[count], '\0', sizeof(files[count]));
-            strcpy(files[count], dirEnt->d_name);
-            size += strlen(files[count]);
-            size++; // to account for the newlines
-            count++;
+        break;
+    case 'c':
+        if ((size = parseSize(arg)) < 4096 || size > (1 << 30)) { // checked before it goes into an int
+            fprintf(stderr, "ERROR, invalid chunk size: %s\n\nUse a size between 4K and 1G\n\n", arg);
+            return FALSE;
         }
-    }
-    closedir(dir);
-    printf("Size of directory contents: %d\n\n", size);
-
-    // If there were no regular files in the directory just put a blank
-    if (size == 0) { (*buf) = " "; return 1; }
-    else {
-        // Append all the file names as one long string
-        (*buf) = malloc(sizeof(char) * (size+1)); 
-        
-        bool first = TRUE;
-        for (i = 0; i < count; i++) {
-            if (first) {
-                strcpy((*buf), files[i]);
-                strcat((*buf), "\n");
-                first = FALSE;
-            } else {
-                strcat((*buf), files[i]);
-                strcat((*buf), "\n");
-            }
+        c->chunkSize = size;
+        break;
+    case 'p':
+        if ((c->pasvPool = atoi(arg)) < 0) {
+            fprintf(stderr, "ERROR, invalid passive pool size: %s\n\n", arg);
+            return FALSE;
+        }
+        break;
+    case 'P':
+        if (sscanf(arg, "%d-%d", &c->pasvLo, &c->pasvHi) != 2
+                || c->pasvLo < 1024 || c->pasvHi > 65535 || c->pasvLo > c->pasvHi) {
+            fprintf(stderr, "ERROR, invalid passive port range: %s\n\n", arg);
+            return FALSE;
+        }
+        break;
+    case 'C':
+        if ((size = parseSize(arg)) == -1) {
+            fprintf(stderr, "ERROR, invalid cache size: %s\n\n", arg);
+            return FALSE;
+        }
+        c->cacheSize = size;
+        break;
+    case 'z':
+        if ((c->zlevel = atoi(arg)) < 0 || c->zlevel > 9) {
+            fprintf(stderr, "ERROR, invalid compression level: %s\n\nUse a level between 0 (off) and 9\n\n", arg);
+            return FALSE;
+        }
+        break;
+    case 'L':
+        if (strcmp(arg, "off") == 0) { c->logLevel = L_OFF; }
+        else if (strcmp(arg, "error") == 0) { c->logLevel = L_ERROR; }
+        else if (strcmp(arg, "warn") == 0) { c->logLevel = L_WARN; }
+        else if (strcmp(arg, "info") == 0) { c->logLevel = L_INFO; }
+        else if (strcmp(arg, "debug") == 0) { c->logLevel = L_DEBUG; }
+        else {
+            fprintf(stderr, "ERROR, invalid log level: %s\n\n", arg);
+            return FALSE;
+        }
+        break;
+    case 'M':
+        if (atoi(arg) < 1024 || atoi(arg) > 65535) {
+            fprintf(stderr, "ERROR, invalid metrics port: %s\n\n", arg);
+            return FALSE;
+        }
+        c->metricsPort = arg;
+        break;
+    case 'S':
+    case 'R':
+        if ((size = parseSize(arg)) < 4096 || size > (1 << 30)) {
+            fprintf(stderr, "ERROR, invalid socket buffer size: %s\n\nUse a size between 4K and 1G\n\n", arg);
+            return FALSE;
+        }
+        if (opt == 'S') { c->sndbuf = size; } else { c->rcvbuf = size; }
+        break;
+    case 'B':
+        // bandwidth-delay product: the bytes in flight that keep a path of that rate and round trip full
+        if (sscanf(arg, "%lf,%lf", &mbits, &rttMs) != 2 || mbits <= 0 || rttMs <= 0
+                || (size = mbits * 1e6 / 8 * rttMs / 1e3) > (1 << 30)) {
+            fprintf(stderr, "ERROR, invalid bandwidth-delay product: %s\n\nUse Mbit/s,ms like 1000,20\n\n", arg);
+            return FALSE;
+        }
+        c->sndbuf = c->rcvbuf = (size < 4096) ? 4096 : size;
+        break;
+    case 'N':
+    case 'K':
+        if (strcmp(arg, "on") != 0 && strcmp(arg, "off") != 0) {
+            fprintf(stderr, "ERROR, invalid --%s: %s\n\nUse on or off\n\n", opt == 'N' ? "nodelay" : "cork", arg);
+            return FALSE;
+        }
+        if (opt == 'N') { c->nodelay = (strcmp(arg, "on") == 0); } else { c->cork = (strcmp(arg, "on") == 0); }
+        break;
+    case 'G':
+        c->congestion = arg; // checked against the kernel at startup
+        break;
+    case 'W':
+        if ((size = parseSize(arg)) < 1 || size > (1 << 30)) {
+            fprintf(stderr, "ERROR, invalid unsent low water mark: %s\n\n", arg);
+            return FALSE;
+        }
+        c->notsentLowat = size;
+        break;
+    case 'F':
+        if ((c->fastopen = atoi(arg)) < 0) {
+            fprintf(stderr, "ERROR, invalid fast open queue length: %s\n\n", arg);
+            return FALSE;
+        }
+        break;
+    case 'q':
+        if ((size = parseSize(arg)) != 0 && (size < 4096 || size > (1 << 30))) {
+            fprintf(stderr, "ERROR, invalid quantum: %s\n\nUse 0 or a size between 4K and 1G\n\n", arg);
+            return FALSE;
+        }
+        c->quantum = size;
+        break;
+    case 'l':
+    case 'i':
+    case 'm':
+        if ((size = parseSize(arg)) != 0 && size < 1024) {
+            fprintf(stderr, "ERROR, invalid rate: %s\n\nUse 0 or bytes per second of at least 1K\n\n", arg);
+            return FALSE;
         }
-        (*buf)[size+1] = '\0';
+        if (opt == 'l') { c->sessionRate = size; } else if (opt == 'i') { c->ipRate = size; } else { c->maxRate = size; }
+        break;
+    case 'x':
+        if (sscanf(arg, "%d,%d", &c->maxSessions, &c->maxQueued) < 1 || c->maxSessions < 1 || c->maxQueued < 0) {
+            fprintf(stderr, "ERROR, invalid session limit: %s\n\nUse N or N,QUEUE\n\n", arg);
+            return FALSE;
+        }
+        break;
+    case 'T': c->tlsCert = arg; break; // loaded at startup
+    case 'k': c->tlsKey = arg; break;
+    case 'r': c->root = arg; break; // opened at startup
+    case 'f': c->config = arg; break; // read once the command line is parsed
+    case 'd':
+        if ((c->drainTimeout = atoi(arg)) < 0) {
+            fprintf(stderr, "ERROR, invalid drain timeout: %s\n\n", arg);
+            return FALSE;
+        }
+        break;
+    case 'H':
+        if (strlen(arg) >= sizeof(((struct sockaddr_un*)NULL)->sun_path)) {
+            fprintf(stderr, "ERROR, handoff socket path too long: %s\n\n", arg);
+            return FALSE;
+        }
+        c->handoff = arg;
+        break;
+    default: return FALSE;
     }
-    printf("Directory contents obtained:\n\n%s\n", (*buf));
-
-    return size; // return size of concatenated string
+    return TRUE;
 }
 
-// Name: getFile()
-// Desc: Gets data for the specified file name and stores it in a buffer.
-// Arg1: buf - the pointer to the uninitialized buffer to store the data.
-// Arg2: name - the name of the file to retrieve the data from.
-// Pre : A buffer is declared and a filename is obtained from a client command.
-// Post: The data for the file is obtained and stored in allocated memory in the buffer.
-// Rtrn: The size of the buffer or -1 if there was an error or the file was not found.
-int getFile(char** buf, char *name) {
-
-    // Opening and reading files from official manpage
-    // http://man7.org/linux/man-pages/man3/fopen.3.html
-    // Using fseek and ftell to get the file size from official manpage
-    // http://man7.org/linux/man-pages/man3/fseek.3.html
-    FILE* file;
-    long size;
-
-    printf("Attempting to open file: %s\n\n", name);
-    if ((file = fopen(name, "r")) == NULL) {
-        fprintf(stderr, "ERROR, could not open file: %s\n\n", name);
-        return -1;
+// Name: readConfig()
+// Desc: Reads a --config file, a line per option: the long name of the option and its value,
+//       like "max-rate 10M". Blank lines and lines starting with '#' are skipped.
+// Arg1: c - the configuration to set the options in.
+// Arg2: path - the file.
+// Pre : None.
+// Post: The options of the file are set in c, over the ones already there. An error is printed
+//       for the first line that is not valid.
+// Rtrn: The file's contents, which the string options point into, or NULL on error.
+char* readConfig(struct config* c, const char* path) {
+
+    char *buf, *line, *save, *rest, *name, *arg;
+    struct option* o;
+    int fd, n = 0, no = 0;
+    ssize_t got;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1 || (buf = malloc(CONFIG_LEN + 1)) == NULL) {
+        fprintf(stderr, "ERROR, reading config %s: %s\n\n", path, strerror(errno));
+        if (fd != -1) { close(fd); }
+        return NULL;
     }
-
-    // Get size of file
-    if (fseek(file, 0, SEEK_END) != 0
-            || (size = ftell(file)) == -1
-            || fseek(file, 0, SEEK_SET) != 0) {
-        perror("ERROR, getting file size\n");
-        return -1;
+    while (n < CONFIG_LEN && ((got = read(fd, buf + n, CONFIG_LEN - n)) > 0 || (got == -1 && errno == EINTR))) {
+        if (got > 0) { n += got; }
     }
-    printf("Size of file: %ld\n\n", size);
-
-    // Get the file contents
-    (*buf) = malloc(sizeof(char) * (size+1));
-    if (fread((*buf), sizeof(char), size, file) < size || ferror(file)) {
-        perror("ERROR, reading file contents to buffer\n\n");
-        return -1;
-    } else {
-        (*buf)[size+1] = '\0';
+    close(fd);
+    buf[n] = '\0';
+
+    for (line = strtok_r(buf, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save)) {
+        no++;
+        if ((name = strtok_r(line, " \t\r", &rest)) == NULL || name[0] == '#') { continue; }
+        for (o = opts; o->name != NULL && strcmp(o->name, name) != 0; o++) {}
+        if (o->name == NULL || o->val == 'f' || (arg = strtok_r(NULL, " \t\r", &rest)) == NULL) {
+            fprintf(stderr, "ERROR, line %d of config %s: %s\n\n", no, path, name);
+            free(buf);
+            return NULL;
+        }
+        if (!setOption(c, o->val, arg)) {
+            fprintf(stderr, "ERROR, line %d of config %s\n\n", no, path);
+            free(buf);
+            return NULL;
+        }
     }
-    printf("Contents of file obtained.\n\n");
-
-    return size;
+    return buf;
 }
 
 // Name: bye()
 // Desc: Signal handler to exit the program
-// Pre : CTRL + C is pressed / SIGINT signal is sent
+// Pre : CTRL + C is pressed / SIGINT signal is sent during startup or a drain, or the drain is over
 // Post: The program is exited
 void bye(int signum) {
- 
-    printf(""); // flush
+
+    logFlush();
     printf("\nftpserver is exiting... Goodbye!\n\n");
     exit(0);
 }
-
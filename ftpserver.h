@@ -0,0 +1,703 @@
+/*
+ * Name: ftpserver.h
+ * Auth: Andrew Swaim
+ * Date: November 2019
+ * Desc: Types, settings and declarations shared by the modules of ftpserver.
+ */
+
+#ifndef FTPSERVER_H
+#define FTPSERVER_H
+
+#define _GNU_SOURCE // CPU_SET() and pthread_setaffinity_np()
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+#include <linux/openat2.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <signal.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <sched.h>
+#include <zlib.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+typedef enum { FALSE, TRUE } bool;   // bool type for C89/C99 compilation
+
+#define BUF_LEN 128
+#define LINE_LEN 1024           // longest line accepted on the control connection
+#define ARENA_LEN (2 * LINE_LEN + 16) // a connection's arena: the names of one request, each shorter than its command
+#define CONN_SLAB 64            // connections allocated at a time when a worker has no idle one
+#define FRAME_LEN 16            // frame header: 32-bit id, 32-bit flags, 64-bit length, big-endian
+#define FRAME_DIR 0x1           // frame flag: the payload is a directory listing
+#define FRAME_CRC 0x2           // frame flag: a 32-bit big-endian CRC32C of the payload follows it
+#define FRAME_ZLIB 0x4          // frame flag: the payload is sent as zlib blocks, the length is uncompressed
+#define FRAME_TREE 0x8          // frame flag: the payload is an archive of a directory tree
+#define ENTRY_HDR 24            // archive entry header: 32-bit name length, 32-bit mode, 64-bit size, 64-bit mtime (ns)
+#define BLOCK_HDR 8             // zlib block header: 32-bit raw length, 32-bit compressed length (0 if stored)
+#define CRC32C_POLY 0x82f63b78  // Castagnoli polynomial, bit reversed
+#define PASV_POOL 4             // default number of passive data listeners per worker
+#define PASV_TIMEOUT_MS 10000   // how long to wait for the client to connect to a passive listener
+#define PASV_BACKLOG 8          // stray connects are turned away by acceptData, room for them and the client
+#define TLS_TIMEOUT_MS 10000    // how long a TLS handshake may take
+#define TLS_RECORD 16384        // most plaintext bytes in one TLS record
+#define MAX_EVENTS 256          // max events handled per epoll_wait() call
+#define CONNECT_RETRIES 6       // attempts to open the data connection before giving up
+#define CONNECT_BACKOFF_MS 10   // delay before the first retry, doubled after every attempt
+#define PIPE_CHUNK 65536        // bytes moved through the splice() pipe at a time
+#define CHUNK_SIZE (1 << 20)    // default size of a chunked transfer buffer
+#define POOL_MAX 64             // idle chunks a worker keeps for reuse
+#define RING_ENTRIES 256        // submission queue entries of a worker's io_uring
+#define RING_BUFS 8             // chunks a worker registers with its io_uring, fewer if they cannot all be pinned
+#define ARCHIVE_DEPTH 64        // deepest directory an archive goes into
+#define ARCHIVE_STEP 256        // directory entries an archive's walk reads per turn of the scheduler
+#define LIST_OPTS 6             // most tokens after -l: five listing options and the port
+#define LONG_LINE 64            // most bytes a long format listing line adds to the name
+#define CACHE_BUCKETS 4096      // hash buckets of the file cache
+#define ZIP_THREADS 2           // most cache entries compressed at once, each on a thread of its own
+#define LOAD_THREADS 2          // most cache misses loaded at once, each on a thread of its own
+#define QUANTUM (256 << 10)     // default bytes a transfer may send per turn of the scheduler
+#define IP_BUCKETS 1024         // client addresses rate limited at once with --ip-rate
+#define ADMIT_POLL_MS 10        // how often a worker with queued sessions checks for a free slot
+#define SUM_MIN 4096           // smallest block SUMS takes a checksum of
+#define SUM_MAX (16 << 20)      // largest block SUMS takes a checksum of
+#define LOG_RING (1 << 20)      // bytes of log lines a worker can have waiting for the logger thread
+#define LOG_LINE 1024           // longest log line, longer ones are cut
+#define LOG_FLUSH_MS 20         // how often the logger thread writes the workers' lines out
+#define METRICS_BACKOFF_MS 100  // how long the metrics endpoint waits after accept() fails, e.g. out of fds
+#define HIST_SUB 4              // buckets per power of two of a histogram
+#define HIST_BUCKETS (64 * HIST_SUB)
+#define PROM_BUCKETS 32         // powers of two a histogram is exported with to Prometheus
+#define STATS_LINE 1024         // longest STATS reply
+#define DIR_ARENA 4096          // first size of the directory index's name arena, doubled as it fills
+#define DIR_HANDLES 256         // directory handles a worker keeps for resolving paths under --root
+#define PATH_SLOTS (2 * DIR_HANDLES) // hash slots of the directory handles
+#define DRAIN_TIMEOUT 30        // default seconds a drain waits for the transfers in flight
+#define HANDOFF_FDS 253         // most descriptors one handoff message carries (SCM_MAX_FD)
+#define HANDOFF_TIMEOUT_MS 10000 // how long either side of a handoff waits for the other
+#define CONFIG_LEN (64 << 10)   // largest --config file
+#define PUT_PREFIX ".ftpserver-put-" // names starting with it are uploads' temporary files, reserved
+#define PUT_TEMP (sizeof(PUT_PREFIX) + 7) // bytes a temporary name adds to the upload's, with the '\0'
+// modification time of a struct stat in nanoseconds, compared to decide if a file changed
+#define MTIME_NS(st) ((long long)(st).st_mtim.tv_sec * 1000000000LL + (st).st_mtim.tv_nsec)
+// a log line, formatted only if its level is switched on
+#define LOG(level, ...) do { if ((level) <= cfg.logLevel) { logWrite(__VA_ARGS__); } } while (0)
+// a log line ending like perror() does, in the error the call failed with
+#define LOG_ERRNO(level, msg) do { if ((level) <= cfg.logLevel) { logWrite("%s: %s\n", (msg), strerror(errno)); } } while (0)
+// the socket has a TLS session, which sends and receives have to go through unless the kernel does it
+#define TLS_ON(fd) (tlsFds != NULL && (fd) < tlsMax && tlsFds[fd].ssl != NULL)
+// a counter only its own worker writes, so a plain store is enough and readers see whole values
+#define STAT_ADD(field, n) __atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+#define USAGE "USAGE: %s [--backlog N] [--workers N] [--transfer buffer|sendfile|splice|chunked|uring]\n" \
+              "       [--chunk-size BYTES] [--pasv-pool N] [--pasv-ports LO-HI] [--cache-size BYTES]\n" \
+              "       [--compress-level N] [--log-level off|error|warn|info|debug] [--metrics-port PORT]\n" \
+              "       [--sndbuf BYTES] [--rcvbuf BYTES] [--bdp MBITS,MS] [--nodelay on|off] [--cork on|off]\n" \
+              "       [--congestion NAME] [--notsent-lowat BYTES] [--fastopen N] [--quantum BYTES]\n" \
+              "       [--session-rate BYTES] [--ip-rate BYTES] [--max-rate BYTES] [--max-sessions N[,QUEUE]]\n" \
+              "       [--tls-cert FILE] [--tls-key FILE] [--root DIR] [--config FILE] [--drain-timeout SECONDS]\n" \
+              "       [--handoff PATH] port\n\n"
+
+// The states a control connection moves through while serving one request.
+enum connState {
+    ST_CMD,         // awaiting a command from the client
+    ST_REPLY,       // sending the OK or error reply on the control connection
+    ST_READY,       // awaiting READY, the client is listening for the data connection
+    ST_ACCEPT,      // awaiting the client's connection to a passive data listener
+    ST_CONNECT,     // opening the data connection back to the client
+    ST_HEADER,      // sending the length (or frame header) of the data
+    ST_STREAM,      // sending the data itself
+    ST_TRAILER,     // sending the checksum that follows the data
+    ST_ACK,         // awaiting acknowledgment of receipt from the client
+    ST_RECV,        // receiving an upload on the data connection
+    ST_HASH,        // reading the file for HAVE CRC or SUMS a chunk per turn, the command then runs again
+    ST_WALK,        // walking the tree for -r a few entries per turn, the command then runs again
+    ST_TLS          // TLS handshake on the control connection, or on the data connection before its first transfer
+};
+
+// How file contents are sent on the data connection.
+enum transferMode {
+    T_BUFFER,       // read the whole file into memory then send it
+    T_SENDFILE,     // sendfile() from the page cache
+    T_SPLICE,       // splice() from the file to a pipe and from the pipe to the socket
+    T_CHUNKED,      // pread() one chunk at a time into a pooled buffer and send it
+    T_URING         // like T_CHUNKED, but the reads and sends are submitted to the worker's io_uring
+};
+
+// The operation a connection has on the io_uring.
+enum ringOp {
+    R_READ,         // reading the next chunk of the file
+    R_SEND          // sending the chunk
+};
+
+// What the client says it already has of the file the next -g (or SUMS) asks for.
+enum haveKind {
+    H_NONE,         // nothing, always send
+    H_STAT,         // a copy with a size and modification time
+    H_CRC           // a copy with a CRC32C
+};
+
+// A chunked transfer buffer. Idle ones are linked in the worker's pool.
+struct chunk {
+    struct chunk* next;     // next idle chunk in the pool
+    int len;                // bytes of file data held
+    int off;                // bytes of it already sent
+    int raw;                // bytes of the file a zlib block holds
+    int buf;                // index of the chunk among the buffers registered with the io_uring, -1 if not
+    char data[];            // cfg.chunkSize bytes, and a zlib block header
+};
+
+// How much the server logs, each level includes the ones before it.
+enum logLevel {
+    L_OFF,          // nothing
+    L_ERROR,        // failed requests and connections
+    L_WARN,         // things that work but not as configured
+    L_INFO,         // every command, connection and transfer
+    L_DEBUG         // every step of every request
+};
+
+// What a registered file descriptor is used for.
+enum watchKind { W_LISTEN, W_CTRL, W_DATA, W_PASV, W_NOTIFY, W_RING, W_WAKE, W_HANDOFF };
+
+struct conn;
+
+// An epoll registration. The event data points at one of these so the
+// reactor knows which socket (and which connection) an event belongs to.
+struct watch {
+    int fd;
+    enum watchKind kind;
+    unsigned int events;    // currently registered event mask
+    struct conn* conn;
+};
+
+// A prebuilt directory listing, shared by every transfer sending it until the directory changes.
+struct listing {
+    int refs;               // one for the index while it is current, plus one per transfer sending it
+    long long len;
+    char data[];
+};
+
+// The regular files in the working directory, kept current with inotify.
+struct dirIndex {
+    struct watch w;         // inotify instance, fd is -1 without one and the directory is scanned every time
+    int wd;                 // the watch on the directory itself
+    char* names;            // arena of newline terminated names, back to back
+    long long len, cap;
+    int count;
+    bool rescan;            // the arena must be rebuilt from the directory
+    unsigned long long gen; // changes whenever entries move, so an old page cursor is refused
+    struct listing* cached; // listing built from the arena, NULL once it changes
+};
+
+// A directory the paths of requests were resolved through, by its path relative to the root.
+struct dirHandle {
+    char* path;             // NULL for a free slot
+    int len;
+    int fd;                 // O_PATH descriptor of the directory
+    int wd;                 // inotify watch of the directory, for moves and removals
+};
+
+// The directories a worker resolved paths through, so only the last name of a path in a known
+// directory is looked up. The parents of a cached directory are all cached as well, so moving
+// or removing any of them shows up as an inotify event on a watched directory.
+struct pathCache {
+    struct dirHandle slots[PATH_SLOTS];
+    int count;
+    int notify;             // the worker's inotify instance, -1 and nothing is cached
+    int rootWd;             // the root's own watch, left alone when the cache is dropped
+};
+
+// A file or directory in an archive, the content of a file follows its header and name.
+struct archEntry {
+    long long nameOff;      // the path relative to the archive's root, in the name arena
+    int nameLen;
+    unsigned int mode;      // st_mode, type and permissions
+    long long size, mtime;  // bytes of content (0 for a directory), mtime (ns)
+};
+
+// A directory tree being sent as one archive, walked when it is asked for.
+struct archive {
+    int root;                           // the directory the tree starts at
+    struct archEntry* entries;
+    int count, cap;
+    char* names;                        // arena of the paths, back to back
+    long long namesLen, namesCap;
+    long long len;                      // length of the whole archive
+    DIR* walk[ARCHIVE_DEPTH + 1];       // directories still being walked, the root first
+    int walkLen[ARCHIVE_DEPTH + 1];     // each one's path relative to the root, "/" included
+    int depth;                          // how many are open, 0 once the walk is done
+    char path[LINE_LEN];                // the entry being walked, relative to the root
+    int idx;                            // entry being sent
+    long long pos;                      // bytes of it sent, header and name included
+    int fd;                             // the entry's file while its content is being sent, -1 if none
+};
+
+// A file held in the file cache, shared by every transfer sending it.
+struct cacheEntry {
+    char* name;             // key: the filename, and the file's identity when it was loaded
+    dev_t dev;
+    ino_t ino;
+    long long size, mtime;
+    char* data;             // read-only copy of the contents
+    unsigned int crc;       // CRC32C of the contents, computed as they were read
+    char* zdata;            // the contents as zlib blocks, NULL until a client asks for them
+    long long zlen;
+    int refs;               // one for the cache while the entry is in it, plus one per transfer
+    bool used;              // CLOCK reference bit, set on every hit
+    bool zipping;           // a thread is compressing the contents into zdata
+    int slot;               // position in the clock
+    struct cacheEntry* next; // next entry in the hash bucket
+};
+
+// A file that missed the file cache, being loaded into it on a thread.
+struct cacheMiss {
+    char* name;             // NULL while the slot is free
+    struct stat st;         // the file's status when it missed
+};
+
+// The file cache, one for all workers.
+struct fileCache {
+    pthread_mutex_t lock;
+    struct cacheEntry* table[CACHE_BUCKETS];
+    struct cacheEntry** ring; // the clock the eviction hand sweeps
+    int count, cap, hand;
+    long long bytes;        // total size of the entries, kept within cfg.cacheSize
+};
+
+// Checksums of a file for HAVE CRC and SUMS, worked out a chunk at a time on the scheduler's
+// turns and kept for the next command that needs the same file.
+struct hashJob {
+    dev_t dev;              // the file they are of
+    ino_t ino;
+    long long size, mtime;
+    long long pos;          // bytes of it read so far
+    long long block;        // SUMS block size, 0 for only the CRC32C of the whole file
+    unsigned int crc;       // CRC32C of the file so far
+    unsigned long sum;      // zlib CRC-32 of the block being read
+    char* sums;             // the block checksums, 4 bytes big-endian each, or NULL
+    bool done;              // the whole file was read
+};
+
+// The rate limit of one client address, shared by every session from it on every worker.
+struct ipBucket {
+    char host[INET6_ADDRSTRLEN];    // empty if the slot was never used
+    int refs;                       // sessions open from the address, 0 if the slot is free
+    long long tat;                  // token bucket state, see bucketWait()
+};
+
+// The --ip-rate buckets, one table for all workers. The lock is only taken when a session
+// starts or ends, the buckets themselves are updated without it.
+struct ipTable {
+    pthread_mutex_t lock;
+    struct ipBucket slots[IP_BUCKETS];
+};
+
+// The TLS session of a socket.
+struct tlsFd {
+    SSL* ssl;
+    bool ktls;      // the kernel encrypts what is sent (kTLS), so send(), sendfile() and splice() work as is
+    bool failed;    // a fatal error, no close_notify is sent
+};
+
+// A passive mode data listener. Idle ones are linked in the worker's pool.
+struct pasv {
+    struct watch w;         // listening socket, w.conn is the connection waiting on it
+    int port;
+    struct pasv* next;      // next idle listener in the pool
+};
+
+// A worker's log lines waiting for the logger thread, one writer and one reader so no lock.
+struct logRing {
+    char buf[LOG_RING];
+    unsigned long long head;    // bytes ever written, only the worker moves it
+    unsigned long long tail;    // bytes ever written out, only the logger moves it
+    unsigned long long dropped; // lines lost to a full ring
+};
+
+// Counts of values in log-linear buckets, HDR histogram style: HIST_SUB buckets per power of
+// two, so every value is within 25% of its bucket's bounds whatever its size.
+struct hist {
+    unsigned long long counts[HIST_BUCKETS];
+    unsigned long long count, sum;
+};
+
+// A worker's counters. Only the worker writes them, STATS and the metrics endpoint read them.
+struct stats {
+    unsigned long long accepted, commands, transfers, uploads;
+    unsigned long long bytesSent, bytesRecv;
+    unsigned long long cacheHits, cacheMisses;
+    unsigned long long retrans;     // segments the data connections retransmitted
+    unsigned long long throttled;   // times a transfer waited on a rate limit
+    unsigned long long queued, rejected; // sessions over --max-sessions
+    unsigned long long tlsHandshakes, tlsResumed; // TLS handshakes done, and those that resumed a session
+    unsigned long long ktls;        // TLS connections whose sends the kernel encrypts
+    struct hist okLat;      // command received to OK reply queued (us)
+    struct hist connectLat; // OK reply queued to data connection open (us)
+    struct hist rate;       // throughput of each transfer (KB/s)
+    struct hist rtt;        // smoothed round trip time of the data connection at the end of each transfer (us)
+};
+
+// Per-connection state, everything needed to resume a request where it left off.
+struct conn {
+    struct conn* next;              // next idle connection in the worker's slab
+    struct watch ctrl;              // control connection
+    struct watch data;              // data connection (fd is -1 until opened)
+    enum connState state;
+    char host[INET6_ADDRSTRLEN];    // client host
+    char in[LINE_LEN];              // bytes received on the control connection not yet parsed
+    int inLen;
+    char cmd[LINE_LEN];             // command (and later acknowledgment) from the client
+    int cmdLen;                     // length of the command before it was parsed, to run it again
+    char port[BUF_LEN];             // data port requested by the client
+    int retries;                    // data connection attempts left
+    int backoff;                    // delay before the next attempt (ms)
+    struct pasv* pasv;              // passive listener the client is connecting to, or NULL
+    const char* reply;              // reply to send on the control connection
+    char replyBuf[BUF_LEN];         // for replies that are not constant
+    int replyLen, replyOff;
+    bool stream;                    // MODE STREAM, the data connection is kept between transfers
+    bool check;                     // MODE CRC, every frame is followed by the checksum of its payload
+    unsigned int crc;               // CRC32C of the payload sent so far
+    bool crcKnown;                  // crc already covers the whole payload (from the file cache)
+    unsigned int xferId;            // id of the current transfer, counting from 1 each session
+    unsigned int acks;              // stream mode transfers sent but not yet acknowledged
+    char hdr[BUF_LEN];              // length of the data as a string, or the binary frame header
+    int hdrLen, hdrOff;
+    char* msg;                      // data to send (directory or file contents)
+    struct listing* listing;        // directory listing msg points into, NULL if msg is owned
+    struct archive* archive;        // directory tree being sent instead of msg or a file, or NULL
+    struct cacheEntry* cached;      // file cache entry msg points into, NULL if msg is owned
+    int file;                       // file to stream instead of msg, -1 if none
+    enum transferMode mode;         // how the file is streamed
+    enum ringOp ringOp;             // what the io_uring is doing for the transfer
+    int ringOps;                    // completions the io_uring still owes the connection
+    bool closed;                    // closed while ringOps was not 0, freed once they arrive
+    int pipe[2];                    // splice() pipe, -1 until needed
+    int piped;                      // bytes read into the pipe but not yet sent
+    bool zip;                       // the file is compressed into zlib blocks as it is sent
+    char* putName;                  // name an upload is stored under once it is all there, NULL if not uploading
+    char* putTemp;                  // the temporary file the upload is received into, removed if it fails, "" while it has no name
+    int putDir;                     // the directory of both, -1 if not uploading
+    char arena[ARENA_LEN];          // strings the current request keeps, emptied when its transfer ends
+    int arenaLen;
+    struct chunk* chunk;            // chunked transfer buffer, NULL until needed
+    long long off;                  // offset in the file the transfer starts at
+    long long rest;                 // REST offset for the next -g, -1 if none
+    long long restSize, restMtime;  // size and mtime (ns) the file must still have to resume
+    enum haveKind have;             // HAVE for the next -g or SUMS, sent only if the file differs
+    long long haveSize, haveMtime;  // the client's size and mtime (ns, compared to the microsecond)
+    unsigned int haveCrc;           // the client's CRC32C
+    struct hashJob hash;            // checksums of the last file a command had to read through
+    long long len, sent;
+    long long started;              // when the data started going out (ms), for throughput
+    unsigned int retransSeen;       // retransmits of the data connection already counted
+    long long cmdAt, okAt;          // when the command arrived and when it was answered OK (us), for latency
+    long long deadline;             // when the timer fires (ms, monotonic clock)
+    int heapIdx;                    // position in the timer heap or -1
+    struct conn *runPrev, *runNext; // neighbours in the scheduler's run queue
+    bool queued;                    // waiting in the run queue for a turn
+    bool turn;                      // the scheduler is running this transfer
+    long long deficit;              // bytes the transfer may still send this turn, below 0 if it went over
+    long long tat;                  // the session's --session-rate bucket
+    struct ipBucket* ipb;           // the client address's --ip-rate bucket, or NULL
+    bool admitted;                  // holds one of the --max-sessions slots
+    struct conn* waitNext;          // next session queued for a slot
+    struct conn *openPrev, *openNext; // neighbours among the worker's open sessions, for a drain
+    bool leaving;                   // a drain sent RECONNECT, the session waits for the client to close
+};
+
+// A worker's io_uring, driven through the raw system calls. The submission and completion
+// queues are memory shared with the kernel, and the ring's fd is watched by epoll like a socket.
+struct ring {
+    struct watch w;         // readable while completions are waiting, fd is -1 without a ring
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    unsigned entries;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    unsigned queued;        // entries filled in but not yet submitted
+    bool zc;                // the kernel has IORING_OP_SEND_ZC
+    struct chunk* bufs;     // idle registered chunks, read into with IORING_OP_READ_FIXED
+};
+
+// The event loop and everything it owns.
+struct reactor {
+    int epfd;
+    struct watch listen;    // listening control socket
+    bool shared;            // listening socket is shared with the other workers
+    struct watch* adopted;  // inherited listening sockets beyond one per worker, served here as well
+    int nAdopted;
+    struct conn** timers;   // min-heap of connections ordered by deadline
+    int nTimers, capTimers;
+    int active;             // number of open control connections
+    struct chunk* pool;     // idle chunks for chunked transfers
+    struct conn* idle;      // idle connections, allocated CONN_SLAB at a time and never freed
+    int pooled;
+    char* scratch;          // file data read for compressing, cfg.chunkSize bytes, NULL until needed
+    struct pasv* pasvPool;  // idle passive data listeners
+    struct dirIndex dir;    // index of the root directory for -l
+    struct pathCache paths; // directory handles for the names of requests
+    struct ring ring;       // io_uring for --transfer uring
+    struct logRing* log;    // lines for the logger thread, NULL with logging off
+    struct conn *runHead, *runTail; // transfers waiting for their turn to send
+    int runLen;
+    struct conn *waitHead, *waitTail; // sessions waiting for a --max-sessions slot
+    int nWaiting;
+    struct conn* open;      // every open session, newest first
+    struct watch wake;      // eventfd the signal handlers and the other workers wake the reactor with
+    bool drained;           // stopped accepting, sessions are closed as they go idle
+    struct watch handoff;   // the first worker's --handoff socket, fd is -1 without one
+    struct watch heir;      // a new process taking the listening sockets over, fd is -1 if none
+    struct stats stats;
+};
+
+// A thread running its own reactor.
+struct worker {
+    int id;
+    pthread_t thread;
+    struct reactor r;
+};
+
+// Server configuration from the command line.
+struct config {
+    char* port;
+    int backlog;
+    int workers;
+    enum transferMode transfer;
+    int chunkSize;
+    int pasvPool;
+    int pasvLo, pasvHi;     // port range for passive listeners, 0 for any port
+    long long cacheSize;    // byte budget of the file cache, 0 for no cache
+    int zlevel;             // zlib compression level, 0 to never compress
+    enum logLevel logLevel;
+    char* metricsPort;      // port of the Prometheus endpoint, NULL for none
+    int sndbuf, rcvbuf;     // socket buffers of the data connections, 0 leaves them to autotuning
+    bool nodelay;           // TCP_NODELAY on control and data connections
+    bool cork;              // send the length or frame header with MSG_MORE so it leaves with the data
+    char* congestion;       // TCP_CONGESTION of the data connections, NULL for the system default
+    int notsentLowat;       // TCP_NOTSENT_LOWAT of the data connections, 0 for the system default
+    int fastopen;           // TCP_FASTOPEN queue of the listeners, 0 for off
+    long long quantum;      // bytes a transfer sends per turn of the scheduler, 0 to send all it can
+    long long sessionRate;  // bytes/s limit of each session, 0 for none
+    long long ipRate;       // bytes/s limit of each client address, 0 for none
+    long long maxRate;      // bytes/s limit of the whole server, 0 for none
+    int maxSessions;        // sessions served at once, 0 for no limit
+    int maxQueued;          // sessions waiting for a slot before new ones are turned away
+    char* tlsCert;          // PEM certificate chain, NULL for no TLS
+    char* tlsKey;           // PEM private key, NULL if it is in the certificate file
+    char* root;             // the directory served, every name of a request is resolved beneath it
+    char* config;           // file of options read after the command line and again on SIGHUP, or NULL
+    int drainTimeout;       // seconds a drain lets the transfers in flight finish before cutting them off
+    char* handoff;          // UNIX socket the listening sockets are handed to a new process on, or NULL
+};
+
+extern struct config cfg;
+extern struct config cfgArgs;
+extern struct fileCache cache;
+extern struct ipTable ipTable;
+extern long long globalTat; // the --max-rate bucket
+extern int admitted; // sessions holding a --max-sessions slot
+extern SSL_CTX* tlsCtx; // shared by every worker, NULL without --tls-cert
+extern struct tlsFd* tlsFds; // the TLS state of each socket, by descriptor
+extern int tlsMax; // size of tlsFds
+extern unsigned int crcTable[256]; // software CRC32C, one byte at a time
+extern bool crcHw; // the CPU has the SSE4.2 crc32 instruction
+extern struct worker* workerList; // every worker, for the logger and the statistics
+extern __thread struct logRing* logMine; // the calling worker's log ring
+extern __thread struct pathCache* pathMine; // the calling worker's directory handles
+extern int rootFd; // the --root directory
+extern bool haveOpenat2; // the kernel has openat2() and RESOLVE_BENEATH
+extern bool draining; // SIGINT, SIGTERM or a handoff started a drain
+extern long long drainDeadline; // when the drain cuts off the transfers still going (ms)
+extern int metricsSock; // the --metrics-port listener, -1 without one
+
+/*
+ * Declarations
+ */
+void startup(char* port, struct worker* workers);
+bool setOption(struct config* c, int opt, char* arg);
+char* readConfig(struct config* c, const char* path);
+int ctrlListen(char* port, bool* shard);
+int dataConnect(char* host, char* port);
+int pasvListen(int* port);
+void handleRequest(struct reactor* r, struct conn* c);
+void dirInit(struct reactor* r);
+int dirScan(struct dirIndex* d, int dirfd);
+int dirAppend(struct dirIndex* d, const char* name);
+long long dirFind(struct dirIndex* d, const char* name);
+void dirNotify(struct reactor* r);
+struct listing* dirListing(struct reactor* r);
+long long dirPage(struct reactor* r, char* dir, long long start, unsigned long long* gen, long long limit, char* match, bool longFmt, long long* next, char** buf);
+void dirDrop(struct dirIndex* d);
+void listingPut(struct listing* l);
+struct archive* archiveOpen(char* dir);
+int archiveWalk(struct archive* a, int max);
+int archiveAdd(struct archive* a, const char* path, struct stat* st);
+long long archiveRead(struct archive* a, char* buf, long long len);
+long long sendArchive(int conn, struct archive* a, struct chunk* chunk, char* scratch, long long len, bool zip, unsigned int* crc);
+void archiveFree(struct archive* a);
+long long getFile(char** buf, char *name);
+long long openFile(int* file, char* name);
+bool hashKnown(struct conn* c, struct stat* st, long long block);
+bool unchanged(struct conn* c, enum haveKind have, char* name, struct stat* st);
+long long sendAll(int conn, char* str, long long len);
+long long sendFlags(int conn, char* str, long long len, int flags);
+ssize_t recvSome(int conn, char* buf, size_t len);
+void tlsInit(void);
+bool tlsStart(int fd, bool tickets);
+int tlsShake(struct reactor* r, int fd, unsigned int* events);
+void tlsEnd(int fd);
+ssize_t tlsSend(int fd, const char* buf, size_t len);
+ssize_t tlsRecv(int fd, char* buf, size_t len);
+ssize_t tlsSendfile(int fd, int file, off_t* off, size_t len);
+void pathInit(void);
+int pathOpen(const char* name, int flags);
+int pathStat(const char* name, struct stat* st);
+int pathParent(const char* name, const char** leaf);
+int pathEntry(int dirfd, const char* name);
+void pathFlush(struct pathCache* p);
+void tuneSocket(int fd, bool data);
+void tuneListener(int fd);
+void tuneCheck(void);
+void tcpReport(struct reactor* r, struct conn* c);
+long long bucketWait(long long* tat, long long rate, long long now);
+void bucketCharge(long long* tat, long long rate, long long n, long long now);
+bool schedDefer(struct reactor* r, struct conn* c);
+void schedCharge(struct conn* c, long long n);
+void schedQueue(struct reactor* r, struct conn* c);
+void schedRemove(struct reactor* r, struct conn* c);
+void schedRun(struct reactor* r);
+struct ipBucket* ipBucketGet(char* host);
+void ipBucketPut(struct ipBucket* b);
+bool admitTry(void);
+void admitRelease(void);
+void admitWaiting(struct reactor* r);
+long long sendFile(int conn, int file, off_t* off, long long len);
+long long spliceFile(int conn, int file, int pipefd[2], int* piped, off_t* off, long long len);
+long long sendChunks(int conn, int file, struct chunk* chunk, off_t off, long long len, unsigned int* crc);
+long long recvChunks(int conn, int file, struct chunk* chunk, off_t off, long long len);
+long long spliceIn(int conn, int file, int pipefd[2], off_t off, long long len);
+int putOpen(char* name, long long len, char* temp, int* dir);
+int putStore(int file, int dir, char* temp, const char* leaf);
+bool isPutTemp(const char* leaf);
+long long sendZipped(int conn, int file, const char* src, struct chunk* chunk, char* scratch, off_t off, long long len, unsigned int* crc);
+int zipBlock(char* dst, const char* src, int n);
+long long zipBlocks(const char* src, long long size, char** buf);
+bool compressible(char* name);
+struct chunk* chunkGet(struct reactor* r);
+void chunkPut(struct reactor* r, struct chunk* ch);
+struct conn* connGet(struct reactor* r);
+void connPut(struct reactor* r, struct conn* c);
+char* arenaAlloc(struct conn* c, int len);
+int ringInit(struct reactor* r);
+int ringBufs(struct reactor* r, int count);
+struct io_uring_sqe* ringSqe(struct reactor* r);
+void ringSubmit(struct reactor* r);
+int ringFile(struct reactor* r, struct conn* c);
+void ringReap(struct reactor* r);
+void ringDone(struct reactor* r, struct conn* c, int res, unsigned int flags);
+struct cacheEntry* cacheGet(char* name, struct stat* st, bool wait);
+char* cacheLoad(char* name, struct stat* st, unsigned int* crc);
+void crcInit(void);
+unsigned int crc32c(unsigned int crc, const char* buf, long long len);
+#if defined(__x86_64__)
+unsigned int crc32cHw(unsigned int crc, const char* buf, long long len);
+#endif
+void cachePut(struct cacheEntry* e);
+void cacheEvict(struct cacheEntry* e);
+void cacheTrim(long long room);
+long long cacheNames(char** buf);
+void cacheRelease(struct cacheEntry* e);
+bool cacheZip(struct cacheEntry* e);
+unsigned int cacheHash(const char* name);
+long long parseSize(char* str);
+void logWrite(const char* fmt, ...);
+void logFlush(void);
+void* logRun(void* arg);
+void histAdd(struct hist* h, unsigned long long v);
+unsigned long long histBound(int idx);
+unsigned long long histPct(struct hist* h, double pct);
+void statsSum(struct stats* s, int* active, unsigned long long* dropped);
+int statsLine(char* buf, int len);
+int statsProm(char* buf, int len);
+void* metricsRun(void* arg);
+long long nowUs(void);
+long long parseHex(char* str);
+void* getInAddr(struct sockaddr *client);
+void bye(int signum);
+void onSignal(int signum);
+void wakeWorker(struct reactor* r);
+void onWake(struct reactor* r);
+void drainStart(void);
+void drainReactor(struct reactor* r);
+void drainSession(struct reactor* r, struct conn* c);
+bool drainDone(struct reactor* r);
+void configReload(void);
+int handoffTake(int* socks, bool* shard);
+void handoffWarm(struct worker* workers);
+void handoffListen(struct reactor* r);
+void handoffEvent(struct reactor* r, struct watch* w);
+
+void reactorInit(struct reactor* r, int sock, bool shared);
+void reactorAdopt(struct reactor* r, int* socks, int n);
+void reactorRun(struct reactor* r);
+void* workerRun(void* arg);
+void acceptConns(struct reactor* r, struct watch* w);
+void onEvent(struct reactor* r, struct watch* w, unsigned int events);
+void onTimer(struct reactor* r, struct conn* c);
+void recvCommand(struct reactor* r, struct conn* c);
+void sendReply(struct reactor* r, struct conn* c);
+void recvReady(struct reactor* r, struct conn* c);
+void acceptData(struct reactor* r, struct conn* c);
+struct pasv* pasvGet(struct reactor* r);
+void pasvPut(struct reactor* r, struct pasv* p);
+void openData(struct reactor* r, struct conn* c);
+void checkData(struct reactor* r, struct conn* c);
+void retryData(struct reactor* r, struct conn* c);
+void shakeHands(struct reactor* r, struct conn* c);
+void startData(struct reactor* r, struct conn* c);
+void sendHeader(struct reactor* r, struct conn* c);
+void recvUpload(struct reactor* r, struct conn* c);
+void sendData(struct reactor* r, struct conn* c);
+bool hashStart(struct reactor* r, struct conn* c, struct stat* st, long long block, enum haveKind have, long long resume);
+void hashStep(struct reactor* r, struct conn* c);
+void walkStep(struct reactor* r, struct conn* c);
+void sendTrailer(struct reactor* r, struct conn* c);
+void finishData(struct reactor* r, struct conn* c);
+void recvAck(struct reactor* r, struct conn* c);
+int recvLine(struct conn* c, char* line, int size);
+int packFrame(char* buf, unsigned int id, unsigned int flags, long long len);
+void endTransfer(struct reactor* r, struct conn* c);
+void closeConn(struct reactor* r, struct conn* c);
+void watchFd(struct reactor* r, struct watch* w, unsigned int events);
+void unwatchFd(struct reactor* r, struct watch* w);
+void timerSet(struct reactor* r, struct conn* c, int ms);
+void timerCancel(struct reactor* r, struct conn* c);
+int setNonBlocking(int fd);
+long long nowMs(void);
+
+#endif
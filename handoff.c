@@ -0,0 +1,464 @@
+/*
+ * Name: handoff.c
+ * Auth: Andrew Swaim
+ * Date: November 2019
+ * Desc: Restarts without dropping a client. SIGINT or SIGTERM drains the server: the workers stop
+ *       accepting, close the sessions with nothing in flight and let the transfers finish, for up
+ *       to --drain-timeout seconds. SIGHUP reads the --config file again. A new binary started
+ *       with the same --handoff socket takes the listening sockets over from the running one
+ *       (SCM_RIGHTS), loads the files the old one had cached, and only then tells it to drain.
+ */
+
+#include "ftpserver.h"
+
+// The first message of a handoff, the descriptors ride along with it.
+struct handoffHdr {
+    int listeners;          // listening control sockets, in worker order
+    int shard;              // one SO_REUSEPORT socket per worker, not one socket they all share
+    int metrics;            // the --metrics-port listener follows them
+    long long namesLen;     // bytes of file cache names sent after the message
+};
+
+static bool reloadWanted = FALSE;   // SIGHUP came, the first worker reloads --config
+static bool handedOff = FALSE;      // a new process has the listening sockets
+static int heritage = -1;           // the connection to the old server, until READY is sent
+static char* heirlooms = NULL;      // the names of the files it had cached
+static char* bequest = NULL;        // the cache names still being sent to the new process
+static long long bequestLen = 0, bequestSent = 0;
+
+// Name: onSignal()
+// Desc: Signal handler for SIGINT, SIGTERM and SIGHUP once the workers are running.
+// Arg : signum - the signal.
+// Pre : startup() setup the workers.
+// Post: SIGHUP wakes the first worker to reload --config. The first SIGINT or SIGTERM starts a
+//       drain, a second one exits at once. That exit does only what is safe in a signal handler,
+//       a worker may hold the log lock, so log lines not yet written are lost.
+void onSignal(int signum) {
+
+    static const char BYE[] = "\nftpserver is exiting... Goodbye!\n\n";
+    int saved = errno;
+
+    if (signum == SIGHUP) {
+        __atomic_store_n(&reloadWanted, TRUE, __ATOMIC_RELEASE);
+        wakeWorker(&workerList[0].r);
+    } else if (__atomic_load_n(&draining, __ATOMIC_ACQUIRE)) {
+        if (write(STDOUT_FILENO, BYE, sizeof(BYE)-1) == -1) {}
+        _exit(0);
+    } else {
+        drainStart();
+    }
+    errno = saved;
+}
+
+// Name: wakeWorker()
+// Desc: Wakes a worker's reactor, from a signal handler or another thread.
+// Arg : r - the reactor.
+// Pre : reactorInit() was called.
+// Post: onWake() runs on the worker's own thread.
+void wakeWorker(struct reactor* r) {
+
+    unsigned long long one = 1;
+
+    if (write(r->wake.fd, &one, sizeof(one)) == -1) {} // already woken if the counter is full
+}
+
+// Name: onWake()
+// Desc: Does what a worker was woken for.
+// Arg : r - the reactor.
+// Pre : The reactor's eventfd is readable.
+// Post: The first worker reloads --config if SIGHUP asked for it, and a drain that started since
+//       the last wake is started on this worker.
+void onWake(struct reactor* r) {
+
+    unsigned long long n;
+
+    while (read(r->wake.fd, &n, sizeof(n)) == -1 && errno == EINTR) {}
+    if (r == &workerList[0].r && __atomic_exchange_n(&reloadWanted, FALSE, __ATOMIC_ACQ_REL)) {
+        configReload();
+    }
+    if (__atomic_load_n(&draining, __ATOMIC_ACQUIRE) && !r->drained) { drainReactor(r); }
+}
+
+// Name: drainStart()
+// Desc: Starts draining every worker.
+// Pre : The workers are running, this is safe to call from a signal handler.
+// Post: The drain deadline is set and each worker is woken to stop accepting.
+void drainStart(void) {
+
+    int i;
+
+    if (__atomic_load_n(&draining, __ATOMIC_ACQUIRE)) { return; }
+    __atomic_store_n(&drainDeadline, nowMs() + cfg.drainTimeout * 1000LL, __ATOMIC_RELAXED);
+    if (__atomic_exchange_n(&draining, TRUE, __ATOMIC_ACQ_REL)) { return; }
+    for (i = 0; i < cfg.workers; i++) { wakeWorker(&workerList[i].r); }
+}
+
+// Name: drainReactor()
+// Desc: Starts the drain of one worker.
+// Arg : r - the reactor.
+// Pre : draining is set.
+// Post: The worker accepts no more sessions. The ones still queued for a slot, and every session
+//       waiting for a command with nothing in flight, are let go with drainSession(); the rest are
+//       once their transfers are done. Sessions still in their TLS handshake are closed. Unless a
+//       new process took them over, the listening sockets are shut down so new clients are
+//       refused instead of left in the backlog.
+void drainReactor(struct reactor* r) {
+
+    struct conn *c, *next;
+    int i;
+
+    r->drained = TRUE;
+    unwatchFd(r, &r->listen);
+    if (!handedOff && (!r->shared || r == &workerList[0].r)) { shutdown(r->listen.fd, SHUT_RDWR); }
+    for (i = 0; i < r->nAdopted; i++) {
+        unwatchFd(r, &r->adopted[i]);
+        if (!handedOff) { shutdown(r->adopted[i].fd, SHUT_RDWR); }
+    }
+    if (r->handoff.fd != -1) {
+        unwatchFd(r, &r->handoff);
+        close(r->handoff.fd);
+        r->handoff.fd = -1;
+        if (!handedOff) { unlink(cfg.handoff); } // the socket is still this server's own
+    }
+
+    while ((c = r->waitHead) != NULL) {
+        r->waitHead = c->waitNext;
+        c->waitNext = NULL;
+        r->nWaiting--;
+        if (c->state == ST_TLS) { closeConn(r, c); continue; }
+        watchFd(r, &c->ctrl, EPOLLIN);
+        drainSession(r, c);
+    }
+    r->waitTail = NULL;
+
+    // a command that already arrived is answered with RECONNECT as well
+    for (c = r->open; c != NULL; c = next) {
+        next = c->openNext;
+        if (c->state == ST_CMD) { recvCommand(r, c); }
+        else if (c->state == ST_TLS && c->data.fd == -1) { closeConn(r, c); } // still shaking hands
+    }
+    LOG(L_INFO, "Draining, %d session(s) still busy\n\n", r->active);
+}
+
+// Name: drainSession()
+// Desc: Lets a session with nothing in flight go during a drain.
+// Arg1: r - the reactor the connection belongs to.
+// Arg2: c - the connection, awaiting a command or with one that will not be served.
+// Pre : The worker is draining.
+// Post: The client is sent RECONNECT and the control connection is shut down for sending. Closing
+//       it outright could lose a command the client sent meanwhile without the client knowing it
+//       was not served; this way the client sends it again on a new session, to whichever server
+//       has the listening sockets, and the connection is closed once the client closes its end.
+void drainSession(struct reactor* r, struct conn* c) {
+
+    static const char RECONNECT[] = "RECONNECT\n";
+
+    c->leaving = TRUE;
+    if (sendAll(c->ctrl.fd, (char*)RECONNECT, sizeof(RECONNECT)-1) != sizeof(RECONNECT)-1) {
+        closeConn(r, c);
+        return;
+    }
+    shutdown(c->ctrl.fd, SHUT_WR);
+    LOG(L_INFO, "Draining, client asked to reconnect: %s\n\n", c->host);
+}
+
+// Name: drainDone()
+// Desc: Checks if a worker's drain is over, cutting off what is left once the deadline passes.
+// Arg : r - the reactor.
+// Pre : drainReactor() was called.
+// Post: Past the deadline every session left is closed.
+// Rtrn: TRUE once the worker has no session left.
+bool drainDone(struct reactor* r) {
+
+    if (r->active > 0 && nowMs() >= drainDeadline) {
+        LOG(L_WARN, "WARNING, drain timed out, %d session(s) cut off\n\n", r->active);
+        while (r->open != NULL) { closeConn(r, r->open); }
+    }
+    return (r->active == 0) ? TRUE : FALSE;
+}
+
+// Name: configReload()
+// Desc: Reads the --config file again and applies the settings that can change while running.
+// Pre : Called by the first worker, SIGHUP asked for it.
+// Post: --log-level, --compress-level, --cache-size, --quantum, --session-rate, --ip-rate,
+//       --max-rate and --drain-timeout take the file's values, or the command line's or the
+//       default ones if the file no longer sets them. A smaller cache is trimmed to fit and
+//       nothing cached is dropped otherwise. The other settings only change with a restart.
+//       A file with an error changes nothing.
+void configReload(void) {
+
+    struct config next = cfgArgs;
+    char* buf;
+
+    if (cfg.config == NULL) {
+        LOG(L_WARN, "WARNING, SIGHUP without --config, nothing to reload\n\n");
+        return;
+    }
+    if ((buf = readConfig(&next, cfg.config)) == NULL) {
+        LOG(L_ERROR, "ERROR, reloading config %s, the settings are unchanged\n\n", cfg.config);
+        return;
+    }
+    if (tlsCtx != NULL && next.quantum > 0 && next.quantum < TLS_RECORD) {
+        next.quantum = TLS_RECORD;
+    }
+
+    __atomic_store_n(&cfg.logLevel, next.logLevel, __ATOMIC_RELAXED);
+    __atomic_store_n(&cfg.zlevel, next.zlevel, __ATOMIC_RELAXED);
+    __atomic_store_n(&cfg.quantum, next.quantum, __ATOMIC_RELAXED);
+    __atomic_store_n(&cfg.sessionRate, next.sessionRate, __ATOMIC_RELAXED);
+    __atomic_store_n(&cfg.ipRate, next.ipRate, __ATOMIC_RELAXED);
+    __atomic_store_n(&cfg.maxRate, next.maxRate, __ATOMIC_RELAXED);
+    __atomic_store_n(&cfg.drainTimeout, next.drainTimeout, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&cache.lock);
+    __atomic_store_n(&cfg.cacheSize, next.cacheSize, __ATOMIC_RELAXED);
+    cacheTrim(0);
+    pthread_mutex_unlock(&cache.lock);
+    free(buf); // none of the settings applied point into it
+
+    LOG(L_INFO, "Config reloaded: %s\n\n", cfg.config);
+}
+
+// Name: handoffTake()
+// Desc: Takes the listening sockets over from a server running on the --handoff socket.
+// Arg1: socks - where to store the listening control sockets, HANDOFF_FDS of them.
+// Arg2: shard - set to TRUE if there is one socket per worker, FALSE if they share one.
+// Pre : The options were parsed.
+// Post: The sockets are this process's as well as the old server's, which keeps serving until
+//       handoffListen() tells it to drain. The metrics listener is taken too. The program exits
+//       if the handoff fails halfway, leaving the old server as it was.
+// Rtrn: The number of sockets taken, 0 if there is no server to take over from.
+int handoffTake(int* socks, bool* shard) {
+
+    struct sockaddr_un addr;
+    struct handoffHdr hdr;
+    struct timeval tv = { HANDOFF_TIMEOUT_MS / 1000, 0 };
+    union { struct cmsghdr align; char buf[CMSG_SPACE(HANDOFF_FDS * sizeof(int))]; } ctl;
+    struct iovec iov = { &hdr, sizeof(hdr) };
+    struct msghdr msg;
+    struct cmsghdr* cm;
+    int fd, n;
+
+    if (cfg.handoff == NULL) { return 0; }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, cfg.handoff);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+        perror("ERROR, opening handoff socket\n\n");
+        exit(1);
+    }
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        close(fd); // nothing running, or a socket left behind by one that is gone
+        return 0;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    if (recvmsg(fd, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC) != sizeof(hdr)
+            || (cm = CMSG_FIRSTHDR(&msg)) == NULL
+            || cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS
+            || (n = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int)) != hdr.listeners + hdr.metrics
+            || hdr.listeners < 1) {
+        fprintf(stderr, "ERROR, taking over from the server on %s: %s\n\n", cfg.handoff,
+                errno ? strerror(errno) : "bad message");
+        exit(1);
+    }
+    memcpy(socks, CMSG_DATA(cm), n * sizeof(int));
+    if (hdr.metrics) {
+        if (cfg.metricsPort != NULL) { metricsSock = socks[hdr.listeners]; }
+        else { close(socks[hdr.listeners]); }
+    }
+
+    if ((heirlooms = malloc(hdr.namesLen + 1)) == NULL
+            || (hdr.namesLen > 0
+                && recv(fd, heirlooms, hdr.namesLen, MSG_WAITALL) != hdr.namesLen)) {
+        fprintf(stderr, "ERROR, taking over from the server on %s: %s\n\n", cfg.handoff,
+                strerror(errno ? errno : EPROTO));
+        exit(1);
+    }
+    heirlooms[hdr.namesLen] = '\0';
+    heritage = fd;
+    *shard = hdr.shard ? TRUE : FALSE;
+    printf("Took over %d listening socket(s) from the server on %s\n\n", hdr.listeners,
+           cfg.handoff);
+    return hdr.listeners;
+}
+
+// Name: handoffWarm()
+// Desc: Loads what the server taken over from had cached, before this one starts serving.
+// Arg : workers - the workers, their reactors setup.
+// Pre : handoffTake() was called.
+// Post: The files are in the file cache and every worker's directory listing is built, so the
+//       first clients after the switch do not all miss.
+void handoffWarm(struct worker* workers) {
+
+    struct cacheEntry* e;
+    struct listing* l;
+    struct stat st;
+    char *name, *save;
+    int total = 0, warmed = 0, i;
+
+    if (heirlooms == NULL) { return; }
+    for (name = strtok_r(heirlooms, "\n", &save); name; name = strtok_r(NULL, "\n", &save)) {
+        total++;
+        if (cfg.cacheSize > 0 && (e = cacheGet(name, &st, TRUE)) != NULL) { cachePut(e); warmed++; }
+    }
+    for (i = 0; i < cfg.workers; i++) {
+        if ((l = dirListing(&workers[i].r)) != NULL) { listingPut(l); }
+    }
+    free(heirlooms);
+    heirlooms = NULL;
+    printf("Cache warmed with %d of the %d file(s) the old server had cached\n\n", warmed, total);
+}
+
+// Name: handoffListen()
+// Desc: Tells the server taken over from to drain, then listens on --handoff for the next one.
+// Arg : r - the first worker's reactor.
+// Pre : Every worker but the first is running.
+// Post: The old server is draining. Another process connecting to the socket gets the listening
+//       sockets, as handoffEvent() does. Without --handoff nothing is done.
+void handoffListen(struct reactor* r) {
+
+    struct sockaddr_un addr;
+    int fd;
+
+    if (heritage != -1) {
+        if (sendAll(heritage, "READY\n", 6) == -1) {
+            LOG_ERRNO(L_WARN, "WARNING, telling the old server to drain\n\n");
+        }
+        close(heritage);
+        heritage = -1;
+    }
+    if (cfg.handoff == NULL) { return; }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, cfg.handoff);
+    unlink(cfg.handoff); // the old server's, or one left behind
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1
+            || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1
+            || chmod(cfg.handoff, 0600) == -1 || listen(fd, 1) == -1) {
+        LOG_ERRNO(L_WARN, "WARNING, no handoff socket, no new process can take over\n\n");
+        if (fd != -1) { close(fd); }
+        return;
+    }
+    r->handoff.fd = fd;
+    r->handoff.kind = W_HANDOFF;
+    watchFd(r, &r->handoff, EPOLLIN);
+    LOG(L_INFO, "Handoff socket listening: %s\n\n", cfg.handoff);
+}
+
+// Name: heirDrop()
+// Desc: Gives up on the new process a handoff was started with.
+// Arg : r - the first worker's reactor.
+// Pre : None.
+// Post: The connection to it is closed and the cache names not yet sent are freed.
+static void heirDrop(struct reactor* r) {
+
+    if (r->heir.fd != -1) {
+        unwatchFd(r, &r->heir);
+        close(r->heir.fd);
+        r->heir.fd = -1;
+    }
+    free(bequest);
+    bequest = NULL;
+    bequestLen = bequestSent = 0;
+}
+
+// Name: handoffEvent()
+// Desc: Hands the listening sockets to a new process, or drains once it has taken over.
+// Arg1: r - the first worker's reactor.
+// Arg2: w - the handoff listener, or the connection to the new process.
+// Pre : The socket is readable, or the connection to the new process is writable.
+// Post: A new process is sent the listening sockets, then the names of the cached files as fast as
+//       it reads them, without the worker ever waiting on it. The server keeps serving until it
+//       says READY, then drains. If it goes away first nothing changes.
+void handoffEvent(struct reactor* r, struct watch* w) {
+
+    struct handoffHdr hdr;
+    union { struct cmsghdr align; char buf[CMSG_SPACE(HANDOFF_FDS * sizeof(int))]; } ctl;
+    struct iovec iov = { &hdr, sizeof(hdr) };
+    struct msghdr msg;
+    struct cmsghdr* cm;
+    int fds[HANDOFF_FDS], fd, n = 0, i, j;
+    char line[BUF_LEN];
+    long long sent;
+    ssize_t got;
+
+    if (w == &r->heir && bequestSent < bequestLen) {
+        if ((sent = sendAll(w->fd, bequest + bequestSent, bequestLen - bequestSent)) == -1) {
+            LOG_ERRNO(L_WARN, "WARNING, handing the listening sockets over\n\n");
+            heirDrop(r);
+            return;
+        }
+        if ((bequestSent += sent) < bequestLen) { return; } // the rest once it has read some
+        LOG(L_INFO, "Listening sockets handed to a new process, %lld bytes of cache names\n\n",
+            bequestLen);
+        free(bequest);
+        bequest = NULL;
+        bequestLen = bequestSent = 0;
+        watchFd(r, w, EPOLLIN); // it says READY once its workers are running
+        return;
+    }
+    if (w == &r->heir) {
+        got = recv(w->fd, line, sizeof(line) - 1, 0);
+        if (got == -1 && (errno == EAGAIN || errno == EINTR)) { return; }
+        heirDrop(r);
+        if (got >= 6 && memcmp(line, "READY\n", 6) == 0) {
+            LOG(L_INFO, "New process took over the listening sockets, draining\n\n");
+            handedOff = TRUE;
+            drainStart();
+        } else {
+            LOG(L_WARN, "WARNING, new process went away before taking over, still serving\n\n");
+        }
+        return;
+    }
+
+    if ((fd = accept4(w->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1) { return; }
+    heirDrop(r); // the last one never said READY, this one replaces it
+
+    // the distinct listening sockets in worker order, the adopted ones, then the metrics listener
+    for (i = 0; i < cfg.workers && n < HANDOFF_FDS - 1; i++) {
+        if (n > 0 && workerList[i].r.listen.fd == fds[n-1]) { continue; }
+        fds[n++] = workerList[i].r.listen.fd;
+    }
+    for (i = 0; i < cfg.workers; i++) {
+        for (j = 0; j < workerList[i].r.nAdopted && n < HANDOFF_FDS - 1; j++) {
+            fds[n++] = workerList[i].r.adopted[j].fd;
+        }
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.listeners = n;
+    hdr.shard = !workerList[0].r.shared;
+    hdr.metrics = (metricsSock != -1);
+    if (metricsSock != -1) { fds[n++] = metricsSock; }
+    if (cfg.cacheSize > 0 && (hdr.namesLen = cacheNames(&bequest)) == -1) { hdr.namesLen = 0; }
+    bequestLen = hdr.namesLen;
+
+    // the socket is new and empty, so the first message goes out whole or not at all
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+    cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(n * sizeof(int));
+    memcpy(CMSG_DATA(cm), fds, n * sizeof(int));
+    r->heir.fd = fd;
+    r->heir.kind = W_HANDOFF;
+    r->heir.events = 0;
+    if (sendmsg(fd, &msg, 0) != sizeof(hdr)) {
+        LOG_ERRNO(L_WARN, "WARNING, handing the listening sockets over\n\n");
+        heirDrop(r);
+        return;
+    }
+    if (bequestLen > 0) { watchFd(r, &r->heir, EPOLLOUT); return; }
+    LOG(L_INFO, "Listening sockets handed to a new process, no cache names\n\n");
+    watchFd(r, &r->heir, EPOLLIN);
+}
@@ -0,0 +1,1197 @@
+/*
+ * Name: io.c
+ * Auth: Andrew Swaim
+ * Date: November 2019
+ * Desc: File I/O: sends files with sendfile(), splice(), chunks or io_uring, receives uploads,
+ *       streams directory trees as archives, compresses with zlib and computes CRC32C.
+ */
+
+#include "ftpserver.h"
+
+// Name: sendFile()
+// Desc: Sends file contents straight from the page cache to the client with sendfile().
+// Arg1: conn - the socket file descriptor to send the data on.
+// Arg2: file - the file descriptor of the file to send.
+// Arg3: off - the offset in the file to send from, advanced past the data sent.
+// Arg4: len - the number of bytes to send.
+// Pre : The file is open and the length of the data was sent.
+// Post: The file is sent up to the provided length or until the non-blocking socket is full.
+// Rtrn: The total length sent (less than len if the socket would block), or -1 if an error is encountered.
+long long sendFile(int conn, int file, off_t* off, long long len) {
+
+    // Using sendfile to copy between file descriptors from official manpage
+    // http://man7.org/linux/man-pages/man2/sendfile.2.html
+    long long total = 0;
+    ssize_t n = 0;
+
+    while (total < len) {
+        n = TLS_ON(conn) ? tlsSendfile(conn, file, off, len - total) : sendfile(conn, file, off, len - total);
+        if (n == -1) {
+            if (errno == EINTR) { continue; }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { n = 0; } // socket full, finish later
+            break;
+        }
+        if (n == 0) { errno = EIO; n = -1; break; } // file shrank under us
+        total += n;
+    }
+
+    return ((n == -1) ? -1 : total);
+}
+
+// Name: spliceFile()
+// Desc: Sends file contents to the client by splicing them through a pipe, without copying to userspace.
+// Arg1: conn - the socket file descriptor to send the data on.
+// Arg2: file - the file descriptor of the file to send.
+// Arg3: pipefd - the pipe to splice through, created on first use.
+// Arg4: piped - the number of bytes sitting in the pipe from a previous call.
+// Arg5: off - the offset in the file of the next byte to read into the pipe, advanced as it is read.
+// Arg6: len - the number of bytes to send, including the ones already in the pipe.
+// Pre : The file is open and the length of the data was sent.
+// Post: The file is sent up to the provided length or until the non-blocking socket is full.
+// Rtrn: The total length sent (less than len if the socket would block), or -1 if an error is encountered.
+long long spliceFile(int conn, int file, int pipefd[2], int* piped, off_t* off, long long len) {
+
+    // Using splice to move data between a file and a socket from official manpage
+    // http://man7.org/linux/man-pages/man2/splice.2.html
+    long long total = 0;
+    ssize_t n;
+
+    if (pipefd[0] == -1 && pipe(pipefd) == -1) { return -1; }
+
+    while (total < len) {
+
+        // refill the pipe from the file
+        if (*piped == 0) {
+            n = splice(file, off, pipefd[1], NULL, (len - total < PIPE_CHUNK) ? len - total : PIPE_CHUNK, SPLICE_F_MOVE);
+            if (n == -1 && errno == EINTR) { continue; }
+            if (n <= 0) { if (n == 0) { errno = EIO; } return -1; }
+            *piped = n;
+        }
+
+        // drain the pipe to the socket
+        n = splice(pipefd[0], NULL, conn, NULL, *piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+        if (n == -1) {
+            if (errno == EINTR) { continue; }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { break; } // socket full, finish later
+            return -1;
+        }
+        *piped -= n;
+        total += n;
+    }
+
+    return total;
+}
+
+// Name: sendChunks()
+// Desc: Sends file contents to the client one chunk at a time through a fixed size buffer.
+// Arg1: conn - the socket file descriptor to send the data on.
+// Arg2: file - the file descriptor of the file to send.
+// Arg3: chunk - the buffer to read through, may hold data left from a previous call.
+// Arg4: off - the offset in the file of the next byte to read into the chunk.
+// Arg5: len - the number of bytes to send, including the ones already in the chunk.
+// Arg6: crc - checksum to extend over the data as it is read, or NULL.
+// Pre : The file is open and the length of the data was sent.
+// Post: The file is sent up to the provided length or until the non-blocking socket is full.
+// Rtrn: The total length sent (less than len if the socket would block), or -1 if an error is encountered.
+long long sendChunks(int conn, int file, struct chunk* chunk, off_t off, long long len, unsigned int* crc) {
+
+    long long total = 0;
+    ssize_t n;
+
+    while (total < len) {
+
+        // refill the chunk from the file
+        if (chunk->off == chunk->len) {
+            n = pread(file, chunk->data, (len - total < cfg.chunkSize) ? len - total : cfg.chunkSize, off);
+            if (n == -1 && errno == EINTR) { continue; }
+            if (n <= 0) { if (n == 0) { errno = EIO; } return -1; }
+            chunk->len = n;
+            chunk->off = 0;
+            off += n;
+            if (crc != NULL) { (*crc) = crc32c(*crc, chunk->data, n); }
+        }
+
+        // and send it
+        n = sendAll(conn, chunk->data + chunk->off, chunk->len - chunk->off);
+        if (n == -1) { return -1; }
+        chunk->off += n;
+        total += n;
+        if (chunk->off < chunk->len) { break; } // socket full, finish later
+    }
+
+    return total;
+}
+
+// Name: archiveOpen()
+// Desc: Starts an archive of a directory tree, walked afterwards with archiveWalk().
+// Arg : dir - the directory.
+// Pre : None.
+// Post: The archive is empty and its walk is at the root.
+// Rtrn: The archive, freed with archiveFree(), or NULL on error.
+struct archive* archiveOpen(char* dir) {
+
+    struct archive* a;
+    int fd = -1;
+
+    if ((a = calloc(1, sizeof(*a))) == NULL) { return NULL; }
+    a->fd = -1;
+    LOG(L_DEBUG, "Walking directory tree: %s\n\n", dir);
+    if ((a->root = pathOpen(dir, O_RDONLY | O_DIRECTORY)) == -1 || (fd = dup(a->root)) == -1
+            || (a->walk[0] = fdopendir(fd)) == NULL) {
+        if (fd != -1) { close(fd); }
+        LOG(L_ERROR, "ERROR, could not walk directory tree: %s\n\n", dir);
+        archiveFree(a);
+        return NULL;
+    }
+    a->depth = 1;
+    return a;
+}
+
+// Name: archiveWalk()
+// Desc: Goes on with the walk of an archive's tree, for a bounded number of directory entries.
+// Arg1: a - the archive.
+// Arg2: max - how many directory entries to read at most.
+// Pre : The walk is not done.
+// Post: Every regular file and directory under the root is added in the order its directory lists
+//       it, each directory before its contents, symbolic links, other files and the temporary
+//       files of uploads are left out. The walk goes through directory descriptors with openat(),
+//       so no path is looked up more than one level at a time.
+// Rtrn: 1 if there is more to walk, 0 once the walk is done, -1 on error. A path too long for the
+//       archive, or a directory deeper than ARCHIVE_DEPTH, is an error rather than a tree sent in part.
+int archiveWalk(struct archive* a, int max) {
+
+    struct dirent* dirEnt;
+    struct stat st;
+    int fd, sub, n;
+
+    while (a->depth > 0 && max-- > 0) {
+        n = a->walkLen[a->depth - 1];
+        if ((dirEnt = readdir(a->walk[a->depth - 1])) == NULL) { // this directory is done
+            closedir(a->walk[--a->depth]); // closes its descriptor too
+            continue;
+        }
+        if (strcmp(dirEnt->d_name, ".") == 0 || strcmp(dirEnt->d_name, "..") == 0) { continue; }
+        fd = dirfd(a->walk[a->depth - 1]);
+        if (fstatat(fd, dirEnt->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) { continue; } // gone already
+        if ((!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) || (S_ISREG(st.st_mode) && isPutTemp(dirEnt->d_name))) { continue; }
+        if (n + snprintf(a->path + n, sizeof(a->path) - n, "%s", dirEnt->d_name) >= (int)sizeof(a->path) - 1) {
+            LOG(L_WARN, "WARNING, path too long for archive: %.*s%s\n\n", n, a->path, dirEnt->d_name);
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        if (S_ISDIR(st.st_mode) && a->depth > ARCHIVE_DEPTH) {
+            LOG(L_WARN, "WARNING, directory too deep for archive: %s\n\n", a->path);
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        if (archiveAdd(a, a->path, &st) == -1) { return -1; }
+        if (S_ISDIR(st.st_mode)) {
+            if ((sub = openat(fd, dirEnt->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW)) == -1) { continue; }
+            if ((a->walk[a->depth] = fdopendir(sub)) == NULL) { close(sub); continue; }
+            strcat(a->path, "/");
+            a->walkLen[a->depth++] = strlen(a->path);
+        }
+    }
+    if (a->depth > 0) { return 1; }
+    LOG(L_INFO, "Archive of %d entries: %lld bytes\n\n", a->count, a->len);
+    return 0;
+}
+
+// Name: archiveAdd()
+// Desc: Adds an entry to an archive.
+// Arg1: a - the archive.
+// Arg2: path - the entry's path relative to the root.
+// Arg3: st - the entry's status.
+// Pre : None.
+// Post: The entries array and the name arena grow by doubling when full, the archive's length
+//       grows by the entry's.
+// Rtrn: 0 on success, -1 if out of memory.
+int archiveAdd(struct archive* a, const char* path, struct stat* st) {
+
+    struct archEntry* e;
+    char* names;
+    long long n = strlen(path), cap;
+
+    if (a->count == a->cap) {
+        cap = a->cap ? a->cap * 2 : 256;
+        if ((e = realloc(a->entries, cap * sizeof(*e))) == NULL) { return -1; }
+        a->entries = e;
+        a->cap = cap;
+    }
+    if (a->namesLen + n > a->namesCap) {
+        for (cap = a->namesCap ? a->namesCap : DIR_ARENA; cap < a->namesLen + n; cap *= 2) {}
+        if ((names = realloc(a->names, cap)) == NULL) { return -1; }
+        a->names = names;
+        a->namesCap = cap;
+    }
+    e = &a->entries[a->count++];
+    e->nameOff = a->namesLen;
+    e->nameLen = n;
+    e->mode = st->st_mode;
+    e->size = S_ISREG(st->st_mode) ? st->st_size : 0;
+    e->mtime = MTIME_NS(*st);
+    memcpy(a->names + a->namesLen, path, n);
+    a->namesLen += n;
+    a->len += ENTRY_HDR + n + e->size;
+    return 0;
+}
+
+// Name: archiveRead()
+// Desc: Produces the next bytes of an archive: each entry's header and name, then its content.
+// Arg1: a - the archive.
+// Arg2: buf - where to put the bytes.
+// Arg3: len - how many bytes, no more than are left.
+// Pre : None.
+// Post: A file that shrank since the walk is padded with zeros and one that grew is cut at the
+//       size it had, so the archive is exactly as long as the length sent ahead of it.
+// Rtrn: len, or -1 on error.
+long long archiveRead(struct archive* a, char* buf, long long len) {
+
+    struct archEntry* e;
+    unsigned int v;
+    long long done = 0, n, hdr;
+    char h[ENTRY_HDR];
+    char path[LINE_LEN];    // the walk keeps every name shorter than this
+    ssize_t got;
+    int i;
+
+    while (done < len && a->idx < a->count) {
+        e = &a->entries[a->idx];
+        hdr = ENTRY_HDR + e->nameLen;
+
+        // header then name
+        if (a->pos < hdr) {
+            v = htonl(e->nameLen); memcpy(h, &v, 4);
+            v = htonl(e->mode);    memcpy(h + 4, &v, 4);
+            for (i = 0; i < 8; i++) {
+                h[8 + i]  = (char)((unsigned long long)e->size >> (56 - 8 * i));
+                h[16 + i] = (char)((unsigned long long)e->mtime >> (56 - 8 * i));
+            }
+            for (; a->pos < hdr && done < len; a->pos++) {
+                buf[done++] = (a->pos < ENTRY_HDR) ? h[a->pos] : a->names[e->nameOff + a->pos - ENTRY_HDR];
+            }
+            if (a->pos == hdr && e->size > 0) {
+                memcpy(path, a->names + e->nameOff, e->nameLen);
+                path[e->nameLen] = '\0';
+                if ((a->fd = pathEntry(a->root, path)) == -1) {
+                    LOG(L_WARN, "WARNING, file gone from archive, sending zeros: %.*s\n\n", e->nameLen, a->names + e->nameOff);
+                }
+            }
+            continue;
+        }
+
+        // then the content
+        n = (len - done < hdr + e->size - a->pos) ? len - done : hdr + e->size - a->pos;
+        got = 0;
+        if (a->fd != -1 && (got = pread(a->fd, buf + done, n, a->pos - hdr)) == -1) {
+            if (errno == EINTR) { continue; }
+            return -1;
+        }
+        if (got < n) {
+            if (got == 0 && a->fd != -1) {
+                LOG(L_WARN, "WARNING, file shrank in archive, padding with zeros: %.*s\n\n", e->nameLen, a->names + e->nameOff);
+                close(a->fd);
+                a->fd = -1;
+            }
+            if (a->fd == -1) { memset(buf + done + got, 0, n - got); got = n; }
+        }
+        done += got;
+        a->pos += got;
+        if (a->pos == hdr + e->size) {
+            if (a->fd != -1) { close(a->fd); a->fd = -1; }
+            a->idx++;
+            a->pos = 0;
+        }
+    }
+    return done;
+}
+
+// Name: sendArchive()
+// Desc: Sends an archive one chunk at a time, as it is or as zlib blocks.
+// Arg1: conn - the data connection.
+// Arg2: a - the archive.
+// Arg3: chunk - the transfer's chunk, holding the bytes being sent.
+// Arg4: scratch - where to build the archive bytes before compressing them, cfg.chunkSize bytes.
+// Arg5: len - bytes of the archive left to send.
+// Arg6: zip - TRUE to send zlib blocks.
+// Arg7: crc - the CRC32C to extend over the archive (not the compressed blocks), or NULL.
+// Pre : The data connection is open and non-blocking.
+// Post: Chunks are sent until the socket is full or the archive is done.
+// Rtrn: Bytes of the archive in chunks that were sent whole, or -1 on error.
+long long sendArchive(int conn, struct archive* a, struct chunk* chunk, char* scratch, long long len, bool zip, unsigned int* crc) {
+
+    long long total = 0;
+    char* raw;
+    ssize_t n;
+
+    while (total < len) {
+
+        // build the next chunk of the archive
+        if (chunk->off == chunk->len) {
+            n = (len - total < cfg.chunkSize) ? len - total : cfg.chunkSize;
+            raw = zip ? scratch : chunk->data;
+            if (archiveRead(a, raw, n) != n) { return -1; }
+            if (crc != NULL) { (*crc) = crc32c(*crc, raw, n); }
+            chunk->len = zip ? zipBlock(chunk->data, raw, n) : n;
+            chunk->off = 0;
+            chunk->raw = n;
+        }
+
+        // and send it
+        n = sendAll(conn, chunk->data + chunk->off, chunk->len - chunk->off);
+        if (n == -1) { return -1; }
+        chunk->off += n;
+        if (chunk->off < chunk->len) { break; } // socket full, finish later
+        total += chunk->raw;
+    }
+
+    return total;
+}
+
+// Name: archiveFree()
+// Desc: Frees an archive.
+// Arg : a - the archive.
+// Pre : None.
+// Post: Everything the archive had open is closed.
+void archiveFree(struct archive* a) {
+
+    while (a->depth > 0) { closedir(a->walk[--a->depth]); }
+    if (a->fd != -1) { close(a->fd); }
+    if (a->root != -1) { close(a->root); }
+    free(a->entries);
+    free(a->names);
+    free(a);
+}
+
+// Name: getFile()
+// Desc: Gets data for the specified file name and stores it in a buffer.
+// Arg1: buf - the pointer to the uninitialized buffer to store the data.
+// Arg2: name - the name of the file to retrieve the data from.
+// Pre : A buffer is declared and a filename is obtained from a client command.
+// Post: The data for the file is obtained and stored in allocated memory in the buffer.
+// Rtrn: The size of the buffer or -1 if there was an error or the file was not found.
+long long getFile(char** buf, char *name) {
+
+    // Opening and reading files from official manpage
+    // http://man7.org/linux/man-pages/man3/fopen.3.html
+    // Using fseek and ftell to get the file size from official manpage
+    // http://man7.org/linux/man-pages/man3/fseek.3.html
+    FILE* file;
+    long size;
+    int fd;
+
+    LOG(L_DEBUG, "Attempting to open file: %s\n\n", name);
+    if ((fd = pathOpen(name, O_RDONLY)) == -1 || (file = fdopen(fd, "r")) == NULL) {
+        LOG(L_ERROR, "ERROR, could not open file: %s\n\n", name);
+        if (fd != -1) { close(fd); }
+        return -1;
+    }
+
+    // Get size of file
+    if (fseek(file, 0, SEEK_END) != 0
+            || (size = ftell(file)) == -1
+            || fseek(file, 0, SEEK_SET) != 0) {
+        LOG_ERRNO(L_ERROR, "ERROR, getting file size\n");
+        fclose(file);
+        return -1;
+    }
+    LOG(L_DEBUG, "Size of file: %ld\n\n", size);
+
+    // Get the file contents
+    (*buf) = malloc(sizeof(char) * (size+1));
+    if (fread((*buf), sizeof(char), size, file) < size || ferror(file)) {
+        LOG_ERRNO(L_ERROR, "ERROR, reading file contents to buffer\n\n");
+        free(*buf);
+        (*buf) = NULL;
+        fclose(file);
+        return -1;
+    } else {
+        (*buf)[size] = '\0';
+    }
+    fclose(file);
+    LOG(L_DEBUG, "Contents of file obtained.\n\n");
+
+    return size;
+}
+
+// Name: openFile()
+// Desc: Opens the specified file to stream it to the client without reading it into memory.
+// Arg1: file - where to store the file descriptor of the opened file.
+// Arg2: name - the name of the file to open.
+// Pre : A filename is obtained from a client command.
+// Post: The file is open for reading.
+// Rtrn: The size of the file or -1 if there was an error or the file was not found.
+long long openFile(int* file, char* name) {
+
+    struct stat st;
+
+    LOG(L_DEBUG, "Attempting to open file: %s\n\n", name);
+    if (((*file) = pathOpen(name, O_RDONLY)) == -1) {
+        LOG(L_ERROR, "ERROR, could not open file: %s\n\n", name);
+        return -1;
+    }
+    if (fstat((*file), &st) == -1 || !S_ISREG(st.st_mode)) {
+        LOG(L_ERROR, "ERROR, not a regular file: %s\n\n", name);
+        close(*file);
+        (*file) = -1;
+        return -1;
+    }
+    LOG(L_DEBUG, "Size of file: %lld\n\n", (long long)st.st_size);
+
+    return st.st_size;
+}
+
+// Name: hashKnown()
+// Desc: Checks if the checksums a connection worked out last are of a file as it is now.
+// Arg1: c - the connection.
+// Arg2: st - the file's status.
+// Arg3: block - the SUMS block size the block checksums must be of, 0 if only the CRC32C is needed.
+// Pre : None.
+// Post: None.
+// Rtrn: TRUE if c->hash holds them, FALSE if the file has to be read through with hashStart().
+bool hashKnown(struct conn* c, struct stat* st, long long block) {
+
+    struct hashJob* h = &c->hash;
+
+    return (h->done && h->dev == st->st_dev && h->ino == st->st_ino && h->size == st->st_size && h->mtime == MTIME_NS(*st)
+            && (block == 0 || (h->sums != NULL && h->block == block))) ? TRUE : FALSE;
+}
+
+// Name: unchanged()
+// Desc: Checks if the client's copy of a file (from HAVE) is the same as the file.
+// Arg1: c - the connection, with the file opened if this is for a -g.
+// Arg2: have - what the client said it has.
+// Arg3: name - name of the file.
+// Arg4: st - the file's status.
+// Pre : For HAVE CRC of a file that is neither cached nor read into memory, hashKnown() is TRUE.
+// Post: None.
+// Rtrn: TRUE if the client's copy is current.
+bool unchanged(struct conn* c, enum haveKind have, char* name, struct stat* st) {
+
+    if (have == H_STAT) {
+
+        // times set with utimes() only keep microseconds
+        return st->st_size == c->haveSize && MTIME_NS(*st) / 1000 == c->haveMtime / 1000;
+    }
+    if (c->cached != NULL) { return c->cached->crc == c->haveCrc; }
+    if (c->msg != NULL) { return crc32c(0, c->msg, st->st_size) == c->haveCrc; }
+    return c->hash.crc == c->haveCrc;
+}
+
+// Name: recvChunks()
+// Desc: Receives an upload through a chunk, writing each read to the file.
+// Arg1: conn - the data connection.
+// Arg2: file - the file to write to.
+// Arg3: chunk - the transfer's chunk.
+// Arg4: off - offset of the file to write the next byte at.
+// Arg5: len - bytes of the upload left.
+// Pre : The data connection is open and non-blocking.
+// Post: Everything the socket had is written to the file, nothing is left in the chunk.
+// Rtrn: The number of bytes received, or -1 on error (including the client closing early).
+long long recvChunks(int conn, int file, struct chunk* chunk, off_t off, long long len) {
+
+    long long total = 0;
+    ssize_t n, w, done;
+
+    while (total < len) {
+        n = recvSome(conn, chunk->data, (len - total < cfg.chunkSize) ? len - total : cfg.chunkSize);
+        if (n == -1) {
+            if (errno == EINTR) { continue; }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { break; } // socket empty, finish later
+            return -1;
+        }
+        if (n == 0) { errno = ECONNRESET; return -1; }
+        for (done = 0; done < n; done += w) {
+            if ((w = pwrite(file, chunk->data + done, n - done, off + total + done)) == -1) {
+                if (errno == EINTR) { w = 0; continue; }
+                return -1;
+            }
+        }
+        total += n;
+    }
+
+    return total;
+}
+
+// Name: spliceIn()
+// Desc: Receives an upload with splice() from the socket to a pipe and from the pipe to the file.
+// Arg1: conn - the data connection.
+// Arg2: file - the file to write to.
+// Arg3: pipefd - the transfer's pipe, created if it is not open yet.
+// Arg4: off - offset of the file to write the next byte at.
+// Arg5: len - bytes of the upload left.
+// Pre : The data connection is open and non-blocking.
+// Post: Everything the socket had is moved to the file, the pipe is left empty.
+// Rtrn: The number of bytes received, or -1 on error (including the client closing early).
+long long spliceIn(int conn, int file, int pipefd[2], off_t off, long long len) {
+
+    long long total = 0;
+    ssize_t n, m, done;
+    loff_t pos;
+
+    if (pipefd[0] == -1 && pipe(pipefd) == -1) { return -1; }
+
+    while (total < len) {
+
+        // fill the pipe from the socket
+        n = splice(conn, NULL, pipefd[1], NULL, (len - total < PIPE_CHUNK) ? len - total : PIPE_CHUNK,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == -1) {
+            if (errno == EINTR) { continue; }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { break; } // socket empty, finish later
+            return -1;
+        }
+        if (n == 0) { errno = ECONNRESET; return -1; }
+
+        // and drain it to the file
+        for (done = 0; done < n; done += m) {
+            pos = off + total + done;
+            if ((m = splice(pipefd[0], NULL, file, &pos, n - done, SPLICE_F_MOVE)) <= 0) {
+                if (m == -1 && errno == EINTR) { m = 0; continue; }
+                if (m == 0) { errno = EIO; }
+                return -1;
+            }
+        }
+        total += n;
+    }
+
+    return total;
+}
+
+// Name: putTempName()
+// Desc: Makes up a name for the temporary file of an upload.
+// Arg1: temp - where to store the name, the length of leaf plus PUT_TEMP bytes.
+// Arg2: leaf - the name the upload is stored under, relative to its directory.
+// Arg3: i - the attempt, so a name taken already is followed by a different one.
+// Pre : None.
+// Post: temp is a hidden name next to the file, so the rename stays in one file system. It starts
+//       with PUT_PREFIX, which no upload can be stored under.
+static void putTempName(char* temp, const char* leaf, int i) {
+
+    sprintf(temp, PUT_PREFIX "%06x.%s", (unsigned int)(nowUs() ^ (i * 2654435761u)) & 0xffffff, leaf);
+}
+
+// Name: isPutTemp()
+// Desc: Tells whether a name is one putTempName() makes up.
+// Arg : leaf - the name, relative to its directory.
+// Pre : None.
+// Post: None.
+// Rtrn: TRUE if it starts with PUT_PREFIX. Such a file may be an upload still being received, it
+//       is never listed, archived or sent, and putOpen() refuses the name.
+bool isPutTemp(const char* leaf) {
+
+    return strncmp(leaf, PUT_PREFIX, sizeof(PUT_PREFIX) - 1) == 0;
+}
+
+// Name: putOpen()
+// Desc: Creates the temporary file an upload is received into, in the directory it is stored in.
+// Arg1: name - the name the upload is stored under.
+// Arg2: len - the length of the upload, allocated up front.
+// Arg3: temp - where to store the name of the temporary file, relative to its directory.
+// Arg4: dir - where to store the directory, open until the upload is stored with putStore().
+// Pre : None.
+// Post: The file is created with O_TMPFILE, without a name, and temp is "". Only where the file
+//       system has no O_TMPFILE is it created under the name stored in temp.
+// Rtrn: The open file, or -1 on error (a name that leaves the root, or no space).
+int putOpen(char* name, long long len, char* temp, int* dir) {
+
+    const char* leaf;
+    int fd, i;
+
+    // stay inside the root, the file itself must be a plain name in its directory
+    if (name[0] == '\0' || name[strlen(name) - 1] == '/' || (*dir = pathParent(name, &leaf)) == -1
+            || strcmp(leaf, ".") == 0 || strcmp(leaf, "..") == 0 || isPutTemp(leaf)) {
+        LOG(L_ERROR, "ERROR, refusing upload name: %s\n\n", name);
+        if (*dir != -1) { close(*dir); *dir = -1; }
+        return -1;
+    }
+
+    // nothing can list or fetch a file without a name before it is all there
+    temp[0] = '\0';
+    if ((fd = openat(*dir, ".", O_TMPFILE | O_RDWR | O_CLOEXEC, 0644)) == -1) {
+        for (i = 0; i < 100 && fd == -1; i++) {
+            putTempName(temp, leaf, i);
+            if ((fd = openat(*dir, temp, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644)) == -1 && errno != EEXIST) { break; }
+        }
+    }
+    if (fd == -1) {
+        LOG(L_ERROR, "ERROR, could not create upload file for: %s\n\n", name);
+        close(*dir);
+        *dir = -1;
+        return -1;
+    }
+
+    // file systems without fallocate() just grow the file as it is written
+    if (len > 0 && fallocate(fd, 0, 0, len) == -1 && errno != EOPNOTSUPP && errno != ENOSYS) {
+        LOG_ERRNO(L_ERROR, "ERROR, allocating upload file\n\n");
+        close(fd);
+        if (temp[0] != '\0') { unlinkat(*dir, temp, 0); }
+        close(*dir);
+        *dir = -1;
+        return -1;
+    }
+    return fd;
+}
+
+// Name: putStore()
+// Desc: Gives an upload received in full the name it is stored under.
+// Arg1: file - the upload's file.
+// Arg2: dir - the directory putOpen() stored.
+// Arg3: temp - the temporary name putOpen() stored, a name linked in here is stored in it.
+// Arg4: leaf - the name to store the upload under, relative to dir.
+// Pre : putOpen() created the file.
+// Post: The file is on disk under the name, replacing any file there. A file without a name is
+//       linked in, or if the name is taken linked in under a temporary name and renamed over it,
+//       so no client ever sees the name missing. On failure temp names what is left to remove.
+// Rtrn: 0 on success, -1 with errno set.
+int putStore(int file, int dir, char* temp, const char* leaf) {
+
+    char proc[32];
+    int i;
+
+    if (fsync(file) == -1) { return -1; }
+    if (temp[0] == '\0') {
+        sprintf(proc, "/proc/self/fd/%d", file);
+        if (linkat(AT_FDCWD, proc, dir, leaf, AT_SYMLINK_FOLLOW) == 0) { return 0; }
+        if (errno != EEXIST) { return -1; }
+        for (i = 0; i < 100; i++) {
+            putTempName(temp, leaf, i);
+            if (linkat(AT_FDCWD, proc, dir, temp, AT_SYMLINK_FOLLOW) == 0) { return renameat(dir, temp, dir, leaf); }
+            if (errno != EEXIST) { break; }
+        }
+        temp[0] = '\0'; // nothing was linked
+        return -1;
+    }
+    return renameat(dir, temp, dir, leaf);
+}
+
+// Name: sendZipped()
+// Desc: Sends a file (or buffer) as zlib blocks, compressing one chunk at a time.
+// Arg1: conn - the data connection.
+// Arg2: file - the file to read from, if src is NULL.
+// Arg3: src - the whole file in memory, or NULL to read it from file.
+// Arg4: chunk - the transfer's chunk, holding the block being sent.
+// Arg5: scratch - where to read the file before compressing it, cfg.chunkSize bytes.
+// Arg6: off - offset of the file where the block being sent starts, or the next one if none is.
+// Arg7: len - bytes of the file left to send.
+// Arg8: crc - the CRC32C to extend over the file data (not the compressed blocks), or NULL.
+// Pre : The data connection is open and non-blocking.
+// Post: Blocks are sent until the socket is full or the file is done, the one the socket was full
+//       on is kept in the chunk.
+// Rtrn: Bytes of the file in blocks that were sent whole, or -1 on error.
+long long sendZipped(int conn, int file, const char* src, struct chunk* chunk, char* scratch, off_t off, long long len, unsigned int* crc) {
+
+    long long total = 0;
+    const char* raw;
+    ssize_t n;
+
+    while (total < len) {
+
+        // compress the next chunk of the file into a block
+        if (chunk->off == chunk->len) {
+            n = (len - total < cfg.chunkSize) ? len - total : cfg.chunkSize;
+            if (src != NULL) {
+                raw = src + off + total;
+            } else {
+                if ((n = pread(file, scratch, n, off + total)) == -1 && errno == EINTR) { continue; }
+                if (n <= 0) { if (n == 0) { errno = EIO; } return -1; }
+                raw = scratch;
+            }
+            if (crc != NULL) { (*crc) = crc32c(*crc, raw, n); }
+            chunk->len = zipBlock(chunk->data, raw, n);
+            chunk->off = 0;
+            chunk->raw = n;
+        }
+
+        // and send it
+        n = sendAll(conn, chunk->data + chunk->off, chunk->len - chunk->off);
+        if (n == -1) { return -1; }
+        chunk->off += n;
+        if (chunk->off < chunk->len) { break; } // socket full, finish later
+        total += chunk->raw;
+    }
+
+    return total;
+}
+
+// Name: zipBlock()
+// Desc: Compresses one block of a zlib transfer, so each block can be inflated on its own.
+// Arg1: dst - where to write the block, BLOCK_HDR bytes more than n.
+// Arg2: src - the file data.
+// Arg3: n - the length of the file data.
+// Pre : None.
+// Post: The block header (raw length and compressed length, big-endian) is followed by the compressed
+//       data, or by the file data as it is with a compressed length of 0 if compressing did not shrink it.
+// Rtrn: The length of the block.
+int zipBlock(char* dst, const char* src, int n) {
+
+    uLongf zlen = n;
+    unsigned int v;
+
+    if (compress2((Bytef*)dst + BLOCK_HDR, &zlen, (const Bytef*)src, n, cfg.zlevel) != Z_OK || (int)zlen >= n) {
+        memcpy(dst + BLOCK_HDR, src, n);
+        zlen = 0;
+    }
+    v = htonl(n);
+    memcpy(dst, &v, 4);
+    v = htonl(zlen);
+    memcpy(dst + 4, &v, 4);
+    return BLOCK_HDR + (zlen ? (int)zlen : n);
+}
+
+// Name: zipBlocks()
+// Desc: Compresses a whole file into zlib blocks of cfg.chunkSize.
+// Arg1: src - the file contents.
+// Arg2: size - the size of the file.
+// Arg3: buf - a pointer to the buffer that will hold the blocks.
+// Pre : None.
+// Post: The blocks are allocated in buf and must be freed.
+// Rtrn: The length of the blocks, or -1 on error.
+long long zipBlocks(const char* src, long long size, char** buf) {
+
+    long long off, len = 0;
+    char* z;
+    int n;
+
+    // a block is never longer than its data and the header
+    if ((*buf = malloc(size + (size / cfg.chunkSize + 1) * BLOCK_HDR)) == NULL) { return -1; }
+    for (off = 0; off < size; off += n) {
+        n = (size - off < cfg.chunkSize) ? size - off : cfg.chunkSize;
+        len += zipBlock(*buf + len, src + off, n);
+    }
+    if ((z = realloc(*buf, len)) != NULL) { *buf = z; }
+    return len;
+}
+
+// Name: compressible()
+// Desc: Checks if a file is worth compressing from its extension.
+// Arg : name - the filename.
+// Pre : None.
+// Post: None.
+// Rtrn: FALSE for formats that are compressed already.
+bool compressible(char* name) {
+
+    static const char* const packed[] = { "gz", "tgz", "bz2", "xz", "zst", "lz4", "zip", "7z", "rar", "jar",
+        "jpg", "jpeg", "png", "gif", "webp", "mp3", "mp4", "mkv", "webm", "ogg", "flac", "pdf", NULL };
+    char* ext = strrchr(name, '.');
+    int i;
+
+    if (ext == NULL) { return TRUE; }
+    for (i = 0; packed[i] != NULL; i++) {
+        if (strcasecmp(ext + 1, packed[i]) == 0) { return FALSE; }
+    }
+    return TRUE;
+}
+
+// Name: chunkGet()
+// Desc: Takes a chunked transfer buffer from the worker's pool, allocating one if the pool is empty.
+// Arg : r - the reactor that owns the pool.
+// Pre : None.
+// Post: The chunk belongs to the caller until it is given back with chunkPut().
+// Rtrn: An empty chunk of cfg.chunkSize bytes, or NULL if out of memory.
+struct chunk* chunkGet(struct reactor* r) {
+
+    struct chunk* ch;
+
+    if ((ch = r->pool) != NULL) {
+        r->pool = ch->next;
+        r->pooled--;
+    } else if ((ch = malloc(sizeof(*ch) + cfg.chunkSize + BLOCK_HDR)) == NULL) {
+        return NULL;
+    } else {
+        ch->buf = -1;
+    }
+    ch->next = NULL;
+    ch->len = ch->off = 0;
+    return ch;
+}
+
+// Name: chunkPut()
+// Desc: Gives a chunked transfer buffer back to the worker's pool.
+// Arg1: r - the reactor that owns the pool.
+// Arg2: ch - the chunk to give back.
+// Pre : ch came from chunkGet() on the same reactor.
+// Post: The chunk is kept for reuse, or freed if the pool is full.
+void chunkPut(struct reactor* r, struct chunk* ch) {
+
+    if (ch->buf != -1) { ch->next = r->ring.bufs; r->ring.bufs = ch; return; } // registered, never freed
+    if (r->pooled >= POOL_MAX) { free(ch); return; }
+    ch->next = r->pool;
+    r->pool = ch;
+    r->pooled++;
+}
+
+// Name: ringInit()
+// Desc: Sets up the worker's io_uring and registers its read buffers.
+// Arg : r - the reactor to setup the ring for.
+// Pre : The reactor's epoll instance was created.
+// Post: The ring's fd is watched for completions. The ring checks which operations the kernel has,
+//       and if its chunks cannot be registered the reads go to plain pooled chunks instead.
+// Rtrn: 0 on success, -1 if the kernel has no io_uring (or it is disabled).
+int ringInit(struct reactor* r) {
+
+    struct ring* q = &r->ring;
+    struct io_uring_params p;
+    struct io_uring_probe* probe;
+    char *sq, *cq;
+    size_t sqLen, cqLen;
+    int fd, n;
+
+    memset(&p, 0, sizeof(p));
+    if ((fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p)) == -1) { return -1; }
+
+    // map the queues, one mapping when the kernel puts both rings in it
+    sqLen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqLen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) { sqLen += cqLen; }
+    if ((sq = mmap(NULL, sqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                   IORING_OFF_SQ_RING)) == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    cq = sq;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)
+            && (cq = mmap(NULL, cqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                          IORING_OFF_CQ_RING)) == MAP_FAILED) {
+        munmap(sq, sqLen);
+        close(fd);
+        return -1;
+    }
+    if ((q->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES)) == MAP_FAILED) {
+        if (cq != sq) { munmap(cq, cqLen); }
+        munmap(sq, sqLen);
+        close(fd);
+        return -1;
+    }
+    q->sqHead = (unsigned*)(sq + p.sq_off.head);
+    q->sqTail = (unsigned*)(sq + p.sq_off.tail);
+    q->sqMask = (unsigned*)(sq + p.sq_off.ring_mask);
+    q->sqArray = (unsigned*)(sq + p.sq_off.array);
+    q->cqHead = (unsigned*)(cq + p.cq_off.head);
+    q->cqTail = (unsigned*)(cq + p.cq_off.tail);
+    q->cqMask = (unsigned*)(cq + p.cq_off.ring_mask);
+    q->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    q->entries = p.sq_entries;
+
+    // zero copy sends need 6.0, plain sends are used without them
+    n = sizeof(*probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    if ((probe = calloc(1, n)) != NULL) {
+        if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0) {
+            q->zc = (probe->last_op >= IORING_OP_SEND_ZC && (probe->ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED));
+        }
+        free(probe);
+    }
+
+    q->w.fd = fd;
+    q->w.kind = W_RING;
+    q->w.conn = NULL;
+    watchFd(r, &q->w, EPOLLIN);
+
+    // registered buffers are pinned, as many as the locked memory limit allows
+    for (n = RING_BUFS; n > 0 && ringBufs(r, n) == -1; n /= 2) {}
+    LOG(L_INFO, "io_uring ready: %u entries, %d registered chunks, %s sends\n\n", q->entries, n, q->zc ? "zero copy" : "copying");
+    return 0;
+}
+
+// Name: ringBufs()
+// Desc: Allocates chunks and registers them with the worker's io_uring as fixed buffers.
+// Arg1: r - the reactor whose ring to register with.
+// Arg2: count - the number of chunks.
+// Pre : ringInit() setup the ring.
+// Post: The chunks are the ring's idle registered chunks.
+// Rtrn: 0 on success, -1 on error.
+int ringBufs(struct reactor* r, int count) {
+
+    struct iovec iov[RING_BUFS];
+    struct chunk* ch[RING_BUFS];
+    int i, j;
+
+    for (i = 0; i < count; i++) {
+        if ((ch[i] = malloc(sizeof(*ch[i]) + cfg.chunkSize + BLOCK_HDR)) == NULL) { break; }
+        ch[i]->buf = i;
+        iov[i].iov_base = ch[i]->data;
+        iov[i].iov_len = cfg.chunkSize;
+    }
+    if (i < count || syscall(__NR_io_uring_register, r->ring.w.fd, IORING_REGISTER_BUFFERS, iov, count) == -1) {
+        for (j = 0; j < i; j++) { free(ch[j]); }
+        return -1;
+    }
+    for (i = 0; i < count; i++) { chunkPut(r, ch[i]); }
+    return 0;
+}
+
+// Name: ringSqe()
+// Desc: Takes the next free submission queue entry of the worker's io_uring.
+// Arg : r - the reactor that owns the ring.
+// Pre : ringInit() setup the ring.
+// Post: The entry is cleared and queued, it goes to the kernel with the next ringSubmit(). Without
+//       SQPOLL the kernel only reads the queue inside io_uring_enter(), so the tail can move first.
+// Rtrn: The entry to fill in, or NULL if the queue is full even after submitting.
+struct io_uring_sqe* ringSqe(struct reactor* r) {
+
+    struct ring* q = &r->ring;
+    struct io_uring_sqe* sqe;
+    unsigned tail = *q->sqTail, idx;
+
+    if (tail - __atomic_load_n(q->sqHead, __ATOMIC_ACQUIRE) == q->entries) {
+        ringSubmit(r);
+        if (tail - __atomic_load_n(q->sqHead, __ATOMIC_ACQUIRE) == q->entries) { return NULL; }
+    }
+    idx = tail & *q->sqMask;
+    sqe = &q->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    q->sqArray[idx] = idx;
+    __atomic_store_n(q->sqTail, tail + 1, __ATOMIC_RELEASE);
+    q->queued++;
+    return sqe;
+}
+
+// Name: ringSubmit()
+// Desc: Hands every queued submission to the kernel.
+// Arg : r - the reactor that owns the ring.
+// Pre : ringInit() setup the ring.
+// Post: The queued entries are submitted, or left queued for the next call if the kernel is busy.
+void ringSubmit(struct reactor* r) {
+
+    int n;
+
+    while (r->ring.queued > 0) {
+        if ((n = syscall(__NR_io_uring_enter, r->ring.w.fd, r->ring.queued, 0, 0, NULL, 0)) == -1) {
+            if (errno == EINTR) { continue; }
+            if (errno != EAGAIN && errno != EBUSY) { LOG_ERRNO(L_ERROR, "ERROR, submitting to io_uring\n\n"); }
+            return;
+        }
+        r->ring.queued -= n;
+    }
+}
+
+// Name: ringFile()
+// Desc: Queues the next operation of a --transfer uring file transfer: a read of the next chunk
+//       once the last one is sent, else a send of what is left of it.
+// Arg1: r - the reactor the connection belongs to.
+// Arg2: c - the connection sending the file.
+// Pre : The length of the data was sent.
+// Post: The operation is queued, its completion carries on with the transfer. Nothing is queued
+//       while the ring is still busy with the connection.
+// Rtrn: 0 (the completions count the bytes sent), or -1 on error.
+int ringFile(struct reactor* r, struct conn* c) {
+
+    struct io_uring_sqe* sqe;
+    struct chunk* ch;
+    long long n;
+
+    if (c->ringOps > 0 || c->sent == c->len) { return 0; }
+    unwatchFd(r, &c->data); // the ring waits for the socket
+    if (c->chunk == NULL) {
+        if ((ch = r->ring.bufs) != NULL) {
+            r->ring.bufs = ch->next;
+            ch->next = NULL;
+            ch->len = ch->off = 0;
+        } else if ((ch = chunkGet(r)) == NULL) {
+            return -1;
+        }
+        c->chunk = ch;
+    }
+    ch = c->chunk;
+    if ((sqe = ringSqe(r)) == NULL) { errno = EBUSY; return -1; }
+    sqe->user_data = (unsigned long)c;
+
+    // send what is left of the chunk, zero copy straight from the registered buffer if it is one
+    if (ch->off < ch->len) {
+        sqe->opcode = (r->ring.zc && !TLS_ON(c->data.fd)) ? IORING_OP_SEND_ZC : IORING_OP_SEND; // kTLS has no zero copy
+        sqe->fd = c->data.fd;
+        sqe->addr = (unsigned long)(ch->data + ch->off);
+        sqe->len = ch->len - ch->off;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        if (r->ring.zc && ch->buf != -1) {
+            sqe->ioprio = IORING_RECVSEND_FIXED_BUF;
+            sqe->buf_index = ch->buf;
+        }
+        c->ringOp = R_SEND;
+        c->ringOps = 1;
+        return 0;
+    }
+
+    // or read the next one
+    n = (c->len - c->sent < cfg.chunkSize) ? c->len - c->sent : cfg.chunkSize;
+    sqe->opcode = (ch->buf != -1) ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = c->file;
+    sqe->off = c->off + c->sent;
+    sqe->addr = (unsigned long)ch->data;
+    sqe->len = n;
+    if (ch->buf != -1) { sqe->buf_index = ch->buf; }
+    c->ringOp = R_READ;
+    c->ringOps = 1;
+    return 0;
+}
+
+// Name: ringReap()
+// Desc: Handles every completion waiting on the worker's io_uring.
+// Arg : r - the reactor that owns the ring.
+// Pre : The ring's fd is readable.
+// Post: The completion queue is empty, each completion was handed to its connection.
+void ringReap(struct reactor* r) {
+
+    struct ring* q = &r->ring;
+    struct io_uring_cqe* cqe;
+    struct conn* c;
+    unsigned head = *q->cqHead;
+    unsigned int flags;
+    int res;
+
+    while (head != __atomic_load_n(q->cqTail, __ATOMIC_ACQUIRE)) {
+        cqe = &q->cqes[head & *q->cqMask];
+        c = (struct conn*)(unsigned long)cqe->user_data;
+        res = cqe->res;
+        flags = cqe->flags;
+        __atomic_store_n(q->cqHead, ++head, __ATOMIC_RELEASE); // the slot is free before the handler queues more
+        if (c != NULL) { ringDone(r, c, res, flags); } // cancellations have no connection
+    }
+}
+
+// Name: ringDone()
+// Desc: Carries on with a --transfer uring file transfer once one of its operations completes.
+// Arg1: r - the reactor the connection belongs to.
+// Arg2: c - the connection the operation was for.
+// Arg3: res - the operation's result, bytes moved or a negated errno.
+// Arg4: flags - the completion's flags. A zero copy send completes twice: its result with
+//       IORING_CQE_F_MORE, then IORING_CQE_F_NOTIF once the kernel is done with the buffer.
+// Pre : The completion was taken from the ring.
+// Post: The next operation is queued, or the transfer is finished or failed.
+void ringDone(struct reactor* r, struct conn* c, int res, unsigned int flags) {
+
+    if (!(flags & IORING_CQE_F_MORE)) { c->ringOps--; } // else the notification is still to come
+    if (c->closed) {
+        if (c->ringOps == 0) {
+            if (c->chunk != NULL) { chunkPut(r, c->chunk); }
+            connPut(r, c);
+        }
+        return;
+    }
+    if (!(flags & IORING_CQE_F_NOTIF)) {
+        if (res == -EAGAIN && c->ringOp == R_SEND) { // socket full, let epoll say when to send again
+            if (c->ringOps == 0) { watchFd(r, &c->data, EPOLLOUT); }
+            return;
+        }
+        if (res < 0 || (res == 0 && c->ringOp == R_READ)) {
+            errno = (res < 0) ? -res : EIO;
+            LOG_ERRNO(c->ringOp == R_READ ? L_ERROR : L_WARN, c->ringOp == R_READ ? "ERROR, reading file\n\n" : "WARNING, entire message not sent\n\n");
+            closeConn(r, c);
+            return;
+        }
+        if (c->ringOp == R_READ) {
+            c->chunk->len = res;
+            c->chunk->off = 0;
+            if (c->check) { c->crc = crc32c(c->crc, c->chunk->data, res); }
+        } else {
+            c->chunk->off += res;
+            c->sent += res;
+            schedCharge(c, res);
+        }
+    }
+    if (c->ringOps == 0) { sendData(r, c); }
+}
+
+// Name: crcInit()
+// Desc: Builds the table for the software CRC32C and checks for the SSE4.2 crc32 instruction.
+// Pre : None.
+// Post: crc32c() is ready to use.
+void crcInit(void) {
+
+    unsigned int i, j, crc;
+
+    for (i = 0; i < 256; i++) {
+        for (crc = i, j = 0; j < 8; j++) { crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1)); }
+        crcTable[i] = crc;
+    }
+#if defined(__x86_64__)
+    crcHw = __builtin_cpu_supports("sse4.2");
+#endif
+    LOG(L_INFO, "CRC32C checksums computed in %s\n\n", crcHw ? "hardware (SSE4.2)" : "software");
+}
+
+// Name: crc32c()
+// Desc: Extends a CRC32C (Castagnoli) checksum over more data.
+// Arg1: crc - the checksum of the data so far, 0 to start.
+// Arg2: buf - the data.
+// Arg3: len - the length of the data.
+// Pre : crcInit() was called.
+// Post: None.
+// Rtrn: The checksum of the data so far followed by buf.
+unsigned int crc32c(unsigned int crc, const char* buf, long long len) {
+
+    const unsigned char* p = (const unsigned char*)buf;
+
+#if defined(__x86_64__)
+    if (crcHw) { return crc32cHw(crc, buf, len); }
+#endif
+    crc = ~crc;
+    while (len-- > 0) { crc = (crc >> 8) ^ crcTable[(crc ^ *p++) & 0xff]; }
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+// Name: crc32cHw()
+// Desc: crc32c() using the SSE4.2 crc32 instruction, eight bytes at a time.
+// Arg1: crc - the checksum of the data so far, 0 to start.
+// Arg2: buf - the data.
+// Arg3: len - the length of the data.
+// Pre : The CPU supports SSE4.2.
+// Post: None.
+// Rtrn: The checksum of the data so far followed by buf.
+__attribute__((target("sse4.2")))
+unsigned int crc32cHw(unsigned int crc, const char* buf, long long len) {
+
+    unsigned long long c = ~crc & 0xffffffffu, w;
+
+    while (len > 0 && ((unsigned long)buf & 7) != 0) { c = __builtin_ia32_crc32qi(c, *buf++); len--; }
+    while (len >= 8) {
+        memcpy(&w, buf, 8);
+        c = __builtin_ia32_crc32di(c, w);
+        buf += 8;
+        len -= 8;
+    }
+    while (len-- > 0) { c = __builtin_ia32_crc32qi(c, *buf++); }
+    return ~(unsigned int)c;
+}
+#endif
+
+// Name: parseSize()
+// Desc: Parses a size in bytes with an optional K, M or G suffix.
+// Arg : str - the size string, like 65536 or 1M.
+// Pre : None.
+// Post: None.
+// Rtrn: The size in bytes, or -1 if the string is not a size or does not fit in a long long.
+long long parseSize(char* str) {
+
+    char* end;
+    long long size;
+    int shift = 0;
+
+    errno = 0;
+    size = strtoll(str, &end, 10);
+
+    if (end == str || size < 0 || (size == LLONG_MAX && errno == ERANGE)) { return -1; }
+    switch (*end) {
+    case 'k': case 'K': shift = 10; end++; break;
+    case 'm': case 'M': shift = 20; end++; break;
+    case 'g': case 'G': shift = 30; end++; break;
+    }
+    if (size > (LLONG_MAX >> shift)) { return -1; } // too big to be a size, not wrapped around
+    return (*end == '\0') ? size << shift : -1;
+}
+
+// Name: parseHex()
+// Desc: Parses a 32-bit value in hex, like a checksum.
+// Arg : str - the hex string, like e3069283.
+// Pre : None.
+// Post: None.
+// Rtrn: The value, or -1 if the string is not 32-bit hex.
+long long parseHex(char* str) {
+
+    char* end;
+    long long val = strtoll(str, &end, 16);
+
+    return (end == str || *end != '\0' || val < 0 || val > 0xffffffffLL) ? -1 : val;
+}
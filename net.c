@@ -0,0 +1,913 @@
+/*
+ * Name: net.c
+ * Auth: Andrew Swaim
+ * Date: November 2019
+ * Desc: Sockets and the reactor: listening and data sockets, the epoll loop of each worker,
+ *       its timers, and the connections and passive listeners it recycles.
+ */
+
+#include "ftpserver.h"
+
+// Name: ctrlListen()
+// Desc: Gets the server info, sets up the socket, and tries to bind and listen on a port number.
+// Arg1: The port number to try to bind and listen on.
+// Arg2: shard - if TRUE the socket is opened with SO_REUSEPORT so every worker can bind its own,
+//       set to FALSE if the kernel does not support it.
+// Pre : A port number were declared on the command line and passed as the arg.
+// Post: The server either successfully binds, listens, and returns the socket file descriptor or exits.
+// Rtrn: The socket file descriptor for the connection.
+int ctrlListen(char *port, bool* shard) {
+
+    // Socket setup and connection from Beej's guide
+    // in the section 'A Simple Stream Server'
+    // https://beej.us/guide/bgnet/html/#a-simple-stream-server
+    int sock, yes=1;
+    struct addrinfo addr, *serv, *ptr;
+
+    // setup server address struct
+    memset(&addr, 0, sizeof(addr));
+    addr.ai_family = AF_UNSPEC;
+    addr.ai_socktype = SOCK_STREAM;
+    addr.ai_flags = AI_PASSIVE;
+
+    // get address info of the server host
+    if (getaddrinfo(NULL, port, &addr, &serv) != 0) {
+        fprintf(stderr, "ERROR, could not get address info on port: %s\n\n", port);
+        exit(1);
+    }
+
+    // loop through all possible connections and try to set socket options and bind.
+    for (ptr = serv; ptr != NULL; ptr = ptr->ai_next) {
+
+        if ((sock = socket(ptr->ai_family, ptr->ai_socktype, ptr->ai_protocol)) >= 0) { // socket found
+
+            if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
+                perror("ERROR, setting socket options\n\n"); exit(1); // critical error setting options
+            }
+            else if (*shard && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1) {
+                *shard = FALSE; // fall back to one shared socket
+            }
+            tuneListener(sock);
+            if (bind(sock, ptr->ai_addr, ptr->ai_addrlen) == -1) {
+                close(sock); // if bind unsuccessful be sure to close socket.
+            }
+            else { break; } // setting socket options and binding successful - exit loop.
+        }
+    }
+    freeaddrinfo(serv); // not needed anymore
+
+    // If pointer looped to the end then binding was unsuccessful
+    if (ptr == NULL) {
+        fprintf(stderr, "ERROR, failed to bind socket on port: %s\n\n", port);
+        exit(1);
+    }
+
+    // Try to start listening, the reactor accepts without blocking
+    if (listen(sock, cfg.backlog) == -1 || setNonBlocking(sock) == -1) {
+        fprintf(stderr, "ERROR, listening on port: %s\n\n", port);
+        exit(1);
+    }
+
+    return sock;
+}
+
+// Name: dataConnect()
+// Desc: Gets the client info, sets up a non-blocking socket, and starts connecting to the client.
+// Arg1: The host address of the client to try to connect to.
+// Arg2: The port number to try to connect to the client on.
+// Pre : A host name was extracted from the control connection, and a port number was supplied by the client.
+// Post: The connection is either established or in progress (check SO_ERROR once writable).
+// Rtrn: The socket file descriptor for the data connection, or -1 on error.
+int dataConnect(char *host, char *port) {
+
+    // Socket setup and connection from Beej's guide
+    // in the section 'A Simple Stream Client'
+    // https://beej.us/guide/bgnet/html/#a-simple-stream-client
+    int sock, ret, err = 0; // err: why the last attempt failed
+    struct addrinfo addr, *serv, *ptr;
+
+    // setup server address struct, the host is always the numeric address of
+    // the control connection so this never blocks on a name lookup
+    memset(&addr, 0, sizeof(addr));
+    addr.ai_family = AF_UNSPEC;
+    addr.ai_socktype = SOCK_STREAM;
+    addr.ai_flags = AI_NUMERICHOST;
+
+    // get address info of the server host
+    if ((ret = getaddrinfo(host, port, &addr, &serv)) != 0) {
+        LOG(L_WARN, "WARNING, could not get address info for host: %s port: %s: %s\n\n", host, port, gai_strerror(ret));
+        return -1;
+    }
+
+    // loop through all possible connections and try to connect
+    for (ptr = serv; ptr != NULL; ptr = ptr->ai_next) {
+
+        if ((sock = socket(ptr->ai_family, ptr->ai_socktype, ptr->ai_protocol)) >= 0) {
+
+            tuneSocket(sock, TRUE); // before connect() so the window scale fits the buffers
+            if (setNonBlocking(sock) == -1
+                    || (connect(sock, ptr->ai_addr, ptr->ai_addrlen) == -1 && errno != EINPROGRESS)) {
+                err = errno;
+                close(sock); // make sure to close connection if connect resulted in err
+            }
+            else { break; } // connection successful or in progress, exit loop
+        } else {
+            err = errno;
+        }
+    }
+    freeaddrinfo(serv); // not needed anymore
+
+    // If pointer looped to the end then connecting was unsuccessful
+    if (ptr == NULL) {
+        LOG(L_WARN, "WARNING, failed to connect to host: %s on port: %s: %s\n\n", host, port, strerror(err));
+        errno = err;
+        return -1;
+    }
+
+    return sock;
+}
+
+// Name: pasvListen()
+// Desc: Sets up a non-blocking socket listening for a passive mode data connection.
+// Arg : port - where to store the port number the socket is bound to.
+// Pre : None.
+// Post: The socket is listening on a port from --pasv-ports, or any free port if no range was given.
+//       It accepts both IPv4 and IPv6 clients when the system supports it.
+// Rtrn: The socket file descriptor of the listener, or -1 on error.
+int pasvListen(int* port) {
+
+    static int next = 0;   // round robin through the port range, shared by the workers
+    struct sockaddr_in6 addr6;
+    struct sockaddr_in addr4;
+    struct sockaddr_storage bound;
+    socklen_t boundLen = sizeof(bound);
+    int sock, no = 0, yes = 1, tries, range, p;
+    bool v6 = TRUE;
+
+    // prefer a dual stack socket, fall back to IPv4
+    if ((sock = socket(AF_INET6, SOCK_STREAM, 0)) == -1
+            || setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &no, sizeof(no)) == -1) {
+        if (sock != -1) { close(sock); }
+        if ((sock = socket(AF_INET, SOCK_STREAM, 0)) == -1) { return -1; }
+        v6 = FALSE;
+    }
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)); // ports left in TIME_WAIT by old transfers
+    tuneListener(sock);
+    tuneSocket(sock, TRUE); // accepted connections inherit the buffers and congestion control
+
+    range = cfg.pasvLo ? cfg.pasvHi - cfg.pasvLo + 1 : 1;
+    for (tries = 0; tries < range; tries++) {
+        p = cfg.pasvLo ? cfg.pasvLo + __sync_fetch_and_add(&next, 1) % range : 0;
+        memset(&addr6, 0, sizeof(addr6));
+        memset(&addr4, 0, sizeof(addr4));
+        addr6.sin6_family = AF_INET6;
+        addr6.sin6_addr = in6addr_any;
+        addr6.sin6_port = htons(p);
+        addr4.sin_family = AF_INET;
+        addr4.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr4.sin_port = htons(p);
+        if (v6 ? bind(sock, (struct sockaddr*)&addr6, sizeof(addr6)) == 0
+               : bind(sock, (struct sockaddr*)&addr4, sizeof(addr4)) == 0) { break; }
+    }
+    if (tries == range || listen(sock, PASV_BACKLOG) == -1 || setNonBlocking(sock) == -1
+            || getsockname(sock, (struct sockaddr*)&bound, &boundLen) == -1) {
+        close(sock);
+        return -1;
+    }
+
+    *port = ntohs(bound.ss_family == AF_INET6 ? ((struct sockaddr_in6*)&bound)->sin6_port
+                                              : ((struct sockaddr_in*)&bound)->sin_port);
+    return sock;
+}
+
+// Name: sendAll()
+// Desc: Handles the sending of a long message to the client.
+// Arg1: conn - the socket file descriptor to send the data on.
+// Arg2: str - the message string to send.
+// Arg3: len - the length of the message string to send.
+// Pre : A message is sent to the client (either a directory or file contents).
+// Post: The message is sent up to the provided length or until the non-blocking socket is full.
+// Rtrn: The total length sent (less than len if the socket would block), or -1 if an error is encountered.
+long long sendAll(int conn, char *str, long long len) {
+
+    return sendFlags(conn, str, len, 0);
+}
+
+// Name: sendFlags()
+// Desc: sendAll() with send() flags, MSG_MORE to hold a header back until the data behind it is sent.
+// Arg1: conn - the socket file descriptor to send the data on.
+// Arg2: str - the message string to send.
+// Arg3: len - the length of the message string to send.
+// Arg4: flags - flags for send().
+// Pre : See sendAll().
+// Post: See sendAll().
+// Rtrn: See sendAll().
+long long sendFlags(int conn, char *str, long long len, int flags) {
+
+    // Handling partial sends taken from Beej's guide
+    // in the section 'Handling Partial send()s'
+    // https://beej.us/guide/bgnet/html/#sendall
+    long long total = 0;
+    long long rem = len;
+    ssize_t n = 0;
+
+    while (total < len) {
+        n = (TLS_ON(conn) && !tlsFds[conn].ktls) ? tlsSend(conn, str+total, rem) : send(conn, str+total, rem, flags);
+        if (n == -1) {
+            if (errno == EINTR) { continue; }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { n = 0; } // socket full, finish later
+            break;
+        }
+        total += n;
+        rem -= n;
+    }
+
+    return ((n == -1) ? -1 : total);
+}
+
+// Name: recvSome()
+// Desc: recv() on a control or data connection, through its TLS session if it has one.
+// Arg1: conn - the socket file descriptor to receive on.
+// Arg2: buf - where to receive.
+// Arg3: len - the size of buf.
+// Pre : None.
+// Post: See recv().
+// Rtrn: See recv().
+ssize_t recvSome(int conn, char* buf, size_t len) {
+
+    return TLS_ON(conn) ? tlsRecv(conn, buf, len) : recv(conn, buf, len, 0);
+}
+
+// Name: tuneSocket()
+// Desc: Sets the configured TCP options on a connection.
+// Arg1: fd - the socket.
+// Arg2: data - TRUE for a data connection (or the passive listener it is accepted from), which
+//       also gets the buffer sizes, congestion control and unsent low water mark.
+// Pre : tuneCheck() was called.
+// Post: The options are set as far as the kernel allows, a failed one leaves its default.
+void tuneSocket(int fd, bool data) {
+
+    int yes = 1;
+
+    if (cfg.nodelay && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)) == -1) {
+        LOG_ERRNO(L_WARN, "WARNING, setting TCP_NODELAY\n\n");
+    }
+    if (!data) { return; }
+    if (cfg.sndbuf > 0 && setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &cfg.sndbuf, sizeof(cfg.sndbuf)) == -1) {
+        LOG_ERRNO(L_WARN, "WARNING, setting SO_SNDBUF\n\n");
+    }
+    if (cfg.rcvbuf > 0 && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &cfg.rcvbuf, sizeof(cfg.rcvbuf)) == -1) {
+        LOG_ERRNO(L_WARN, "WARNING, setting SO_RCVBUF\n\n");
+    }
+    if (cfg.congestion != NULL && setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, cfg.congestion, strlen(cfg.congestion)) == -1) {
+        LOG_ERRNO(L_WARN, "WARNING, setting TCP_CONGESTION\n\n");
+    }
+    if (cfg.notsentLowat > 0
+            && setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &cfg.notsentLowat, sizeof(cfg.notsentLowat)) == -1) {
+        LOG_ERRNO(L_WARN, "WARNING, setting TCP_NOTSENT_LOWAT\n\n");
+    }
+}
+
+// Name: tuneListener()
+// Desc: Sets the configured TCP options on a listening socket.
+// Arg : fd - the socket, not yet listening.
+// Pre : None.
+// Post: With --fastopen the listener takes data in the SYN of clients that have a cookie.
+void tuneListener(int fd) {
+
+    if (cfg.fastopen > 0 && setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &cfg.fastopen, sizeof(cfg.fastopen)) == -1) {
+        LOG_ERRNO(L_WARN, "WARNING, setting TCP_FASTOPEN\n\n");
+    }
+}
+
+// Name: tuneCheck()
+// Desc: Checks the configured TCP options against the kernel on a scratch socket.
+// Pre : The options were parsed.
+// Post: Exits if the congestion control is not available, since every data connection would
+//       silently fall back to the default. The buffer sizes the kernel caps are reported.
+void tuneCheck(void) {
+
+    int fd, got;
+    socklen_t len = sizeof(got);
+
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) { return; }
+    if (cfg.congestion != NULL && setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, cfg.congestion, strlen(cfg.congestion)) == -1) {
+        fprintf(stderr, "ERROR, congestion control not available: %s\n\n"
+                "See /proc/sys/net/ipv4/tcp_available_congestion_control\n\n", cfg.congestion);
+        exit(1);
+    }
+    // the kernel doubles the size for its own bookkeeping, and caps it at net.core.wmem_max
+    if (cfg.sndbuf > 0 && setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &cfg.sndbuf, sizeof(cfg.sndbuf)) == 0
+            && getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &got, &len) == 0 && got < cfg.sndbuf) {
+        printf("WARNING, send buffer capped at %d bytes by net.core.wmem_max\n\n", got / 2);
+    }
+    len = sizeof(got);
+    if (cfg.rcvbuf > 0 && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &cfg.rcvbuf, sizeof(cfg.rcvbuf)) == 0
+            && getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &got, &len) == 0 && got < cfg.rcvbuf) {
+        printf("WARNING, receive buffer capped at %d bytes by net.core.rmem_max\n\n", got / 2);
+    }
+    close(fd);
+}
+
+// Name: tcpReport()
+// Desc: Records the TCP state of a data connection at the end of a transfer.
+// Arg1: r - the reactor the connection belongs to.
+// Arg2: c - the connection whose transfer just finished.
+// Pre : The data connection is open.
+// Post: Its round trip time and retransmits are counted in the statistics and logged with the
+//       congestion control and buffer it ran with.
+void tcpReport(struct reactor* r, struct conn* c) {
+
+    struct tcp_info ti;
+    char cc[16] = "";
+    socklen_t len = sizeof(ti);
+    int buf = 0;
+
+    if (getsockopt(c->data.fd, IPPROTO_TCP, TCP_INFO, &ti, &len) == -1) { return; }
+    histAdd(&r->stats.rtt, ti.tcpi_rtt);
+    STAT_ADD(r->stats.retrans, ti.tcpi_total_retrans - c->retransSeen);
+    c->retransSeen = ti.tcpi_total_retrans; // a stream mode connection carries many transfers
+    if (cfg.logLevel >= L_INFO) {
+        len = sizeof(cc) - 1;
+        getsockopt(c->data.fd, IPPROTO_TCP, TCP_CONGESTION, cc, &len);
+        len = sizeof(buf);
+        getsockopt(c->data.fd, SOL_SOCKET, c->file != -1 && c->putName != NULL ? SO_RCVBUF : SO_SNDBUF, &buf, &len);
+        LOG(L_INFO, "TCP: %s, rtt %u us, cwnd %u segments, %u retransmits, %d byte buffer\n\n",
+            cc, ti.tcpi_rtt, ti.tcpi_snd_cwnd, ti.tcpi_total_retrans, buf);
+    }
+}
+
+// Name: get_in_addr()
+// Desc: Get an IPv4 or IPv6 address of a client using a sockaddr struct
+// Arg : client - the socket address struct containing information about the client.
+// Pre : A connection with the client is established and a sockaddr struct w/ client info is obatined.
+// Post: An IPv4 or IPv6 address of the client is obtained.
+// Rtrn: The IPv4 or IPv6 address of the client.
+void* getInAddr(struct sockaddr* client) {
+
+    // Getting IPv4 or IPv6 sockaddr rom Beej's guide
+    // in the section 'A Simple Stream Server'
+    // https://beej.us/guide/bgnet/html/#a-simple-stream-server
+    if (client->sa_family == AF_INET) {
+        return &(((struct sockaddr_in*)client)->sin_addr);
+    }
+
+    return &(((struct sockaddr_in6*)client)->sin6_addr);
+}
+
+// Name: reactorInit()
+// Desc: Creates the epoll instance and registers the listening control socket.
+// Arg1: r - the reactor to setup.
+// Arg2: sock - the listening control socket.
+// Arg3: shared - TRUE if other workers listen on the same socket.
+// Pre : The control socket is bound and listening.
+// Post: The reactor is ready to run, or the program exits on error.
+void reactorInit(struct reactor* r, int sock, bool shared) {
+
+    struct pasv *p, *bound = NULL;
+    int i;
+
+    memset(r, 0, sizeof(*r));
+    if (cfg.logLevel != L_OFF && (r->log = calloc(1, sizeof(*r->log))) == NULL) { perror("ERROR, allocating log ring\n\n"); exit(1); }
+    if ((r->epfd = epoll_create1(0)) == -1) { LOG_ERRNO(L_ERROR, "ERROR, creating epoll instance\n\n"); exit(1); }
+
+    r->listen.fd = sock;
+    r->listen.kind = W_LISTEN;
+    r->listen.conn = NULL;
+    r->shared = shared;
+
+    // only wake one of the workers sharing the socket for each new connection
+    watchFd(r, &r->listen, shared ? EPOLLIN | EPOLLEXCLUSIVE : EPOLLIN);
+
+    // the signal handlers and the other workers wake the reactor through an eventfd
+    if ((r->wake.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) { LOG_ERRNO(L_ERROR, "ERROR, creating eventfd\n\n"); exit(1); }
+    r->wake.kind = W_WAKE;
+    watchFd(r, &r->wake, EPOLLIN);
+    r->handoff.fd = r->heir.fd = -1;
+
+    // bind the passive data listeners ahead of time
+    for (i = 0; i < cfg.pasvPool; i++) {
+        if ((p = pasvGet(r)) == NULL) {
+            LOG_ERRNO(L_WARN, "WARNING, binding passive data listener\n\n");
+            break;
+        }
+        p->next = bound;
+        bound = p;
+    }
+    while ((p = bound) != NULL) {
+        bound = p->next;
+        pasvPut(r, p);
+    }
+
+    dirInit(r);
+
+    // the first worker whose ring cannot be setup makes every worker use the epoll path
+    r->ring.w.fd = -1;
+    if (cfg.transfer == T_URING && ringInit(r) == -1) {
+        LOG_ERRNO(L_WARN, "WARNING, io_uring not available, using --transfer chunked\n\n");
+        cfg.transfer = T_CHUNKED;
+    }
+}
+
+// Name: workerRun()
+// Desc: Thread entry point of a worker, pins the thread to a core and runs its reactor.
+// Arg : arg - the worker.
+// Pre : startup() setup the worker's reactor.
+// Post: Returns once a drain is over.
+// Rtrn: Nothing.
+void* workerRun(void* arg) {
+
+    struct worker* w = arg;
+    cpu_set_t cpus;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (cfg.workers > 1 && ncpu > 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(w->id % ncpu, &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+            LOG(L_WARN, "WARNING, could not pin worker %d to a core\n\n", w->id);
+        }
+    }
+    logMine = w->r.log;
+    pathMine = &w->r.paths;
+    reactorRun(&w->r);
+    return NULL;
+}
+
+// Name: reactorRun()
+// Desc: The event loop. Waits for socket events or the next timer and dispatches them.
+// Arg : r - the reactor to run.
+// Pre : reactorInit() was called.
+// Post: Returns once a drain closed the last session.
+void reactorRun(struct reactor* r) {
+
+    struct epoll_event evs[MAX_EVENTS];
+    int i, n, timeout;
+    long long now;
+
+    while (1) {
+
+        // sleep until the earliest timer is due, not at all while transfers wait for their turn,
+        // and no longer than ADMIT_POLL_MS while sessions wait for a slot another worker may free
+        timeout = -1;
+        if (r->nTimers > 0) {
+            now = nowMs();
+            timeout = (r->timers[0]->deadline > now) ? (int)(r->timers[0]->deadline - now) : 0;
+        }
+        if (r->runHead != NULL) { timeout = 0; }
+        if (r->waitHead != NULL && (timeout == -1 || timeout > ADMIT_POLL_MS)) { timeout = ADMIT_POLL_MS; }
+        if (r->drained) {
+            now = nowMs();
+            if (timeout == -1 || timeout > drainDeadline - now) { timeout = (drainDeadline > now) ? (int)(drainDeadline - now) : 0; }
+        }
+
+        if ((n = epoll_wait(r->epfd, evs, MAX_EVENTS, timeout)) == -1) {
+            if (errno == EINTR) { continue; }
+            LOG_ERRNO(L_ERROR, "ERROR, waiting for events\n\n");
+            exit(1);
+        }
+        for (i = 0; i < n; i++) {
+            onEvent(r, evs[i].data.ptr, evs[i].events);
+        }
+
+        // fire every expired timer
+        now = nowMs();
+        while (r->nTimers > 0 && r->timers[0]->deadline <= now) {
+            struct conn* c = r->timers[0];
+            timerCancel(r, c);
+            onTimer(r, c);
+        }
+
+        // one round for the transfers with room to send, then the sessions that got a slot
+        if (r->runHead != NULL) { schedRun(r); }
+        if (r->waitHead != NULL) { admitWaiting(r); }
+
+        // everything the events queued on the ring goes to the kernel in one call
+        if (r->ring.queued > 0) { ringSubmit(r); }
+        if (r->drained && drainDone(r)) { return; }
+    }
+}
+
+// Name: reactorAdopt()
+// Desc: Serves inherited listening sockets there is no worker of their own for.
+// Arg1: r - the reactor to serve them.
+// Arg2: socks - the sockets, each one an SO_REUSEPORT socket of its own.
+// Arg3: n - how many there are.
+// Pre : reactorInit() was called.
+// Post: The reactor accepts on them like on its own socket, so the connections the kernel already
+//       queued on them, or hashes to them until the old server is gone, are not reset.
+void reactorAdopt(struct reactor* r, int* socks, int n) {
+
+    int i;
+
+    if ((r->adopted = calloc(n, sizeof(*r->adopted))) == NULL) { perror("ERROR, allocating listeners\n\n"); exit(1); }
+    r->nAdopted = n;
+    for (i = 0; i < n; i++) {
+        r->adopted[i].fd = socks[i];
+        r->adopted[i].kind = W_LISTEN;
+        watchFd(r, &r->adopted[i], EPOLLIN);
+    }
+}
+
+// Name: acceptConns()
+// Desc: Accepts every pending client connection on a listening socket.
+// Arg1: r - the reactor to add the connections to.
+// Arg2: w - the listening socket, the worker's own or an adopted one.
+// Pre : The listening socket is readable.
+// Post: A connection awaiting a command is created for each accepted client.
+void acceptConns(struct reactor* r, struct watch* w) {
+
+    int fd;
+    struct conn* c;
+    struct sockaddr_storage client;
+    socklen_t clientSize;
+    bool admit;
+    static const char BUSY[] = "BUSY\n";
+
+    while (1) {
+
+        // Accept client connection.
+        clientSize = sizeof(client);
+        if ((fd = accept(w->fd, (struct sockaddr *)&client, &clientSize)) == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) { continue; }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                LOG_ERRNO(L_ERROR, "ERROR, accepting client connection\n\n");
+            }
+            return;
+        }
+
+        // over --max-sessions the session waits for a slot, unless the queue is full too
+        if (!(admit = admitTry()) && r->nWaiting >= cfg.maxQueued) {
+            LOG(L_WARN, "WARNING, too many sessions, client turned away\n\n");
+            STAT_ADD(r->stats.rejected, 1);
+            if (tlsCtx == NULL) { sendAll(fd, (char*)BUSY, sizeof(BUSY)-1); } // a TLS client could not read it
+            close(fd);
+            continue;
+        }
+        if (setNonBlocking(fd) == -1 || (tlsCtx != NULL && !tlsStart(fd, TRUE)) || (c = connGet(r)) == NULL) {
+            if (admit) { admitRelease(); }
+            LOG_ERRNO(L_ERROR, "ERROR, setting up client connection\n\n");
+            tlsEnd(fd);
+            close(fd);
+            continue;
+        }
+        LOG(L_INFO, "Client connection established!\n\n");
+        STAT_ADD(r->stats.accepted, 1);
+        tuneSocket(fd, FALSE); // replies are single lines
+
+        c->ctrl.fd = fd;
+        c->ctrl.kind = W_CTRL;
+        c->ctrl.conn = c;
+        c->data.fd = -1;
+        c->data.kind = W_DATA;
+        c->data.conn = c;
+        c->file = -1;
+        c->putDir = -1;
+        c->pipe[0] = c->pipe[1] = -1;
+        c->state = (tlsCtx != NULL) ? ST_TLS : ST_CMD; // the handshake comes before the first command
+        c->heapIdx = -1;
+        c->rest = -1;
+
+        // get the client host
+        inet_ntop(client.ss_family, getInAddr((struct sockaddr*)&client), c->host, sizeof(c->host));
+        LOG(L_DEBUG, "Client host: %s\n\n", c->host);
+        if (cfg.ipRate > 0 && (c->ipb = ipBucketGet(c->host)) == NULL) {
+            LOG(L_WARN, "WARNING, no --ip-rate bucket left, client not limited: %s\n\n", c->host);
+        }
+
+        r->active++;
+        c->openNext = r->open;
+        if (r->open != NULL) { r->open->openPrev = c; }
+        r->open = c;
+        if (!admit) {
+            // its commands wait in the socket until admitWaiting() starts it
+            LOG(L_INFO, "Too many sessions, client queued: %s\n\n", c->host);
+            STAT_ADD(r->stats.queued, 1);
+            if (r->waitTail != NULL) { r->waitTail->waitNext = c; } else { r->waitHead = c; }
+            r->waitTail = c;
+            r->nWaiting++;
+            continue;
+        }
+        c->admitted = TRUE;
+        if (c->state == ST_TLS) { timerSet(r, c, TLS_TIMEOUT_MS); }
+        watchFd(r, &c->ctrl, EPOLLIN);
+    }
+}
+
+// Name: onEvent()
+// Desc: Dispatches a socket event to the handler for the connection's current state.
+// Arg1: r - the reactor the event came from.
+// Arg2: w - the registration the event is for.
+// Arg3: events - the epoll event mask.
+// Pre : epoll_wait() returned the event.
+// Post: The connection has made as much progress as it can without blocking.
+void onEvent(struct reactor* r, struct watch* w, unsigned int events) {
+
+    struct conn* c = w->conn;
+
+    if (w->kind == W_LISTEN) { acceptConns(r, w); return; }
+    if (w->kind == W_PASV) { if (c != NULL) { acceptData(r, c); } return; }
+    if (w->kind == W_NOTIFY) { dirNotify(r); return; }
+    if (w->kind == W_RING) { ringReap(r); return; }
+    if (w->kind == W_WAKE) { onWake(r); return; }
+    if (w->kind == W_HANDOFF) { handoffEvent(r, w); return; }
+
+    switch (c->state) {
+    case ST_CMD:     recvCommand(r, c); break;
+    case ST_REPLY:   sendReply(r, c); break;
+    case ST_READY:   recvReady(r, c); break;
+    case ST_CONNECT: if (w->kind == W_DATA) { checkData(r, c); } break;
+    case ST_HEADER:  sendHeader(r, c); break;
+    case ST_STREAM:  sendData(r, c); break;
+    case ST_TRAILER: sendTrailer(r, c); break;
+    case ST_ACK:     recvAck(r, c); break;
+    case ST_RECV:    recvUpload(r, c); break;
+    case ST_ACCEPT:  break; // the passive listener's event accepts the data connection
+    case ST_HASH:    break; // the scheduler reads the file, nothing is watched meanwhile
+    case ST_WALK:    break; // the scheduler walks the tree, likewise
+    case ST_TLS:     shakeHands(r, c); break;
+    }
+}
+
+// Name: onTimer()
+// Desc: Resumes a connection that was waiting on a timer.
+// Arg1: r - the reactor the connection belongs to.
+// Arg2: c - the connection whose timer fired.
+// Pre : The connection's deadline has passed.
+// Post: The data connection is attempted again.
+void onTimer(struct reactor* r, struct conn* c) {
+
+    switch (c->state) {
+    case ST_CONNECT: openData(r, c); break;
+    case ST_ACCEPT:
+        LOG(L_ERROR, "ERROR, client never connected to passive port: %d\n\n", c->pasv->port);
+        closeConn(r, c);
+        break;
+    case ST_STREAM: sendData(r, c); break; // a rate limit let the transfer go on
+    case ST_TLS:
+        LOG(L_ERROR, "ERROR, TLS handshake timed out: %s\n\n", c->host);
+        closeConn(r, c);
+        break;
+    default: break;
+    }
+}
+
+// Name: closeConn()
+// Desc: Closes the control and data connections of a connection and frees it.
+// Arg1: r - the reactor the connection belongs to.
+// Arg2: c - the connection to close.
+// Pre : The request finished or failed.
+// Post: The sockets are closed and the connection is freed.
+void closeConn(struct reactor* r, struct conn* c) {
+
+    struct io_uring_sqe* sqe;
+
+    endTransfer(r, c);
+    if (c->data.fd != -1) { tlsEnd(c->data.fd); close(c->data.fd); }
+    unwatchFd(r, &c->ctrl);
+    tlsEnd(c->ctrl.fd);
+    close(c->ctrl.fd);
+    r->active--;
+    if (c->openPrev != NULL) { c->openPrev->openNext = c->openNext; } else { r->open = c->openNext; }
+    if (c->openNext != NULL) { c->openNext->openPrev = c->openPrev; }
+    c->openPrev = c->openNext = NULL;
+    if (c->admitted) { admitRelease(); c->admitted = FALSE; }
+    if (c->ipb != NULL) { ipBucketPut(c->ipb); c->ipb = NULL; }
+    free(c->hash.sums);
+    c->hash.sums = NULL;
+    LOG(L_INFO, "Client connection closed.\n\n");
+
+    // the ring may still be reading into the chunk, cancel and free it when it is done
+    if (c->ringOps > 0) {
+        c->closed = TRUE;
+        if ((sqe = ringSqe(r)) != NULL) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = -1;
+            sqe->addr = (unsigned long)c;
+            sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+        }
+        return;
+    }
+    connPut(r, c);
+}
+
+// Name: watchFd()
+// Desc: Registers, changes or pauses the events the reactor waits for on a socket.
+// Arg1: r - the reactor to register with.
+// Arg2: w - the registration to change.
+// Arg3: events - the new event mask (0 to pause).
+// Pre : w->fd is an open socket.
+// Post: The reactor waits for the given events on the socket.
+void watchFd(struct reactor* r, struct watch* w, unsigned int events) {
+
+    struct epoll_event ev;
+    int op = (w->events == 0 && events != 0) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+
+    if (w->events == events) { return; }
+    if (events == 0) { unwatchFd(r, w); return; }
+
+    ev.events = events;
+    ev.data.ptr = w;
+    if (epoll_ctl(r->epfd, op, w->fd, &ev) == -1) { LOG_ERRNO(L_ERROR, "ERROR, watching socket\n\n"); }
+    w->events = events;
+}
+
+// Name: unwatchFd()
+// Desc: Removes a socket from the reactor.
+// Arg1: r - the reactor the socket is registered with.
+// Arg2: w - the registration to remove.
+// Pre : None.
+// Post: The reactor no longer waits for events on the socket.
+void unwatchFd(struct reactor* r, struct watch* w) {
+
+    if (w->events == 0) { return; }
+    epoll_ctl(r->epfd, EPOLL_CTL_DEL, w->fd, NULL);
+    w->events = 0;
+}
+
+// Name: timerSet()
+// Desc: Arms a connection's timer, pushing it on the reactor's min-heap.
+// Arg1: r - the reactor the connection belongs to.
+// Arg2: c - the connection to wake up.
+// Arg3: ms - how long from now to wake it up.
+// Pre : The connection has no socket events it is waiting for.
+// Post: onTimer() is called for the connection after ms milliseconds.
+void timerSet(struct reactor* r, struct conn* c, int ms) {
+
+    int i, parent;
+
+    timerCancel(r, c);
+    if (r->nTimers == r->capTimers) {
+        r->capTimers = r->capTimers ? r->capTimers * 2 : 64;
+        if ((r->timers = realloc(r->timers, sizeof(*r->timers) * r->capTimers)) == NULL) {
+            LOG_ERRNO(L_ERROR, "ERROR, growing timer heap\n\n"); exit(1);
+        }
+    }
+    c->deadline = nowMs() + ms;
+
+    // sift up
+    for (i = r->nTimers++; i > 0; i = parent) {
+        parent = (i - 1) / 2;
+        if (r->timers[parent]->deadline <= c->deadline) { break; }
+        r->timers[i] = r->timers[parent];
+        r->timers[i]->heapIdx = i;
+    }
+    r->timers[i] = c;
+    c->heapIdx = i;
+}
+
+// Name: timerCancel()
+// Desc: Disarms a connection's timer, removing it from the reactor's min-heap.
+// Arg1: r - the reactor the connection belongs to.
+// Arg2: c - the connection to disarm.
+// Pre : None.
+// Post: The connection is not in the heap.
+void timerCancel(struct reactor* r, struct conn* c) {
+
+    int i, child;
+    struct conn* last;
+
+    if (c->heapIdx == -1) { return; }
+    i = c->heapIdx;
+    c->heapIdx = -1;
+    last = r->timers[--r->nTimers];
+    if (i == r->nTimers) { return; }
+
+    // move the last entry into the hole, then sift it up or down
+    while (i > 0 && r->timers[(i - 1) / 2]->deadline > last->deadline) {
+        r->timers[i] = r->timers[(i - 1) / 2];
+        r->timers[i]->heapIdx = i;
+        i = (i - 1) / 2;
+    }
+    while ((child = 2 * i + 1) < r->nTimers) {
+        if (child + 1 < r->nTimers && r->timers[child + 1]->deadline < r->timers[child]->deadline) { child++; }
+        if (r->timers[child]->deadline >= last->deadline) { break; }
+        r->timers[i] = r->timers[child];
+        r->timers[i]->heapIdx = i;
+        i = child;
+    }
+    r->timers[i] = last;
+    last->heapIdx = i;
+}
+
+// Name: connGet()
+// Desc: Takes a connection from the worker's slab, allocating CONN_SLAB more if it is empty.
+// Arg : r - the reactor that owns the slab.
+// Pre : None.
+// Post: The connection belongs to the caller until it is given back with connPut().
+// Rtrn: A zeroed connection, or NULL if out of memory.
+struct conn* connGet(struct reactor* r) {
+
+    struct conn* c;
+    int i;
+
+    if (r->idle == NULL) {
+        if ((c = calloc(CONN_SLAB, sizeof(*c))) == NULL) { return NULL; }
+        for (i = 0; i < CONN_SLAB; i++) { c[i].next = r->idle; r->idle = &c[i]; }
+    }
+    c = r->idle;
+    r->idle = c->next;
+    c->next = NULL;
+    return c;
+}
+
+// Name: connPut()
+// Desc: Gives a closed connection back to the worker's slab.
+// Arg1: r - the reactor that owns the slab.
+// Arg2: c - the connection.
+// Pre : c came from connGet() on the same reactor and nothing refers to it any more.
+// Post: The connection is zeroed and kept for the next client, slabs are never freed.
+void connPut(struct reactor* r, struct conn* c) {
+
+    memset(c, 0, sizeof(*c));
+    c->next = r->idle;
+    r->idle = c;
+}
+
+// Name: arenaAlloc()
+// Desc: Takes memory from a connection's arena, for strings the current request keeps.
+// Arg1: c - the connection.
+// Arg2: len - bytes wanted.
+// Pre : None.
+// Post: The memory is the request's until endTransfer() empties the arena.
+// Rtrn: The memory, or NULL if the arena is full.
+char* arenaAlloc(struct conn* c, int len) {
+
+    char* p;
+
+    if (len > ARENA_LEN - c->arenaLen) { return NULL; }
+    p = c->arena + c->arenaLen;
+    c->arenaLen += len;
+    return p;
+}
+
+// Name: pasvGet()
+// Desc: Takes a passive data listener from the worker's pool, binding a new one if the pool is empty.
+// Arg : r - the reactor that owns the pool.
+// Pre : None.
+// Post: The listener belongs to the caller until it is given back with pasvPut().
+// Rtrn: The listener, or NULL on error.
+struct pasv* pasvGet(struct reactor* r) {
+
+    struct pasv* p;
+
+    if ((p = r->pasvPool) != NULL) {
+        r->pasvPool = p->next;
+    } else {
+        if ((p = calloc(1, sizeof(*p))) == NULL) { return NULL; }
+        if ((p->w.fd = pasvListen(&p->port)) == -1) { free(p); return NULL; }
+        p->w.kind = W_PASV;
+    }
+    p->next = NULL;
+    return p;
+}
+
+// Name: pasvPut()
+// Desc: Gives a passive data listener back to the worker's pool.
+// Arg1: r - the reactor that owns the pool.
+// Arg2: p - the listener to give back.
+// Pre : p came from pasvGet() on the same reactor.
+// Post: The listener stays bound, but is not watched until it is handed out again.
+void pasvPut(struct reactor* r, struct pasv* p) {
+
+    unwatchFd(r, &p->w);
+    p->w.conn = NULL;
+    p->next = r->pasvPool;
+    r->pasvPool = p;
+}
+
+// Name: setNonBlocking()
+// Desc: Puts a file descriptor in non-blocking mode.
+// Arg : fd - the file descriptor.
+// Pre : fd is open.
+// Post: Calls on fd return EAGAIN instead of blocking.
+// Rtrn: 0 on success, -1 on error.
+int setNonBlocking(int fd) {
+
+    int flags;
+
+    if ((flags = fcntl(fd, F_GETFL, 0)) == -1) { return -1; }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Name: nowUs()
+// Desc: Gets the current time of the monotonic clock, finer than nowMs() for latencies.
+// Rtrn: The time in microseconds.
+long long nowUs(void) {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Name: nowMs()
+// Desc: Gets the current time of the monotonic clock.
+// Rtrn: The time in milliseconds.
+long long nowMs(void) {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
@@ -0,0 +1,280 @@
+/*
+ * Name: path.c
+ * Auth: Andrew Swaim
+ * Date: November 2019
+ * Desc: Names of requests resolved beneath the --root directory. Every lookup goes through
+ *       openat2() with RESOLVE_BENEATH, so neither .. nor a symbolic link can leave the root.
+ *       Each worker keeps the directories it looked up open, so a file in a nested directory
+ *       costs one lookup of its own name.
+ */
+
+#include "ftpserver.h"
+
+// Name: pathInit()
+// Desc: Opens the --root directory and checks the kernel has openat2().
+// Pre : The options were parsed.
+// Post: rootFd is open. The program exits if the root is not a directory that can be read.
+void pathInit(void) {
+
+    struct open_how how = { O_PATH | O_CLOEXEC, 0, RESOLVE_BENEATH };
+    long fd;
+
+    if ((rootFd = open(cfg.root, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+        fprintf(stderr, "ERROR, opening root directory %s: %s\n\n", cfg.root, strerror(errno));
+        exit(1);
+    }
+    if ((fd = syscall(SYS_openat2, rootFd, ".", &how, sizeof(how))) != -1) {
+        close(fd);
+    } else if (errno == ENOSYS) {
+        haveOpenat2 = FALSE;
+        printf("WARNING, the kernel has no openat2(), symbolic links under the root are not followed\n\n");
+    }
+}
+
+// Name: beneath()
+// Desc: Opens a name relative to a directory, refusing anything that resolves outside of it.
+// Arg1: dirfd - the directory.
+// Arg2: name - the name, relative to the directory.
+// Arg3: flags - open() flags.
+// Pre : None.
+// Post: A file created is mode 0644.
+// Rtrn: The open file, or -1 with errno set (EXDEV if the name leaves the directory).
+static int beneath(int dirfd, const char* name, int flags) {
+
+    struct open_how how = { flags | O_CLOEXEC, (flags & O_CREAT) ? 0644 : 0, RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS };
+    long fd;
+
+    if (haveOpenat2) {
+
+        // EAGAIN means a rename raced the lookup
+        while ((fd = syscall(SYS_openat2, dirfd, name, &how, sizeof(how))) == -1 && (errno == EAGAIN || errno == EINTR)) {}
+        return fd;
+    }
+
+    // without it a name is taken only when it is no more than one plain name
+    if (name[0] == '/' || strchr(name, '/') != NULL || strcmp(name, "..") == 0) {
+        errno = EXDEV;
+        return -1;
+    }
+    return openat(dirfd, name, flags | O_CLOEXEC | O_NOFOLLOW, 0644);
+}
+
+// Name: pathSlot()
+// Desc: Finds a directory in the calling worker's handles, or the slot to add it in.
+// Arg1: p - the worker's handles.
+// Arg2: dir - the directory's path relative to the root.
+// Arg3: len - the length of the path.
+// Pre : None.
+// Post: None.
+// Rtrn: The directory's slot, or the free slot it would take.
+static struct dirHandle* pathSlot(struct pathCache* p, const char* dir, int len) {
+
+    struct dirHandle* h;
+    unsigned int i = 2166136261u; // FNV-1a
+    int j;
+
+    for (j = 0; j < len; j++) { i = (i ^ (unsigned char)dir[j]) * 16777619u; }
+    for (h = &p->slots[i % PATH_SLOTS]; h->path != NULL; h = &p->slots[++i % PATH_SLOTS]) {
+        if (h->len == len && memcmp(h->path, dir, len) == 0) { break; }
+    }
+    return h;
+}
+
+// Name: pathDir()
+// Desc: Gets a directory by its path relative to the root, from the worker's handles if it is there.
+// Arg1: p - the worker's handles, or NULL to cache nothing.
+// Arg2: dir - the path, which need not end in a '\0'.
+// Arg3: len - the length of the path, 0 for the root itself.
+// Arg4: owned - set to TRUE if the caller has to close the descriptor returned.
+// Pre : None.
+// Post: A directory found is cached along with its parents, while there is room. Each one is
+//       looked up from its parent, one name at a time.
+// Rtrn: An O_PATH descriptor of the directory, or -1 with errno set.
+static int pathDir(struct pathCache* p, const char* dir, int len, bool* owned) {
+
+    struct dirHandle* h;
+    const char* slash;
+    char proc[32];
+    bool parentOwned;
+    int parent, fd, wd;
+
+    *owned = FALSE;
+    if (len == 0) { return rootFd; }
+    if (p != NULL && p->notify == -1) { p = NULL; }
+    if (p != NULL && (h = pathSlot(p, dir, len))->path != NULL) { return h->fd; }
+    if (p == NULL && haveOpenat2) {
+        *owned = TRUE;
+        return beneath(rootFd, strndupa(dir, len), O_PATH | O_DIRECTORY);
+    }
+
+    slash = memrchr(dir, '/', len);
+    if ((parent = pathDir(p, dir, slash ? slash - dir : 0, &parentOwned)) == -1) { return -1; }
+    fd = beneath(parent, strndupa(slash ? slash + 1 : dir, slash ? len - (slash + 1 - dir) : len), O_PATH | O_DIRECTORY);
+    if (parentOwned) { close(parent); }
+
+    // a link above its own directory may still be beneath the root, that takes the whole path
+    if (fd == -1 && errno == EXDEV && slash != NULL && haveOpenat2) {
+        fd = beneath(rootFd, strndupa(dir, len), O_PATH | O_DIRECTORY);
+        parentOwned = TRUE; // its parents are not the ones cached
+    }
+    if (fd == -1) { return -1; }
+    *owned = TRUE;
+
+    // only a directory whose parents are all watched can be cached, and it needs a watch of its own
+    if (p == NULL || parentOwned || p->count >= DIR_HANDLES) { return fd; }
+    sprintf(proc, "/proc/self/fd/%d", fd);
+    h = pathSlot(p, dir, len); // the parent may have taken the slot found before
+    if ((h->path = malloc(len)) == NULL
+            || (wd = inotify_add_watch(p->notify, proc, IN_MOVE_SELF | IN_DELETE_SELF | IN_MASK_ADD | IN_ONLYDIR)) == -1) {
+        free(h->path);
+        h->path = NULL;
+        return fd;
+    }
+    *owned = FALSE;
+    memcpy(h->path, dir, len);
+    h->len = len;
+    h->fd = fd;
+    h->wd = wd;
+    p->count++;
+    LOG(L_DEBUG, "Directory handle cached: %.*s\n\n", len, dir);
+    return fd;
+}
+
+// Name: pathOpen()
+// Desc: Opens the name of a request beneath the root.
+// Arg1: name - the name, relative to the root. A name ending in '/' is a directory.
+// Arg2: flags - open() flags.
+// Pre : pathInit() was called.
+// Post: The directory the name is in comes from the calling worker's handles, so only the last
+//       name is looked up. Absolute names, and names that .. or a symbolic link take out of the
+//       root, are refused.
+// Rtrn: The open file, or -1 with errno set.
+int pathOpen(const char* name, int flags) {
+
+    struct pathCache* p = pathMine;
+    const char* slash;
+    bool owned;
+    int len = strlen(name), dir, fd;
+
+    while (len > 1 && name[len-1] == '/') { len--; }
+    if (len == 0) { errno = ENOENT; return -1; }
+    if (name[0] == '/') {
+        LOG(L_INFO, "Refusing name outside the root: %s\n\n", name);
+        errno = EXDEV;
+        return -1;
+    }
+    if (p != NULL && p->count >= DIR_HANDLES) { pathFlush(p); }
+
+    slash = memrchr(name, '/', len);
+    if ((dir = pathDir(p, name, slash ? slash - name : 0, &owned)) == -1) {
+        fd = -1;
+    } else {
+        fd = beneath(dir, strndupa(slash ? slash + 1 : name, slash ? len - (slash + 1 - name) : len), flags);
+        if (owned) { close(dir); }
+        if (fd == -1 && errno == EXDEV && slash != NULL && haveOpenat2) { fd = beneath(rootFd, strndupa(name, len), flags); }
+    }
+    if (fd == -1 && (errno == EXDEV || errno == ELOOP)) { LOG(L_INFO, "Refusing name outside the root: %s\n\n", name); }
+    return fd;
+}
+
+// Name: pathStat()
+// Desc: stat() for the name of a request, resolved like pathOpen().
+// Arg1: name - the name, relative to the root.
+// Arg2: st - where to store the status.
+// Pre : pathInit() was called.
+// Post: A name in a directory the calling worker has a handle of is looked up with fstatat() from
+//       it, so nothing is opened. Only a symbolic link is opened, to follow it like pathOpen().
+// Rtrn: 0 on success, -1 with errno set.
+int pathStat(const char* name, struct stat* st) {
+
+    struct pathCache* p = pathMine;
+    const char* leaf = strrchr(name, '/');
+    bool owned;
+    int fd, ret;
+
+    leaf = leaf ? leaf + 1 : name;
+    if (p != NULL && p->count >= DIR_HANDLES) { pathFlush(p); }
+    if (name[0] != '/' && leaf[0] != '\0' && strcmp(leaf, ".") != 0 && strcmp(leaf, "..") != 0
+            && (fd = pathDir(p, name, leaf == name ? 0 : leaf - 1 - name, &owned)) != -1) {
+        ret = fstatat(fd, leaf, st, AT_SYMLINK_NOFOLLOW);
+        if (owned) { close(fd); }
+        if (ret == -1 || !S_ISLNK(st->st_mode)) { return ret; }
+    }
+
+    if ((fd = pathOpen(name, O_PATH)) == -1) { return -1; }
+    ret = fstat(fd, st);
+    close(fd);
+    return ret;
+}
+
+// Name: pathParent()
+// Desc: Opens the directory a name is in, for creating and renaming files in it.
+// Arg1: name - the name, relative to the root, not ending in '/'.
+// Arg2: leaf - set to the last name of name, relative to the directory.
+// Pre : pathInit() was called.
+// Post: None.
+// Rtrn: An O_PATH descriptor of the directory, closed by the caller, or -1 with errno set.
+int pathParent(const char* name, const char** leaf) {
+
+    const char* slash = strrchr(name, '/');
+
+    *leaf = slash ? slash + 1 : name;
+    if (slash == NULL) { return fcntl(rootFd, F_DUPFD_CLOEXEC, 0); }
+    if (slash == name) { errno = EXDEV; return -1; }
+    return pathOpen(strndupa(name, slash - name), O_PATH | O_DIRECTORY);
+}
+
+// Name: pathEntry()
+// Desc: Opens a file of an archive being sent, by its path relative to the archive's directory.
+// Arg1: dirfd - the archive's directory.
+// Arg2: name - the path, relative to dirfd.
+// Pre : pathInit() was called.
+// Post: No symbolic link is followed anywhere along the path, as archiveWalk() followed none, so
+//       a directory swapped for a link since the walk cannot take the read out of the root.
+// Rtrn: The open file, or -1 with errno set.
+int pathEntry(int dirfd, const char* name) {
+
+    struct open_how how = { O_RDONLY | O_CLOEXEC, 0, RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS | RESOLVE_NO_SYMLINKS };
+    const char* slash;
+    long fd;
+    int dir = dirfd, sub;
+
+    if (haveOpenat2) {
+        while ((fd = syscall(SYS_openat2, dirfd, name, &how, sizeof(how))) == -1 && (errno == EAGAIN || errno == EINTR)) {}
+        return fd;
+    }
+
+    // without it one directory at a time, none of them a link
+    while ((slash = strchr(name, '/')) != NULL) {
+        sub = openat(dir, strndupa(name, slash - name), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (dir != dirfd) { close(dir); }
+        if (sub == -1) { return -1; }
+        dir = sub;
+        name = slash + 1;
+    }
+    fd = openat(dir, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (dir != dirfd) { close(dir); }
+    return fd;
+}
+
+// Name: pathFlush()
+// Desc: Drops every directory handle of a worker.
+// Arg : p - the worker's handles.
+// Pre : None.
+// Post: The handles are closed and their watches removed, the next paths are looked up again
+//       from the root. This is done when a cached directory is moved or removed, so a handle
+//       never leads to a directory that is no longer where its path says.
+void pathFlush(struct pathCache* p) {
+
+    struct dirHandle* h;
+
+    for (h = p->slots; h < p->slots + PATH_SLOTS; h++) {
+        if (h->path == NULL) { continue; }
+        if (h->wd != p->rootWd) { inotify_rm_watch(p->notify, h->wd); } // a link back to the root shares its watch
+        close(h->fd);
+        free(h->path);
+        h->path = NULL;
+    }
+    if (p->count > 0) { LOG(L_DEBUG, "Directory handles dropped: %d\n\n", p->count); }
+    p->count = 0;
+}
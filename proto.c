@@ -0,0 +1,1249 @@
+/*
+ * Name: proto.c
+ * Auth: Andrew Swaim
+ * Date: November 2019
+ * Desc: The control protocol: parses each command, sends its reply and drives a connection
+ *       through the states of a request, from READY to the acknowledgment of the data.
+ */
+
+#include "ftpserver.h"
+
+// Name: handleRequest()
+// Desc: handles a command/request from the client
+// Arg1: r - the reactor the connection belongs to.
+// Arg2: c - the connection with the received command in its command buffer.
+// Pre : The command was received on the control connection.
+// Post: The command is parsed, the reply is queued, and the data for the request (if any) is obtained.
+void handleRequest(struct reactor* r, struct conn* c) {
+
+    char* name = "";    // filename, points into the command like every other token
+    char* temp;         // upload temporary file, in the connection's arena
+    char* leaf;         // last part of the filename
+    char* token;
+    char* save;         // strtok_r() state, workers parse commands concurrently
+    char* port = NULL;  // data port token
+    char* rest[4];      // tokens after the filename: [offset length] port [zlib]
+    int nRest = 0;
+    char* opts[LIST_OPTS]; // tokens after -l: [start=[GEN:]N] [limit=N] [match=GLOB] [long] [dir=PATH] port
+    int nOpts = 0, i, n;
+    long long start = 0, limit = -1, next = -1;
+    unsigned long long gen = 0; // generation of the listing start is in, 0 if the client gave none
+    char* match = NULL;
+    char* dir = NULL;   // directory to list, NULL for the root
+    bool longFmt = FALSE;
+    long long off = 0, len = -1, size;
+    long long wire = -1;        // bytes actually sent when they are not the length in the header
+    bool zip = FALSE;
+    long long resume = c->rest; // a REST only applies to the command right after it
+    enum haveKind have = c->have; // and so does a HAVE
+    char facts[BUF_LEN] = "";   // added to the OK reply
+    struct stat st;
+    bool rerun = (c->state == ST_HASH || c->state == ST_WALK); // already counted when it first came
+
+    unsigned int flags = 0;
+
+    // response constant variables
+    static const char CMD_OK[]  = "OK\n";
+    static const char BAD_CMD[] = "INVALID COMMAND\n";
+    static const char BAD_DIR[] = "ERROR READING DIRECTORY\n";
+    static const char BAD_FIL[] = "FILE NOT FOUND\n";
+    static const char BAD_PSV[] = "CANNOT OPEN DATA PORT\n";
+    static const char BAD_RNG[] = "INVALID RANGE\n";
+    static const char CHANGED[] = "FILE CHANGED\n";
+    static const char UNMODIF[] = "NOT MODIFIED\n";
+    static const char STALE[]   = "LISTING CHANGED\n";
+    static const char BAD_PUT[] = "CANNOT STORE FILE\n";
+
+    // a command put off while its file was read for checksums, or its tree walked, runs again as it came
+    if (rerun) {
+        for (i = 0; i < c->cmdLen; i++) { if (c->cmd[i] == '\0') { c->cmd[i] = ' '; } }
+    } else {
+        LOG(L_INFO, "Command received from client: %s\n\n", c->cmd);
+        STAT_ADD(r->stats.commands, 1);
+    }
+    c->cmdLen = strlen(c->cmd);
+    c->state = ST_REPLY;
+    c->replyOff = 0;
+    c->off = 0;
+    c->zip = FALSE;
+    c->rest = -1;
+    c->have = H_NONE;
+
+    // Parse command, anything the last request kept in the arena is done with
+    c->arenaLen = 0;
+    token = strtok_r(c->cmd, " ", &save);
+    LOG(L_DEBUG, "Handling flag: %s\n\n", token ? token : "");
+    if (token != NULL && strcmp(token, "QUIT") == 0) { // end of session
+        LOG(L_INFO, "Client ended the session.\n\n");
+        closeConn(r, c);
+        return;
+
+    } else if (token != NULL && strcmp(token, "MODE") == 0 && (token = strtok_r(NULL, " ", &save)) != NULL
+            && (strcmp(token, "STREAM") == 0 || strcmp(token, "CRC") == 0)) {
+
+        // keep the data connection and frame every transfer from now on, MODE CRC adds checksums
+        LOG(L_INFO, "Switching session to stream mode%s...\n\n", token[0] == 'C' ? " with checksums" : "");
+        c->stream = TRUE;
+        if (token[0] == 'C') { c->check = TRUE; }
+        c->reply = CMD_OK; c->replyLen = sizeof(CMD_OK)-1;
+        sendReply(r, c);
+        return;
+
+    } else if (token != NULL && strcmp(token, "STATS") == 0) { // server statistics command
+
+        // Reply with one line of counters for the whole server, there is no data connection
+        if ((token = arenaAlloc(c, STATS_LINE)) == NULL) {
+            c->reply = BAD_CMD; c->replyLen = sizeof(BAD_CMD)-1;
+        } else {
+            c->reply = token; c->replyLen = statsLine(token, STATS_LINE);
+        }
+        sendReply(r, c);
+        return;
+
+    } else if (token != NULL && strcmp(token, "SIZE") == 0) { // get file size command
+
+        // Reply with the size alone, there is no data connection
+        if ((token = strtok_r(NULL, " ", &save)) == NULL || pathStat(token, &st) == -1 || !S_ISREG(st.st_mode)) {
+            LOG(L_INFO, "Sending FILE NOT FOUND error to client...\n\n");
+            c->reply = BAD_FIL; c->replyLen = sizeof(BAD_FIL)-1;
+        } else {
+            sprintf(c->replyBuf, "SIZE %lld %lld\n", (long long)st.st_size, MTIME_NS(st));
+            c->reply = c->replyBuf; c->replyLen = strlen(c->replyBuf);
+        }
+        sendReply(r, c);
+        return;
+
+    } else if (token != NULL && strcmp(token, "REST") == 0) { // resume the next transfer command
+
+        // Remember where to restart and what the file must look like, checked once it is opened
+        if ((token = strtok_r(NULL, " ", &save)) == NULL || (c->rest = parseSize(token)) == -1
+                || (token = strtok_r(NULL, " ", &save)) == NULL || (c->restSize = parseSize(token)) == -1
+                || (token = strtok_r(NULL, " ", &save)) == NULL || (c->restMtime = parseSize(token)) == -1) {
+            LOG(L_INFO, "Sending INVALID COMMAND error to client...\n\n");
+            c->rest = -1;
+            c->reply = BAD_CMD; c->replyLen = sizeof(BAD_CMD)-1;
+        } else {
+            LOG(L_DEBUG, "Next transfer restarts at offset %lld\n\n", c->rest);
+            c->reply = CMD_OK; c->replyLen = sizeof(CMD_OK)-1;
+        }
+        sendReply(r, c);
+        return;
+
+    } else if (token != NULL && strcmp(token, "HAVE") == 0) { // make the next transfer command conditional
+
+        // Remember the client's copy, either HAVE size mtime or HAVE CRC crc32c in hex
+        if ((token = strtok_r(NULL, " ", &save)) != NULL && strcmp(token, "CRC") == 0) {
+            if ((token = strtok_r(NULL, " ", &save)) != NULL && (c->haveSize = parseHex(token)) != -1) {
+                c->haveCrc = (unsigned int)c->haveSize;
+                c->have = H_CRC;
+            }
+        } else if (token != NULL && (c->haveSize = parseSize(token)) != -1
+                && (token = strtok_r(NULL, " ", &save)) != NULL && (c->haveMtime = parseSize(token)) != -1) {
+            c->have = H_STAT;
+        }
+        if (c->have == H_NONE) {
+            LOG(L_INFO, "Sending INVALID COMMAND error to client...\n\n");
+            c->reply = BAD_CMD; c->replyLen = sizeof(BAD_CMD)-1;
+        } else {
+            LOG(L_DEBUG, "Next transfer is sent only if the client's copy differs\n\n");
+            c->reply = CMD_OK; c->replyLen = sizeof(CMD_OK)-1;
+        }
+        sendReply(r, c);
+        return;
+
+    } else if (token != NULL && strcmp(token, "SUMS") == 0) { // get block checksums of a file command
+
+        // Get the filename, the block size and the port
+        if ((token = strtok_r(NULL, " ", &save)) != NULL) { name = token; }
+        if ((token = strtok_r(NULL, " ", &save)) == NULL || (len = parseSize(token)) < SUM_MIN || len > SUM_MAX
+                || (port = strtok_r(NULL, " ", &save)) == NULL) {
+            LOG(L_INFO, "Sending INVALID COMMAND error to client...\n\n");
+            c->reply = BAD_CMD; c->replyLen = sizeof(BAD_CMD)-1;
+            sendReply(r, c);
+            return;
+        }
+
+        // Checksum every block of the file, unless the client's copy is current. The file is read
+        // a chunk per turn of the scheduler, and the command runs again once it is all read.
+        if ((c->file = pathOpen(name, O_RDONLY)) == -1 || fstat(c->file, &st) == -1 || !S_ISREG(st.st_mode)) {
+            LOG(L_INFO, "Sending FILE NOT FOUND error to client...\n\n");
+            endTransfer(r, c);
+            c->reply = BAD_FIL; c->replyLen = sizeof(BAD_FIL)-1;
+            sendReply(r, c);
+            return;
+        }
+        if (have != H_NONE && (have == H_STAT || hashKnown(c, &st, len)) && unchanged(c, have, name, &st)) {
+            LOG(L_INFO, "Sending NOT MODIFIED to client...\n\n");
+            endTransfer(r, c);
+            c->reply = UNMODIF; c->replyLen = sizeof(UNMODIF)-1;
+            sendReply(r, c);
+            return;
+        }
+        if (!hashKnown(c, &st, len)) {
+            if (!hashStart(r, c, &st, len, have, resume)) {
+                LOG_ERRNO(L_ERROR, "ERROR, allocating block checksums\n\n");
+                endTransfer(r, c);
+                c->reply = BAD_FIL; c->replyLen = sizeof(BAD_FIL)-1;
+                sendReply(r, c);
+            }
+            return;
+        }
+        close(c->file);
+        c->file = -1;
+        c->msg = c->hash.sums; // the reply's data now, freed when it is sent
+        c->hash.sums = NULL;
+        c->len = (st.st_size + len - 1) / len * 4;
+        sprintf(facts, " SIZE %lld MTIME %lld", (long long)st.st_size, MTIME_NS(st));
+
+    } else if (token != NULL && strcmp(token, "-p") == 0) { // put file contents command
+
+        // Get the filename, the length and the port
+        if ((token = strtok_r(NULL, " ", &save)) != NULL) { name = token; }
+        if ((token = strtok_r(NULL, " ", &save)) == NULL || (len = parseSize(token)) == -1
+                || (port = strtok_r(NULL, " ", &save)) == NULL) {
+            LOG(L_INFO, "Sending INVALID COMMAND error to client...\n\n");
+            c->reply = BAD_CMD; c->replyLen = sizeof(BAD_CMD)-1;
+            sendReply(r, c);
+            return;
+        }
+
+        // Receive into a temporary file next to it, with the space allocated up front
+        if ((c->putName = arenaAlloc(c, strlen(name) + 1)) != NULL) { strcpy(c->putName, name); }
+        if (c->putName == NULL || (temp = arenaAlloc(c, strlen(name) + PUT_TEMP)) == NULL || (c->file = putOpen(name, len, temp, &c->putDir)) == -1) {
+            LOG(L_INFO, "Sending CANNOT STORE FILE error to client...\n\n");
+            endTransfer(r, c);
+            c->reply = BAD_PUT; c->replyLen = sizeof(BAD_PUT)-1;
+            sendReply(r, c);
+            return;
+        }
+        c->putTemp = temp;
+        c->len = len;
+        c->mode = (cfg.transfer == T_SENDFILE || cfg.transfer == T_SPLICE) ? T_SPLICE : T_CHUNKED;
+
+    } else if (token != NULL && strcmp(token, "-r") == 0) { // get directory tree command
+
+        // Get the directory, the port and if the client takes zlib
+        if ((token = strtok_r(NULL, " ", &save)) != NULL) { name = token; }
+        if ((port = strtok_r(NULL, " ", &save)) == NULL
+                || ((token = strtok_r(NULL, " ", &save)) != NULL && strcmp(token, "zlib") != 0)) {
+            LOG(L_INFO, "Sending INVALID COMMAND error to client...\n\n");
+            c->reply = BAD_CMD; c->replyLen = sizeof(BAD_CMD)-1;
+            sendReply(r, c);
+            return;
+        }
+
+        // Walk the whole tree first, so the length of the archive is known before it is sent. The
+        // tree is walked a few entries per turn of the scheduler, and the command runs again once
+        // it is all walked.
+        if (c->archive == NULL) {
+            if ((c->archive = archiveOpen(name)) == NULL) {
+                LOG(L_INFO, "Sending ERROR READING DIRECTORY error to client...\n\n");
+                c->reply = BAD_DIR; c->replyLen = sizeof(BAD_DIR)-1;
+                sendReply(r, c);
+                return;
+            }
+            c->have = have;
+            c->rest = resume;
+            c->state = ST_WALK;
+            watchFd(r, &c->ctrl, 0);
+            schedQueue(r, c);
+            return;
+        }
+        c->len = c->archive->len;
+        flags |= FRAME_TREE;
+        sprintf(facts, " ENTRIES %d", c->archive->count);
+        if (token != NULL && cfg.zlevel != 0) {
+            c->zip = TRUE;
+            flags |= FRAME_ZLIB;
+            strcat(facts, " CODEC zlib");
+        }
+
+    } else if (token != NULL && strcmp(token, "-l") == 0) { // get directory contents command
+
+        // Get the listing options, the last token is the port
+        while (nOpts < LIST_OPTS && (opts[nOpts] = strtok_r(NULL, " ", &save)) != NULL) { nOpts++; }
+        if (nOpts > 0) { port = opts[--nOpts]; }
+        for (i = 0; i < nOpts; i++) {
+            if (strncmp(opts[i], "start=", 6) == 0 && strchr(opts[i], ':') != NULL) { // a NEXT cursor, GEN:ENTRY
+                if (sscanf(opts[i] + 6, "%llu:%lld%n", &gen, &start, &n) == 2 && opts[i][6 + n] == '\0'
+                        && gen != 0 && start >= 0) { continue; }
+                break;
+            }
+            if (strncmp(opts[i], "start=", 6) == 0 && (start = parseSize(opts[i] + 6)) != -1) { continue; }
+            if (strncmp(opts[i], "limit=", 6) == 0 && (limit = parseSize(opts[i] + 6)) != -1) { continue; }
+            if (strncmp(opts[i], "match=", 6) == 0) { match = opts[i] + 6; continue; }
+            if (strcmp(opts[i], "long") == 0) { longFmt = TRUE; continue; }
+            if (strncmp(opts[i], "dir=", 4) == 0) { dir = opts[i] + 4; continue; }
+            break;
+        }
+        if (i < nOpts || (nOpts == LIST_OPTS - 1 && strtok_r(NULL, " ", &save) != NULL)) {
+            LOG(L_INFO, "Sending INVALID COMMAND error to client...\n\n");
+            c->reply = BAD_CMD; c->replyLen = sizeof(BAD_CMD)-1;
+            sendReply(r, c);
+            return;
+        }
+
+        // Try to get the directory contents, the whole listing is prebuilt but a page is built to order
+        if (nOpts > 0) {
+            c->len = dirPage(r, dir, start, &gen, limit, match, longFmt, &next, &c->msg);
+        } else if ((c->listing = dirListing(r)) != NULL) {
+            c->msg = c->listing->data;
+            c->len = c->listing->len;
+        } else {
+            c->len = -1;
+        }
+        if (c->len == -1 && errno == ESTALE) {
+
+            // entries moved since the page the cursor came from, going on from it could skip some
+            LOG(L_INFO, "Sending LISTING CHANGED error to client...\n\n");
+            c->reply = STALE; c->replyLen = sizeof(STALE)-1;
+            sendReply(r, c);
+            return;
+        }
+        if (c->len == -1) {
+
+            // error reading directory contents
+            LOG(L_INFO, "Sending ERROR READING DIRECTORY error to client...\n\n");
+            c->reply = BAD_DIR; c->replyLen = sizeof(BAD_DIR)-1;
+            sendReply(r, c);
+            return;
+        }
+        flags |= FRAME_DIR;
+
+    } else if (token != NULL && strcmp(token, "-g") == 0) { // get file contents command
+
+        // Get the filename, then either the port or an offset, length and the port, and if the client takes zlib
+        if ((token = strtok_r(NULL, " ", &save)) != NULL) { name = token; }
+        while (nRest < 4 && (rest[nRest] = strtok_r(NULL, " ", &save)) != NULL) { nRest++; }
+        if (nRest > 1 && strcmp(rest[nRest-1], "zlib") == 0) {
+            zip = (cfg.zlevel != 0 && compressible(name)); // else it goes out as it is
+            nRest--;
+        }
+        if (nRest == 2 || nRest == 4 || (nRest == 3 && ((off = parseSize(rest[0])) == -1 || (len = parseSize(rest[1])) == -1))) {
+            LOG(L_INFO, "Sending INVALID RANGE error to client...\n\n");
+            c->reply = BAD_RNG; c->replyLen = sizeof(BAD_RNG)-1;
+            sendReply(r, c);
+            return;
+        }
+        if (nRest > 0) { port = rest[nRest-1]; }
+
+        // An upload being received under a temporary name is not there yet
+        if (isPutTemp((leaf = strrchr(name, '/')) != NULL ? leaf + 1 : name)) {
+            LOG(L_INFO, "Sending FILE NOT FOUND error to client...\n\n");
+            c->reply = BAD_FIL; c->replyLen = sizeof(BAD_FIL)-1;
+            sendReply(r, c);
+            return;
+        }
+
+        // Try the file cache, then to get the file contents, or just open the file to stream it.
+        // A checksum is taken (and compression done) as the file passes through a chunk, sendfile() and
+        // splice() never see it.
+        c->mode = ((zip || (c->check && cfg.transfer != T_URING)) && cfg.transfer != T_BUFFER) ? T_CHUNKED : cfg.transfer;
+        if (cfg.cacheSize > 0) {
+            if ((c->cached = cacheGet(name, &st, FALSE)) != NULL) { if (!rerun) { STAT_ADD(r->stats.cacheHits, 1); } }
+            else if (!rerun) { STAT_ADD(r->stats.cacheMisses, 1); }
+        }
+        if (c->cached != NULL) {
+            c->msg = c->cached->data;
+            size = c->cached->size;
+        } else if ((size = (c->mode == T_BUFFER) ? getFile(&c->msg, name) : openFile(&c->file, name)) == -1) {
+
+            // could not find file to open
+            LOG(L_INFO, "Sending FILE NOT FOUND error to client...\n\n");
+            c->reply = BAD_FIL; c->replyLen = sizeof(BAD_FIL)-1;
+            sendReply(r, c);
+            return;
+        }
+
+        // Tell the client which version of the file it gets, and skip it if the client has it already.
+        // A cached file was just checked against the file on disk, its status is that one.
+        if (c->cached == NULL && (c->file != -1 ? fstat(c->file, &st) : pathStat(name, &st)) == -1) {
+            LOG(L_INFO, "Sending FILE NOT FOUND error to client...\n\n");
+            endTransfer(r, c);
+            c->reply = BAD_FIL; c->replyLen = sizeof(BAD_FIL)-1;
+            sendReply(r, c);
+            return;
+        }
+        if (have == H_CRC && c->cached == NULL && c->msg == NULL && !hashKnown(c, &st, 0)) {
+            hashStart(r, c, &st, 0, have, resume); // the CRC32C of the file is read a chunk per turn first
+            return;
+        }
+        if (have != H_NONE && unchanged(c, have, name, &st)) {
+            LOG(L_INFO, "Sending NOT MODIFIED to client...\n\n");
+            endTransfer(r, c);
+            c->reply = UNMODIF; c->replyLen = sizeof(UNMODIF)-1;
+            sendReply(r, c);
+            return;
+        }
+        sprintf(facts, " SIZE %lld MTIME %lld", (long long)st.st_size, MTIME_NS(st));
+
+        // Only resume if the file is the one the client started on
+        if (resume != -1) {
+            if (st.st_size != c->restSize || MTIME_NS(st) != c->restMtime) {
+                LOG(L_INFO, "Sending FILE CHANGED error to client...\n\n");
+                endTransfer(r, c);
+                c->reply = CHANGED; c->replyLen = sizeof(CHANGED)-1;
+                sendReply(r, c);
+                return;
+            }
+            off = resume;
+        }
+
+        // Only send the requested range, a length running past the end stops at the end
+        if (off > size) {
+            LOG(L_INFO, "Sending INVALID RANGE error to client...\n\n");
+            endTransfer(r, c);
+            c->reply = BAD_RNG; c->replyLen = sizeof(BAD_RNG)-1;
+            sendReply(r, c);
+            return;
+        }
+        c->off = off;
+        c->len = (len == -1 || len > size - off) ? size - off : len;
+        if (nRest == 3) { LOG(L_DEBUG, "Sending range of %lld bytes from offset %lld\n\n", c->len, c->off); }
+
+        // A whole cached file is compressed once for every client, anything else (and a cached file
+        // until its compressed copy is ready) as it is sent
+        if (zip) {
+            flags |= FRAME_ZLIB;
+            strcat(facts, " CODEC zlib");
+            if (c->cached != NULL && c->off == 0 && c->len == size && cacheZip(c->cached)) {
+                LOG(L_DEBUG, "Sending compressed copy from cache: %lld bytes\n\n", c->cached->zlen);
+                c->msg = c->cached->zdata;
+                wire = c->cached->zlen;
+            } else {
+                c->zip = TRUE;
+            }
+        }
+
+    } else { // invalid command
+        LOG(L_INFO, "Sending INVALID COMMAND error to client...\n\n");
+        c->reply = BAD_CMD; c->replyLen = sizeof(BAD_CMD)-1;
+        sendReply(r, c);
+        return;
+    }
+
+    // Get the port number for the data connection
+    memset(c->port, '\0', sizeof(c->port));
+    if (port != NULL) { strncpy(c->port, port, sizeof(c->port)-1); }
+
+    // Get the length of the message as a string, or as a frame header in stream mode
+    memset(c->hdr, '\0', sizeof(c->hdr));
+    if (c->putName == NULL) { c->xferId++; } // an upload has no frame
+    if (c->check) { flags |= FRAME_CRC; }
+    if (c->stream) {
+        c->hdrLen = packFrame(c->hdr, c->xferId, flags, c->len);
+    } else {
+        sprintf(c->hdr, "%lld", c->len);
+        strcat(c->hdr, "\n"); // finish with newline to mark end of string
+        c->hdrLen = strlen(c->hdr);
+    }
+    c->hdrOff = 0;
+    c->sent = 0;
+    c->crc = 0;
+    c->crcKnown = (c->cached != NULL && c->off == 0 && c->len == c->cached->size);
+    if (c->crcKnown) { c->crc = c->cached->crc; }
+    if (wire != -1) { c->len = wire; }
+    c->retries = CONNECT_RETRIES;
+    c->backoff = CONNECT_BACKOFF_MS;
+
+    // command [and filename] good, send acknowledgment
+    LOG(L_DEBUG, "Command OK, sending acknowledgment to client...\n\n");
+    c->okAt = nowUs();
+    histAdd(&r->stats.okLat, c->okAt - c->cmdAt);
+    c->reply = CMD_OK; c->replyLen = sizeof(CMD_OK)-1;
+
+    // In passive mode tell the client which port to connect to
+    if (strcmp(c->port, "PASV") == 0 && !(c->stream && c->data.fd != -1)) {
+        if ((c->pasv = pasvGet(r)) == NULL) {
+            LOG_ERRNO(L_ERROR, "ERROR, opening passive data listener\n\n");
+            endTransfer(r, c);
+            c->reply = BAD_PSV; c->replyLen = sizeof(BAD_PSV)-1;
+            sendReply(r, c);
+            return;
+        }
+        c->pasv->w.conn = c;
+        sprintf(c->replyBuf, "OK %d\n", c->pasv->port);
+        c->reply = c->replyBuf; c->replyLen = strlen(c->replyBuf);
+        LOG(L_DEBUG, "Passive mode, client will connect on port: %d\n\n", c->pasv->port);
+    }
+
+    // A page of the listing says where the next one starts, a file which version of it is sent
+    if (next != -1) { sprintf(facts, " NEXT %llu:%lld", gen, next); }
+    if (facts[0] != '\0') {
+        if (c->reply != c->replyBuf) { strcpy(c->replyBuf, CMD_OK); }
+        n = strlen(c->replyBuf) - 1; // the facts go in before the newline
+        snprintf(c->replyBuf + n, sizeof(c->replyBuf) - n, "%s\n", facts);
+        c->reply = c->replyBuf; c->replyLen = strlen(c->replyBuf);
+    }
+    sendReply(r, c);
+}
+
+// Name: sendReply()
+// Desc: Sends (the rest of) the queued reply on the control connection.
+// Arg1: r - the reactor the connection belongs to.
+// Arg2: c - the connection to send the reply on.
+// Pre : A reply was queued by handleRequest().
+// Post: Once the whole reply is sent the connection waits for READY, or the next command after an error.
+void sendReply(struct reactor* r, struct conn* c) {
+
+    int n;
+
+    if ((n = sendAll(c->ctrl.fd, (char*)c->reply + c->replyOff, c->replyLen - c->replyOff)) == -1) {
+        LOG_ERRNO(L_ERROR, "ERROR, reply not sent to client\n\n");
+        closeConn(r, c);
+        return;
+    }
+    c->replyOff += n;
+    if (c->replyOff < c->replyLen) { watchFd(r, &c->ctrl, EPOLLOUT); return; } // finish when writable
+
+    // Nothing more to do after an error or a reply that carries no data
+    if (c->msg == NULL && c->file == -1 && c->archive == NULL) {
+        c->state = ST_CMD;
+        watchFd(r, &c->ctrl, EPOLLIN);
+        recvCommand(r, c); // the next command may already be buffered
+        return;
+    }
+
+    // A stream mode session sends right away on the data connection it already has
+    if (c->stream && c->data.fd != -1) {
+        watchFd(r, &c->ctrl, 0);
+        LOG(L_DEBUG, "Using open data connection: %lld bytes\n\n", c->len);
+        startData(r, c);
+        return;
+    }
+
+    // Passive mode, wait for the client to connect
+    if (c->pasv != NULL) {
+        watchFd(r, &c->ctrl, 0);
+        c->state = ST_ACCEPT;
+        watchFd(r, &c->pasv->w, EPOLLIN);
+        timerSet(r, c, PASV_TIMEOUT_MS);
+        return;
+    }
+
+    // Wait for the client to setup the data connection
+    c->state = ST_READY;
+    watchFd(r, &c->ctrl, EPOLLIN);
+    recvReady(r, c);
+}
+
+// Name: acceptData()
+// Desc: Accepts the client's data connection on a passive data listener.
+// Arg1: r - the reactor the connection belongs to.
+// Arg2: c - the connection waiting on the listener.
+// Pre : The OK reply with the listener's port was sent and the listener is readable.
+// Post: The data connection is established, the listener goes back to the pool and the length of
+//       the data is sent.
+void acceptData(struct reactor* r, struct conn* c) {
+
+    int fd;
+    struct sockaddr_storage peer;
+    socklen_t peerSize;
+    char peerHost[INET6_ADDRSTRLEN];
+
+    while (1) {
+        peerSize = sizeof(peer);
+        if ((fd = accept(c->pasv->w.fd, (struct sockaddr*)&peer, &peerSize)) == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) { continue; }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) { LOG_ERRNO(L_ERROR, "ERROR, accepting data connection\n\n"); }
+            return;
+        }
+
+        // only the client we gave the port to may connect, a v4 client shows up v4-mapped on a v6 listener
+        inet_ntop(peer.ss_family, getInAddr((struct sockaddr*)&peer), peerHost, sizeof(peerHost));
+        if (strcmp(peerHost, c->host) == 0
+                || (strncmp(peerHost, "::ffff:", 7) == 0 && strcmp(peerHost + 7, c->host) == 0)
+                || (strncmp(c->host, "::ffff:", 7) == 0 && strcmp(c->host + 7, peerHost) == 0)) { break; }
+        LOG(L_WARN, "WARNING, refusing data connection from: %s\n\n", peerHost);
+        close(fd);
+    }
+    if (setNonBlocking(fd) == -1) {
+        LOG_ERRNO(L_ERROR, "ERROR, setting up data connection\n\n");
+        close(fd);
+        closeConn(r, c);
+        return;
+    }
+
+    timerCancel(r, c);
+    pasvPut(r, c->pasv);
+    c->pasv = NULL;
+    c->data.fd = fd;
+    LOG(L_DEBUG, "Data connection established!\n\n");
+    histAdd(&r->stats.connectLat, nowUs() - c->okAt);
+    startData(r, c);
+}
+
+// Name: recvReady()
+// Desc: Receives READY from the client, meaning it is listening for the data connection.
+// Arg1: r - the reactor the connection belongs to.
+// Arg2: c - the connection to receive on.
+// Pre : The OK reply was sent.
+// Post: The data connection is opened once READY arrives, or the connection is closed on error.
+void recvReady(struct reactor* r, struct conn* c) {
+
+    char buf[LINE_LEN];
+    int n;
+
+    memset(buf, '\0', sizeof(buf));
+    if ((n = recvLine(c, buf, sizeof(buf))) == 0) { return; }
+    if (n == -1 || strcmp(buf, "READY") != 0) {
+        LOG(L_ERROR, "ERROR, client did not send READY: %s\n\n", buf);
+        closeConn(r, c);
+        return;
+    }
+
+    watchFd(r, &c->ctrl, 0);
+    c->state = ST_CONNECT;
+    openData(r, c);
+}
+
+// Name: openData()
+// Desc: Starts opening the data connection with the client host.
+// Arg1: r - the reactor the connection belongs to.
+// Arg2: c - the connection to open the data connection for.
+// Pre : The client sent READY, or a previous attempt failed and the backoff elapsed.
+// Post: The data connection is in progress, checkData() finishes it once it is writable.
+void openData(struct reactor* r, struct conn* c) {
+
+    LOG(L_DEBUG, "Opening data connection with client: %s on port: %s\n\n", c->host, c->port);
+    if ((c->data.fd = dataConnect(c->host, c->port)) == -1) { retryData(r, c); return; } // Error connecting
+    watchFd(r, &c->data, EPOLLOUT);
+}
+
+// Name: retryData()
+// Desc: Schedules another attempt at the data connection with exponential backoff.
+// Arg1: r - the reactor the connection belongs to.
+// Arg2: c - the connection the data connection belongs to.
+// Pre : An attempt at opening the data connection failed.
+// Post: openData() is called again after the backoff, or the connection is closed if out of attempts.
+void retryData(struct reactor* r, struct conn* c) {
+
+    if (c->data.fd != -1) {
+        unwatchFd(r, &c->data);
+        close(c->data.fd);
+        c->data.fd = -1;
+    }
+    if (--c->retries <= 0) {
+        LOG(L_ERROR, "ERROR, giving up on data connection to host: %s on port: %s\n\n", c->host, c->port);
+        closeConn(r, c);
+        return;
+    }
+    timerSet(r, c, c->backoff);
+    c->backoff *= 2;
+}
+
+// Name: checkData()
+// Desc: Checks the result of connecting to the client once the data socket is writable.
+// Arg1: r - the reactor the connection belongs to.
+// Arg2: c - the connection the data connection belongs to.
+// Pre : openData() started a non-blocking connect.
+// Post: The length of the data is sent if the connection was established, otherwise it is retried.
+void checkData(struct reactor* r, struct conn* c) {
+
+    int err = 0;
+    socklen_t errLen = sizeof(err);
+
+    if (getsockopt(c->data.fd, SOL_SOCKET, SO_ERROR, &err, &errLen) == -1 || err != 0) {
+        LOG(L_ERROR, "ERROR, failed to connect to host: %s on port: %s\n\n", c->host, c->port);
+        retryData(r, c);
+        return;
+    }
+    LOG(L_DEBUG, "Data connection established!\n\n");
+    histAdd(&r->stats.connectLat, nowUs() - c->okAt);
+    startData(r, c);
+}
+
+// Name: shakeHands()
+// Desc: Goes on with the TLS handshake of the control connection, or of the data connection.
+// Arg1: r - the reactor the connection belongs to.
+// Arg2: c - the connection.
+// Pre : The connection is in ST_TLS. The data connection is open only if it is its handshake.
+// Post: Once the handshake is done the session waits for its first command, or the transfer
+//       starts. The connection is closed if the handshake fails.
+void shakeHands(struct reactor* r, struct conn* c) {
+
+    struct watch* w = (c->data.fd != -1) ? &c->data : &c->ctrl;
+    unsigned int events;
+    int n;
+
+    if ((n = tlsShake(r, w->fd, &events)) == 0) { watchFd(r, w, events); return; }
+    timerCancel(r, c);
+    if (n == -1) {
+        LOG_ERRNO(L_ERROR, "ERROR, TLS handshake failed\n\n");
+        closeConn(r, c);
+        return;
+    }
+    if (w == &c->data) {
+        watchFd(r, &c->data, 0);
+        startData(r, c);
+        return;
+    }
+    c->state = ST_CMD;
+    watchFd(r, &c->ctrl, EPOLLIN);
+    recvCommand(r, c); // the first command may have come with the handshake
+}
+
+// Name: startData()
+// Desc: Starts the transfer once the data connection is up.
+// Arg1: r - the reactor the connection belongs to.
+// Arg2: c - the connection the data connection belongs to.
+// Pre : The data connection is established.
+// Post: The length of the data is sent, or an upload starts being received.
+void startData(struct reactor* r, struct conn* c) {
+
+    // the data connection's TLS handshake comes before its first transfer
+    if (tlsCtx != NULL && (!TLS_ON(c->data.fd) || !SSL_is_init_finished(tlsFds[c->data.fd].ssl))) {
+        if (!TLS_ON(c->data.fd) && !tlsStart(c->data.fd, FALSE)) {
+            LOG_ERRNO(L_ERROR, "ERROR, starting TLS on data connection\n\n");
+            closeConn(r, c);
+            return;
+        }
+        c->state = ST_TLS;
+        timerSet(r, c, TLS_TIMEOUT_MS);
+        shakeHands(r, c);
+        return;
+    }
+
+    // Without kTLS the bytes have to pass through OpenSSL, so a file is read through a chunk.
+    // An upload always is, OpenSSL decrypts what is received.
+    if (TLS_ON(c->data.fd) && c->file != -1 && (c->putName != NULL || !tlsFds[c->data.fd].ktls)) { c->mode = T_CHUNKED; }
+
+    if (c->putName != NULL) {
+        LOG(L_DEBUG, "Receiving upload from client: %lld bytes\n\n", c->len);
+        c->state = ST_RECV;
+        recvUpload(r, c);
+        return;
+    }
+
+    // Send buffer length and then buffer contents.
+    if (c->stream) { LOG(L_DEBUG, "Sending frame %u to client: %lld bytes\n\n", c->xferId, c->len); }
+    else { LOG(L_DEBUG, "Sending data length to client: %s\n", c->hdr); }
+    c->state = ST_HEADER;
+    sendHeader(r, c);
+}
+
+// Name: recvUpload()
+// Desc: Receives as much of an upload as the data connection has, into the temporary file.
+// Arg1: r - the reactor the connection belongs to.
+// Arg2: c - the connection the data connection belongs to.
+// Pre : The data connection is established and the temporary file is open.
+// Post: Once the whole length is there the file is synced and renamed into place, and STORED is
+//       sent. The connection is closed (and the temporary file removed) if the client goes away early.
+void recvUpload(struct reactor* r, struct conn* c) {
+
+    long long n, ms;
+    char* leaf;
+    static const char STORED[]  = "STORED\n";
+    static const char BAD_PUT[] = "CANNOT STORE FILE\n";
+
+    if (c->started == 0) { c->started = nowMs(); }
+    if (c->mode == T_CHUNKED && c->chunk == NULL) {
+        if ((c->chunk = chunkGet(r)) == NULL) {
+            LOG_ERRNO(L_ERROR, "ERROR, allocating transfer buffer\n\n");
+            closeConn(r, c);
+            return;
+        }
+    }
+
+    // socket to file through a pipe, or one chunk at a time
+    if (c->mode == T_SPLICE) {
+        n = spliceIn(c->data.fd, c->file, c->pipe, c->sent, c->len - c->sent);
+    } else {
+        n = recvChunks(c->data.fd, c->file, c->chunk, c->sent, c->len - c->sent);
+    }
+    if (n == -1) {
+        LOG_ERRNO(L_ERROR, "ERROR, receiving upload\n\n");
+        closeConn(r, c);
+        return;
+    }
+    c->sent += n;
+    if (c->sent < c->len) { watchFd(r, &c->data, EPOLLIN); return; }
+
+    ms = nowMs() - c->started;
+    LOG(L_INFO, "Upload complete! %lld bytes in %lld ms (%.1f MB/s) using %s\n\n", c->len, ms,
+            ms > 0 ? c->len / 1000.0 / ms : 0.0, c->mode == T_SPLICE ? "splice" : "chunked");
+    STAT_ADD(r->stats.uploads, 1);
+    STAT_ADD(r->stats.bytesRecv, c->len);
+    tcpReport(r, c);
+
+    // the file only takes the name once it is all on disk
+    watchFd(r, &c->data, 0);
+    leaf = strrchr(c->putName, '/');
+    if (putStore(c->file, c->putDir, c->putTemp, leaf ? leaf + 1 : c->putName) == -1) {
+        LOG_ERRNO(L_ERROR, "ERROR, storing upload\n\n");
+        c->reply = BAD_PUT; c->replyLen = sizeof(BAD_PUT)-1;
+    } else {
+        LOG(L_INFO, "File stored: %s\n\n", c->putName);
+        c->putTemp = NULL; // nothing to remove
+        c->reply = STORED; c->replyLen = sizeof(STORED)-1;
+    }
+    endTransfer(r, c);
+    c->state = ST_REPLY;
+    c->replyOff = 0;
+    sendReply(r, c);
+}
+
+// Name: sendHeader()
+// Desc: Sends (the rest of) the length of the data on the data connection.
+// Arg1: r - the reactor the connection belongs to.
+// Arg2: c - the connection the data connection belongs to.
+// Pre : The data connection is established.
+// Post: Once the length is sent, the data follows right behind it.
+void sendHeader(struct reactor* r, struct conn* c) {
+
+    int n;
+
+    // held back with MSG_MORE so the header leaves in the same segment as the start of the data
+    if ((n = sendFlags(c->data.fd, c->hdr + c->hdrOff, c->hdrLen - c->hdrOff, (cfg.cork && c->len > 0) ? MSG_MORE : 0)) == -1) {
+        LOG_ERRNO(L_ERROR, "ERROR, could not send message length, aborting\n\n");
+        closeConn(r, c);
+        return;
+    }
+    c->hdrOff += n;
+    if (c->hdrOff < c->hdrLen) { watchFd(r, &c->data, EPOLLOUT); return; }
+
+    c->state = ST_STREAM;
+    sendData(r, c);
+}
+
+// Name: sendData()
+// Desc: Sends as much of the data as the data connection will take.
+// Arg1: r - the reactor the connection belongs to.
+// Arg2: c - the connection the data connection belongs to.
+// Pre : The length of the data was sent.
+// Post: The data is sent, then the connection waits for acknowledgment of receipt.
+void sendData(struct reactor* r, struct conn* c) {
+
+    long long n, ms, want = c->len - c->sent;
+    off_t off = c->off + c->sent + c->piped; // file offset of the next byte to read
+
+    if (c->started == 0) {
+        LOG(L_DEBUG, "Sending data to client...\n\n");
+        c->started = nowMs();
+    }
+    if (schedDefer(r, c)) { return; }
+
+    // on its turn a transfer sends no more than it has credit for, without a quantum all it can
+    if (c->turn && cfg.quantum > 0) {
+        c->deficit += cfg.quantum;
+        if (c->deficit <= 0) { schedQueue(r, c); return; }
+        if (c->deficit < want) { want = c->deficit; }
+    }
+
+    if (((c->file != -1 && c->mode == T_CHUNKED) || c->zip || c->archive != NULL) && c->chunk == NULL) {
+        if ((c->chunk = chunkGet(r)) == NULL) {
+            LOG_ERRNO(L_ERROR, "ERROR, allocating transfer buffer\n\n");
+            closeConn(r, c);
+            return;
+        }
+    }
+    if (c->zip && (c->file != -1 || c->archive != NULL) && r->scratch == NULL) {
+        if ((r->scratch = malloc(cfg.chunkSize)) == NULL) {
+            LOG_ERRNO(L_ERROR, "ERROR, allocating compression buffer\n\n");
+            closeConn(r, c);
+            return;
+        }
+    }
+
+    if (c->archive != NULL) {
+        n = sendArchive(c->data.fd, c->archive, c->chunk, r->scratch, want, c->zip, c->check ? &c->crc : NULL);
+    } else if (c->zip) {
+        n = sendZipped(c->data.fd, c->file, c->file == -1 ? c->msg : NULL, c->chunk, r->scratch,
+                       c->off + c->sent, want, (c->check && !c->crcKnown) ? &c->crc : NULL);
+    } else if (c->file == -1) {
+        n = sendAll(c->data.fd, c->msg + c->off + c->sent, want);
+        if (n > 0 && c->check && !c->crcKnown) { c->crc = crc32c(c->crc, c->msg + c->off + c->sent, n); }
+    } else if (c->mode == T_SENDFILE) {
+        // not every file system supports sendfile(), splice() instead
+        if ((n = sendFile(c->data.fd, c->file, &off, want)) == -1 && (errno == EINVAL || errno == ENOSYS)) {
+            c->mode = T_SPLICE;
+            n = spliceFile(c->data.fd, c->file, c->pipe, &c->piped, &off, want);
+        }
+    } else if (c->mode == T_SPLICE) {
+        n = spliceFile(c->data.fd, c->file, c->pipe, &c->piped, &off, want);
+    } else if (c->mode == T_URING) {
+        n = ringFile(r, c); // the completions count what is sent
+    } else {
+        off = c->off + c->sent + (c->chunk->len - c->chunk->off);
+        n = sendChunks(c->data.fd, c->file, c->chunk, off, want, c->check ? &c->crc : NULL);
+    }
+    if (n == -1) {
+        LOG_ERRNO(L_WARN, "WARNING, entire message not sent\n\n");
+        closeConn(r, c);
+        return;
+    }
+    c->sent += n;
+    if (c->mode != T_URING || c->file == -1) { schedCharge(c, n); } // else charged as the sends complete
+    if (c->sent < c->len) {
+        if (c->turn && cfg.quantum > 0) {
+            // a transfer that used its turn goes to the back of the queue, one that filled the
+            // socket first waits for room and gives up its credit
+            c->deficit -= n;
+            if (n >= want) { schedQueue(r, c); return; }
+            c->deficit = 0;
+        }
+        if (c->mode != T_URING || c->file == -1) { watchFd(r, &c->data, EPOLLOUT); }
+        return;
+    }
+    c->deficit = 0;
+
+    // the chunk can serve another transfer while we wait
+    if (c->chunk != NULL) { chunkPut(r, c->chunk); c->chunk = NULL; }
+
+    ms = nowMs() - c->started;
+    LOG(L_INFO, "Transfer complete! %lld bytes in %lld ms (%.1f MB/s) using %s\n\n", c->len, ms,
+            ms > 0 ? c->len / 1000.0 / ms : 0.0,
+            c->archive ? "archive" : c->zip ? "zlib" : c->cached ? "cache" : c->file == -1 ? "buffer" : (c->mode == T_SENDFILE ? "sendfile" : (c->mode == T_SPLICE ? "splice" : (c->mode == T_URING ? "uring" : "chunked"))));
+    STAT_ADD(r->stats.transfers, 1);
+    STAT_ADD(r->stats.bytesSent, c->len);
+    histAdd(&r->stats.rate, c->len * 1000 / 1024 / (ms > 0 ? ms : 1));
+    tcpReport(r, c);
+
+    // the checksum follows the payload
+    if (c->check) {
+        LOG(L_DEBUG, "Sending checksum: %08x\n\n", c->crc);
+        c->hdr[0] = (char)(c->crc >> 24); c->hdr[1] = (char)(c->crc >> 16);
+        c->hdr[2] = (char)(c->crc >> 8);  c->hdr[3] = (char)c->crc;
+        c->hdrLen = 4;
+        c->hdrOff = 0;
+        c->state = ST_TRAILER;
+        sendTrailer(r, c);
+        return;
+    }
+    finishData(r, c);
+}
+
+// Name: hashStart()
+// Desc: Puts a command off until its file has been read for the checksums it needs, so a large
+//       file does not hold up the worker's other sessions while it is read.
+// Arg1: r - the reactor the connection belongs to.
+// Arg2: c - the connection, with the file open.
+// Arg3: st - the file's status.
+// Arg4: block - the SUMS block size, 0 for only the CRC32C of the whole file.
+// Arg5: have - the HAVE the command was given, so it still has it when it runs again.
+// Arg6: resume - the REST the command was given, likewise.
+// Pre : hashKnown() is FALSE for the file.
+// Post: The connection waits in the run queue and reads a chunk of the file on each of its turns,
+//       its control connection is not read meanwhile. hashStep() runs the command again at the end.
+// Rtrn: TRUE if the command was put off, FALSE if out of memory for the block checksums.
+bool hashStart(struct reactor* r, struct conn* c, struct stat* st, long long block, enum haveKind have, long long resume) {
+
+    struct hashJob* h = &c->hash;
+
+    free(h->sums);
+    h->sums = NULL;
+    h->done = FALSE;
+    if (block > 0 && (h->sums = malloc((st->st_size + block - 1) / block * 4 + 1)) == NULL) { return FALSE; }
+    h->dev = st->st_dev;
+    h->ino = st->st_ino;
+    h->size = st->st_size;
+    h->mtime = MTIME_NS(*st);
+    h->pos = 0;
+    h->block = block;
+    h->crc = 0;
+    h->sum = crc32(0L, Z_NULL, 0);
+    c->have = have;
+    c->rest = resume;
+    c->state = ST_HASH;
+    watchFd(r, &c->ctrl, 0);
+    schedQueue(r, c);
+    LOG(L_DEBUG, "Reading file for its checksums before answering: %lld bytes\n\n", h->size);
+    return TRUE;
+}
+
+// Name: hashStep()
+// Desc: Reads the next chunk of a file for its checksums, on the connection's turn.
+// Arg1: r - the reactor the connection belongs to.
+// Arg2: c - the connection, put off by hashStart().
+// Pre : The scheduler is running the connection.
+// Post: The chunk is added to the CRC32C and to the block checksums, and the connection is queued
+//       for its next turn. Once the file is all read, or it turns out to have changed, the command
+//       runs again and finds the checksums, or reads the file again as it is now.
+void hashStep(struct reactor* r, struct conn* c) {
+
+    static const char BAD_FIL[] = "FILE NOT FOUND\n";
+    struct hashJob* h = &c->hash;
+    long long n, i, end, b;
+    ssize_t got;
+
+    if (c->chunk == NULL && (c->chunk = chunkGet(r)) == NULL) {
+        LOG_ERRNO(L_ERROR, "ERROR, allocating transfer buffer\n\n");
+        closeConn(r, c);
+        return;
+    }
+    n = (h->size - h->pos < cfg.chunkSize) ? h->size - h->pos : cfg.chunkSize;
+    while ((got = pread(c->file, c->chunk->data, n, h->pos)) == -1 && errno == EINTR) {}
+    if (got == -1) {
+        LOG_ERRNO(L_ERROR, "ERROR, reading file for its checksums\n\n");
+        endTransfer(r, c);
+        c->state = ST_REPLY;
+        c->reply = BAD_FIL; c->replyLen = sizeof(BAD_FIL)-1;
+        sendReply(r, c);
+        return;
+    }
+    if (got == 0 && n > 0) { h->mtime = -1; } // it shrank, these checksums are of no file
+
+    h->crc = crc32c(h->crc, c->chunk->data, got);
+    for (i = 0; h->sums != NULL && i < got; i = end) {
+        end = i + h->block - (h->pos + i) % h->block; // up to the end of the block
+        if (end > got) { end = got; }
+        h->sum = crc32(h->sum, (unsigned char*)c->chunk->data + i, end - i);
+        if ((h->pos + end) % h->block == 0 || h->pos + end == h->size) {
+            b = (h->pos + end - 1) / h->block;
+            h->sums[b*4]   = (h->sum >> 24) & 0xff;
+            h->sums[b*4+1] = (h->sum >> 16) & 0xff;
+            h->sums[b*4+2] = (h->sum >> 8) & 0xff;
+            h->sums[b*4+3] = h->sum & 0xff;
+            h->sum = crc32(0L, Z_NULL, 0);
+        }
+    }
+    h->pos += got;
+    if (h->pos < h->size && got > 0) { schedQueue(r, c); return; }
+
+    h->done = TRUE;
+    LOG(L_DEBUG, "File read for its checksums: %lld bytes\n\n", h->pos);
+    endTransfer(r, c);
+    c->turn = FALSE; // the transfer the command starts was never queued for this turn
+    handleRequest(r, c);
+}
+
+// Name: walkStep()
+// Desc: Walks the next directory entries of a -r tree, on the connection's turn.
+// Arg1: r - the reactor the connection belongs to.
+// Arg2: c - the connection, put off with its archive open.
+// Pre : The scheduler is running the connection.
+// Post: Up to ARCHIVE_STEP entries are walked and the connection is queued for its next turn. Once
+//       the whole tree is walked the command runs again and sends the archive.
+void walkStep(struct reactor* r, struct conn* c) {
+
+    static const char BAD_DIR[] = "ERROR READING DIRECTORY\n";
+    int rc;
+
+    if ((rc = archiveWalk(c->archive, ARCHIVE_STEP)) == 1) { schedQueue(r, c); return; }
+    if (rc == -1) {
+        LOG_ERRNO(L_ERROR, "ERROR, could not walk directory tree\n\n");
+        endTransfer(r, c);
+        c->state = ST_REPLY;
+        c->reply = BAD_DIR; c->replyLen = sizeof(BAD_DIR)-1;
+        sendReply(r, c);
+        return;
+    }
+    c->turn = FALSE; // the archive's transfer was never queued for this turn
+    handleRequest(r, c);
+}
+
+// Name: sendTrailer()
+// Desc: Sends (the rest of) the checksum that follows the payload in MODE CRC.
+// Arg1: r - the reactor the connection belongs to.
+// Arg2: c - the connection the data connection belongs to.
+// Pre : The payload was sent and the checksum is in the header buffer.
+// Post: Once the checksum is sent the transfer is finished.
+void sendTrailer(struct reactor* r, struct conn* c) {
+
+    int n;
+
+    if ((n = sendAll(c->data.fd, c->hdr + c->hdrOff, c->hdrLen - c->hdrOff)) == -1) {
+        LOG_ERRNO(L_ERROR, "ERROR, could not send checksum, aborting\n\n");
+        closeConn(r, c);
+        return;
+    }
+    c->hdrOff += n;
+    if (c->hdrOff < c->hdrLen) { watchFd(r, &c->data, EPOLLOUT); return; }
+
+    finishData(r, c);
+}
+
+// Name: finishData()
+// Desc: Finishes a transfer once everything was sent on the data connection.
+// Arg1: r - the reactor the connection belongs to.
+// Arg2: c - the connection the data connection belongs to.
+// Pre : The data (and its checksum) was sent.
+// Post: A stream mode session goes on to its next command, otherwise the connection waits for
+//       acknowledgment of receipt.
+void finishData(struct reactor* r, struct conn* c) {
+
+    watchFd(r, &c->data, 0);
+
+    // A stream mode session moves straight on to the next (maybe already queued) command,
+    // the acknowledgment is picked up whenever it arrives
+    if (c->stream) {
+        c->acks++;
+        endTransfer(r, c);
+        c->state = ST_CMD;
+        watchFd(r, &c->ctrl, EPOLLIN);
+        recvCommand(r, c);
+        return;
+    }
+    LOG(L_DEBUG, "Waiting for acknowledgment of receipt...\n\n");
+
+    // Get acknowledgment of receipt from client before closing
+    c->state = ST_ACK;
+    watchFd(r, &c->ctrl, EPOLLIN);
+    recvAck(r, c);
+}
+
+// Name: recvCommand()
+// Desc: Receives a command from the client on the control connection.
+// Arg1: r - the reactor the connection belongs to.
+// Arg2: c - the connection to receive the command on.
+// Pre : The connection is awaiting a command.
+// Post: Once a whole command line arrives it is handed to handleRequest(), or the connection is closed
+//       if the client went away. Acknowledgments of stream mode transfers are counted off on the way.
+//       While draining, the next command after the transfers in flight lets the session go instead.
+void recvCommand(struct reactor* r, struct conn* c) {
+
+    int n;
+
+    while (1) {
+        // Get command
+        memset(c->cmd, '\0', sizeof(c->cmd));
+        if ((n = recvLine(c, c->cmd, sizeof(c->cmd))) == 0) {
+            // a drain lets a session go as soon as it has nothing left in flight
+            if (r->drained && !c->leaving && c->acks == 0 && c->inLen == 0) { drainSession(r, c); }
+            return;
+        }
+        if (n == -1) {
+            if (!c->leaving && (c->inLen > 0 || errno != 0)) { LOG_ERRNO(L_ERROR, "ERROR, receiving command from client\n\n"); }
+            closeConn(r, c);
+            return;
+        }
+        if (c->leaving) { continue; } // sent before the client saw RECONNECT, it sends it again elsewhere
+
+        // acknowledgment of an earlier stream mode transfer, not a command
+        c->cmdAt = nowUs();
+        if (c->acks > 0 && strcmp(c->cmd, "OK") == 0) {
+            c->acks--;
+            LOG(L_DEBUG, "Acknowledgment of receipt received, %u outstanding\n\n", c->acks);
+            continue;
+        }
+        break;
+    }
+    if (r->drained && strcmp(c->cmd, "QUIT") != 0) { drainSession(r, c); return; }
+    handleRequest(r, c);
+}
+
+// Name: recvAck()
+// Desc: Receives the acknowledgment of receipt from the client and finishes the request.
+// Arg1: r - the reactor the connection belongs to.
+// Arg2: c - the connection to receive the acknowledgment on.
+// Pre : The data was sent.
+// Post: The data connection is closed and the connection awaits the next command.
+void recvAck(struct reactor* r, struct conn* c) {
+
+    int n;
+
+    memset(c->cmd, '\0', sizeof(c->cmd));
+    if ((n = recvLine(c, c->cmd, sizeof(c->cmd))) == 0) { return; }
+    if (n == -1) {
+        LOG_ERRNO(L_ERROR, "ERROR, getting acknowledgment back from client\n");
+        closeConn(r, c);
+        return;
+    }
+    LOG(L_DEBUG, "Acknowledgment of receipt received: %s\n\n", c->cmd);
+    if (!c->stream) { LOG(L_DEBUG, "Closing data connection...\n\n"); }
+
+    endTransfer(r, c);
+    c->state = ST_CMD;
+    recvCommand(r, c);
+}
+
+// Name: recvLine()
+// Desc: Gets the next newline terminated line from the control connection.
+// Arg1: c - the connection to receive on.
+// Arg2: line - where to store the line, without the newline.
+// Arg3: size - the size of line.
+// Pre : None.
+// Post: The line is removed from the connection's input, anything after it stays for the next call.
+// Rtrn: 1 if a line was read, 0 if the whole line has not arrived yet, or -1 if the client closed the
+//       connection (errno 0), sent a line that is too long, or an error is encountered.
+int recvLine(struct conn* c, char* line, int size) {
+
+    char* nl;
+    int n;
+
+    while (1) {
+
+        // a whole line already buffered
+        if ((nl = memchr(c->in, '\n', c->inLen)) != NULL) {
+            n = nl - c->in;
+            if (n > 0 && c->in[n-1] == '\r') { n--; } // tolerate CRLF
+            if (n >= size) { n = size-1; }
+            memcpy(line, c->in, n);
+            line[n] = '\0';
+            c->inLen -= (nl + 1) - c->in;
+            memmove(c->in, nl + 1, c->inLen);
+            return 1;
+        }
+        if (c->inLen == sizeof(c->in)) { errno = EMSGSIZE; return -1; }
+
+        // otherwise receive more
+        if ((n = recvSome(c->ctrl.fd, c->in + c->inLen, sizeof(c->in) - c->inLen)) == -1) {
+            if (errno == EINTR) { continue; }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { return 0; }
+            return -1;
+        }
+        if (n == 0) { errno = 0; return -1; }
+        c->inLen += n;
+    }
+}
+
+// Name: packFrame()
+// Desc: Writes the binary header that precedes a payload on a stream mode data connection.
+// Arg1: buf - where to write the header, at least FRAME_LEN bytes.
+// Arg2: id - the transfer id.
+// Arg3: flags - FRAME_* flags describing the payload.
+// Arg4: len - the length of the payload that follows.
+// Pre : None.
+// Post: The header is written in network byte order.
+// Rtrn: The length of the header, FRAME_LEN.
+int packFrame(char* buf, unsigned int id, unsigned int flags, long long len) {
+
+    unsigned int n;
+    int i;
+
+    n = htonl(id);
+    memcpy(buf, &n, 4);
+    n = htonl(flags);
+    memcpy(buf + 4, &n, 4);
+    for (i = 0; i < 8; i++) {
+        buf[8 + i] = (char)((unsigned long long)len >> (56 - 8 * i));
+    }
+    return FRAME_LEN;
+}
+
+// Name: endTransfer()
+// Desc: Releases everything a transfer used so the connection can serve another command.
+// Arg1: r - the reactor the connection belongs to.
+// Arg2: c - the connection.
+// Pre : The transfer finished or failed.
+// Post: The file, pipe, chunk and message are closed or freed, as is the data connection unless the
+//       session is in stream mode. Entries of the connection's still on the ring are submitted first,
+//       so none of them runs against a file or socket that reuses a closed fd.
+void endTransfer(struct reactor* r, struct conn* c) {
+
+    // an entry still queued names the fds by number, it must reach the kernel before they are closed
+    if (c->ringOps > 0 && r->ring.queued > 0) { ringSubmit(r); }
+    timerCancel(r, c);
+    if (c->queued) { schedRemove(r, c); }
+    c->deficit = 0;
+    if (c->pasv != NULL) { pasvPut(r, c->pasv); c->pasv = NULL; }
+    if (c->data.fd != -1) {
+        unwatchFd(r, &c->data);
+        if (!c->stream) { tlsEnd(c->data.fd); close(c->data.fd); c->data.fd = -1; }
+    }
+    if (c->file != -1) { close(c->file); c->file = -1; }
+    if (c->pipe[0] != -1) { close(c->pipe[0]); close(c->pipe[1]); c->pipe[0] = c->pipe[1] = -1; }
+    if (c->chunk != NULL && c->ringOps == 0) { chunkPut(r, c->chunk); c->chunk = NULL; } // else the ring still uses it
+    if (c->listing != NULL) { listingPut(c->listing); c->listing = NULL; }
+    else if (c->archive != NULL) { archiveFree(c->archive); c->archive = NULL; }
+    else if (c->cached != NULL) { cachePut(c->cached); c->cached = NULL; }
+    else { free(c->msg); }
+    c->msg = NULL;
+    if (c->putTemp != NULL && c->putTemp[0] != '\0') { unlinkat(c->putDir, c->putTemp, 0); } // an unnamed one goes with its fd
+    c->putTemp = NULL;
+    if (c->putDir != -1) { close(c->putDir); c->putDir = -1; }
+    c->putName = NULL;
+    c->arenaLen = 0;
+    c->piped = 0;
+    c->started = 0;
+}
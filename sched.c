@@ -0,0 +1,245 @@
+/*
+ * Name: sched.c
+ * Auth: Andrew Swaim
+ * Date: November 2019
+ * Desc: The transfer scheduler: deficit round robin between the transfers of a worker, token
+ *       bucket rate limits per session, per client address and for the whole server, and the
+ *       admission of new sessions under --max-sessions.
+ */
+
+#include "ftpserver.h"
+
+// Name: bucketWait()
+// Desc: Gets how long a token bucket makes the next send wait. A bucket is kept as one number,
+//       the time its tokens run out (the theoretical arrival time of GCRA), so a bucket shared by
+//       several workers is updated with a single compare and swap and needs no lock.
+// Arg1: tat - the bucket.
+// Arg2: rate - the bucket's rate in bytes/s.
+// Arg3: now - the current time (us).
+// Pre : None.
+// Post: None.
+// Rtrn: The time to wait (us), 0 if a burst of up to the quantum may be sent now.
+long long bucketWait(long long* tat, long long rate, long long now) {
+
+    long long burst = (cfg.quantum > cfg.chunkSize ? cfg.quantum : cfg.chunkSize) * 1000000LL / rate;
+    long long wait = __atomic_load_n(tat, __ATOMIC_RELAXED) - now - burst;
+
+    return (wait > 0) ? wait : 0;
+}
+
+// Name: bucketCharge()
+// Desc: Takes the tokens for bytes that were sent out of a token bucket.
+// Arg1: tat - the bucket.
+// Arg2: rate - the bucket's rate in bytes/s.
+// Arg3: n - the bytes sent.
+// Arg4: now - the current time (us).
+// Pre : None.
+// Post: The bucket runs out n / rate seconds later. The bytes are charged after they are sent,
+//       so a bucket can go over by one turn, and the next send waits that much longer.
+void bucketCharge(long long* tat, long long rate, long long n, long long now) {
+
+    long long old = __atomic_load_n(tat, __ATOMIC_RELAXED), next;
+
+    do {
+        next = (old > now ? old : now) + n * 1000000LL / rate;
+    } while (!__atomic_compare_exchange_n(tat, &old, next, TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// Name: schedDefer()
+// Desc: Decides if a transfer may send now or has to wait, for a rate limit or for its turn.
+// Arg1: r - the reactor the connection belongs to.
+// Arg2: c - the connection whose transfer wants to send.
+// Pre : The transfer has data left to send.
+// Post: A transfer over a rate limit sleeps on its timer, one that is not on its turn joins the
+//       run queue. io_uring transfers are only rate limited, the ring already interleaves them
+//       a chunk at a time.
+// Rtrn: TRUE if the transfer was put off, FALSE if it may send.
+bool schedDefer(struct reactor* r, struct conn* c) {
+
+    // read once, SIGHUP may change them in between
+    long long sessionRate = cfg.sessionRate, ipRate = cfg.ipRate, maxRate = cfg.maxRate;
+    long long now, wait = 0, w;
+
+    if (sessionRate > 0 || (c->ipb != NULL && ipRate > 0) || maxRate > 0) {
+        now = nowUs();
+        if (sessionRate > 0) { wait = bucketWait(&c->tat, sessionRate, now); }
+        if (c->ipb != NULL && ipRate > 0 && (w = bucketWait(&c->ipb->tat, ipRate, now)) > wait) { wait = w; }
+        if (maxRate > 0 && (w = bucketWait(&globalTat, maxRate, now)) > wait) { wait = w; }
+        if (wait > 0) {
+            if (c->queued) { schedRemove(r, c); }
+            watchFd(r, &c->data, 0);
+            timerSet(r, c, (wait + 999) / 1000);
+            STAT_ADD(r->stats.throttled, 1);
+            return TRUE;
+        }
+    }
+    if (cfg.quantum == 0 || c->turn || (c->mode == T_URING && c->file != -1)) { return FALSE; }
+    schedQueue(r, c);
+    return TRUE;
+}
+
+// Name: schedCharge()
+// Desc: Charges the bytes a transfer sent to every rate limit it is under.
+// Arg1: c - the connection.
+// Arg2: n - the bytes sent.
+// Pre : None.
+// Post: The session, address and server buckets are n bytes emptier.
+void schedCharge(struct conn* c, long long n) {
+
+    long long sessionRate = cfg.sessionRate, ipRate = cfg.ipRate, maxRate = cfg.maxRate;
+    long long now;
+
+    if (n <= 0 || (sessionRate == 0 && (c->ipb == NULL || ipRate == 0) && maxRate == 0)) { return; }
+    now = nowUs();
+    if (sessionRate > 0) { bucketCharge(&c->tat, sessionRate, n, now); }
+    if (c->ipb != NULL && ipRate > 0) { bucketCharge(&c->ipb->tat, ipRate, n, now); }
+    if (maxRate > 0) { bucketCharge(&globalTat, maxRate, n, now); }
+}
+
+// Name: schedQueue()
+// Desc: Puts a transfer at the back of the run queue.
+// Arg1: r - the reactor the connection belongs to.
+// Arg2: c - the connection.
+// Pre : The data connection can take more data, or the transfer just used up its turn.
+// Post: The transfer gets its next turn after every transfer ahead of it had one. Its socket is
+//       not watched in the meantime.
+void schedQueue(struct reactor* r, struct conn* c) {
+
+    if (c->queued) { return; }
+    watchFd(r, &c->data, 0);
+    c->runPrev = r->runTail;
+    c->runNext = NULL;
+    if (r->runTail != NULL) { r->runTail->runNext = c; } else { r->runHead = c; }
+    r->runTail = c;
+    r->runLen++;
+    c->queued = TRUE;
+}
+
+// Name: schedRemove()
+// Desc: Takes a transfer out of the run queue.
+// Arg1: r - the reactor the connection belongs to.
+// Arg2: c - the connection.
+// Pre : The connection is in the run queue.
+// Post: It is not.
+void schedRemove(struct reactor* r, struct conn* c) {
+
+    if (c->runPrev != NULL) { c->runPrev->runNext = c->runNext; } else { r->runHead = c->runNext; }
+    if (c->runNext != NULL) { c->runNext->runPrev = c->runPrev; } else { r->runTail = c->runPrev; }
+    c->runPrev = c->runNext = NULL;
+    r->runLen--;
+    c->queued = FALSE;
+}
+
+// Name: schedRun()
+// Desc: Runs one round of the scheduler: every transfer queued at the start gets one turn.
+// Arg : r - the reactor.
+// Pre : None.
+// Post: Each transfer sent up to its deficit plus the quantum. One that used it all and still has
+//       data is queued again for the next round, so a bulk transfer never holds up a small one for
+//       more than a quantum per round. A command reading its file for checksums reads one chunk,
+//       and one walking a tree walks ARCHIVE_STEP entries.
+void schedRun(struct reactor* r) {
+
+    struct conn* c;
+    int n = r->runLen;
+
+    while (n-- > 0 && (c = r->runHead) != NULL) {
+        schedRemove(r, c);
+        c->turn = TRUE;
+        if (c->state == ST_HASH) { hashStep(r, c); }
+        else if (c->state == ST_WALK) { walkStep(r, c); }
+        else { sendData(r, c); }
+        c->turn = FALSE;
+    }
+}
+
+// Name: ipBucketGet()
+// Desc: Gets the --ip-rate bucket of a client address.
+// Arg : host - the client's address.
+// Pre : None.
+// Post: The caller holds a reference to the bucket and gives it back with ipBucketPut(). A
+//       client that comes back finds the bucket it left, as long as no other address took it.
+// Rtrn: The bucket, or NULL if every slot is taken by other addresses.
+struct ipBucket* ipBucketGet(char* host) {
+
+    struct ipBucket *b, *free = NULL;
+    unsigned int h = 2166136261u; // FNV-1a
+    char* p;
+    int i;
+
+    for (p = host; *p != '\0'; p++) { h = (h ^ (unsigned char)*p) * 16777619u; }
+    pthread_mutex_lock(&ipTable.lock);
+    for (i = 0; i < IP_BUCKETS; i++) {
+        b = &ipTable.slots[(h + i) % IP_BUCKETS];
+        if (strcmp(b->host, host) == 0) { free = b; break; }
+        if (b->refs == 0 && free == NULL) { free = b; }
+        if (b->host[0] == '\0') { break; } // the end of the chain, the address has no slot
+    }
+    if (free != NULL) {
+        if (strcmp(free->host, host) != 0) {
+            strcpy(free->host, host);
+            free->tat = 0;
+        }
+        free->refs++;
+    }
+    pthread_mutex_unlock(&ipTable.lock);
+    return free;
+}
+
+// Name: ipBucketPut()
+// Desc: Gives back a reference to an --ip-rate bucket.
+// Arg : b - the bucket.
+// Pre : The caller got it from ipBucketGet().
+// Post: The slot is free for another address once no session of this one uses it.
+void ipBucketPut(struct ipBucket* b) {
+
+    pthread_mutex_lock(&ipTable.lock);
+    b->refs--;
+    pthread_mutex_unlock(&ipTable.lock);
+}
+
+// Name: admitTry()
+// Desc: Takes one of the --max-sessions slots.
+// Pre : None.
+// Post: The caller holds a slot if there was one, given back with admitRelease().
+// Rtrn: TRUE if a slot was taken or there is no limit, FALSE if every slot is held.
+bool admitTry(void) {
+
+    int n = __atomic_load_n(&admitted, __ATOMIC_RELAXED);
+
+    if (cfg.maxSessions == 0) { return TRUE; }
+    do {
+        if (n >= cfg.maxSessions) { return FALSE; }
+    } while (!__atomic_compare_exchange_n(&admitted, &n, n + 1, TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return TRUE;
+}
+
+// Name: admitRelease()
+// Desc: Gives back a --max-sessions slot.
+// Pre : The caller holds a slot from admitTry().
+// Post: The next worker to check hands the slot to one of its queued sessions.
+void admitRelease(void) {
+
+    if (cfg.maxSessions > 0) { __atomic_sub_fetch(&admitted, 1, __ATOMIC_RELAXED); }
+}
+
+// Name: admitWaiting()
+// Desc: Starts the worker's queued sessions that a slot is free for, oldest first.
+// Arg : r - the reactor.
+// Pre : None.
+// Post: Each started session waits for its first command, which may already be waiting.
+void admitWaiting(struct reactor* r) {
+
+    struct conn* c;
+
+    while ((c = r->waitHead) != NULL && admitTry()) {
+        r->waitHead = c->waitNext;
+        if (r->waitHead == NULL) { r->waitTail = NULL; }
+        r->nWaiting--;
+        c->waitNext = NULL;
+        c->admitted = TRUE;
+        LOG(L_INFO, "Queued client admitted: %s\n\n", c->host);
+        if (c->state == ST_TLS) { timerSet(r, c, TLS_TIMEOUT_MS); }
+        watchFd(r, &c->ctrl, EPOLLIN);
+    }
+}
@@ -0,0 +1,313 @@
+/*
+ * Name: stats.c
+ * Auth: Andrew Swaim
+ * Date: November 2019
+ * Desc: Logging and statistics: the async logger, the per-worker counters and histograms, the
+ *       STATS reply and the Prometheus endpoint.
+ */
+
+#include "ftpserver.h"
+
+// Name: logWrite()
+// Desc: Formats a log line into the calling worker's ring for the logger thread to write out.
+// Arg1: fmt - printf() format of the line.
+// Arg2: ... - its arguments.
+// Pre : Called through LOG(), which checks the level first.
+// Post: The line is in the ring, or counted as dropped if the ring is full, so a worker never
+//       waits on the output. The main thread before the workers start writes to stdout itself.
+void logWrite(const char* fmt, ...) {
+
+    struct logRing* q = logMine;
+    char line[LOG_LINE];
+    unsigned long long head;
+    va_list ap;
+    int n, off, part;
+
+    va_start(ap, fmt);
+    n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (n < 0) { return; }
+    if (n >= (int)sizeof(line)) { n = sizeof(line) - 1; }
+    if (q == NULL) { fwrite(line, 1, n, stdout); return; }
+
+    head = q->head;
+    if (head + n - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) > LOG_RING) {
+        __atomic_store_n(&q->dropped, q->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    for (off = 0; off < n; off += part) {
+        part = LOG_RING - (head + off) % LOG_RING;
+        if (part > n - off) { part = n - off; }
+        memcpy(q->buf + (head + off) % LOG_RING, line + off, part);
+    }
+    __atomic_store_n(&q->head, head + n, __ATOMIC_RELEASE);
+}
+
+// Name: logFlush()
+// Desc: Writes out every line waiting in the workers' log rings.
+// Pre : The workers' rings were allocated.
+// Post: The rings are empty up to where they were when it was called. Only one caller
+//       flushes at a time, a second one returns right away.
+void logFlush(void) {
+
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    struct logRing* q;
+    unsigned long long head, tail, dropped;
+    ssize_t n;
+    int i, part;
+
+    if (workerList == NULL || pthread_mutex_trylock(&lock) != 0) { return; }
+    for (i = 0; i < cfg.workers; i++) {
+        if ((q = workerList[i].r.log) == NULL) { continue; }
+        head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+        for (tail = q->tail; tail < head; tail += n) {
+            part = LOG_RING - tail % LOG_RING;
+            if (part > head - tail) { part = head - tail; }
+            if ((n = write(STDOUT_FILENO, q->buf + tail % LOG_RING, part)) <= 0) {
+                if (n == -1 && errno == EINTR) { n = 0; continue; }
+                tail = head; // output is gone, drop the lines
+                break;
+            }
+        }
+        __atomic_store_n(&q->tail, tail, __ATOMIC_RELEASE);
+        if ((dropped = __atomic_exchange_n(&q->dropped, 0, __ATOMIC_RELAXED)) > 0) {
+            dprintf(STDOUT_FILENO, "WARNING, worker %d dropped %llu log lines\n\n", i, dropped);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+// Name: logRun()
+// Desc: Thread entry point of the logger, writes the workers' log lines out every LOG_FLUSH_MS.
+// Arg : arg - unused.
+// Pre : The workers' rings were allocated.
+// Post: Never returns.
+// Rtrn: Nothing.
+void* logRun(void* arg) {
+
+    struct timespec ts = { 0, LOG_FLUSH_MS * 1000000L };
+
+    while (1) {
+        logFlush();
+        nanosleep(&ts, NULL);
+    }
+    return NULL;
+}
+
+// Name: histAdd()
+// Desc: Counts a value in a histogram.
+// Arg1: h - the histogram, written only by the calling worker.
+// Arg2: v - the value.
+// Pre : None.
+// Post: The value's bucket, the count and the sum are one more.
+void histAdd(struct hist* h, unsigned long long v) {
+
+    unsigned long long u = (v > 0) ? v - 1 : 0; // buckets hold their upper bound, as Prometheus' do
+    int msb, idx;
+
+    if (u < HIST_SUB) {
+        idx = u;
+    } else {
+        msb = 63 - __builtin_clzll(u); // values past 2^msb up to 2^(msb+1) share HIST_SUB buckets
+        idx = (msb - 1) * HIST_SUB + (int)((u >> (msb - 2)) & (HIST_SUB - 1));
+    }
+    STAT_ADD(h->counts[idx], 1);
+    STAT_ADD(h->count, 1);
+    STAT_ADD(h->sum, v);
+}
+
+// Name: histBound()
+// Desc: Gets the largest value that goes in a histogram bucket.
+// Arg : idx - the bucket after it.
+// Rtrn: The largest value of bucket idx - 1, bucket 0 holds 0 and 1.
+unsigned long long histBound(int idx) {
+
+    if (idx < HIST_SUB) { return idx; }
+    return (unsigned long long)(HIST_SUB + idx % HIST_SUB) << (idx / HIST_SUB - 1);
+}
+
+// Name: histPct()
+// Desc: Gets a percentile of the values in a histogram.
+// Arg1: h - the histogram.
+// Arg2: pct - the percentile, 0 to 100.
+// Rtrn: The largest value of the bucket the percentile falls in, 0 if the histogram is empty.
+unsigned long long histPct(struct hist* h, double pct) {
+
+    unsigned long long seen = 0;
+    int i;
+
+    if (h->count == 0) { return 0; }
+    for (i = 0; i < HIST_BUCKETS - 1; i++) {
+        seen += h->counts[i];
+        if (seen >= h->count * pct / 100) { break; }
+    }
+    return histBound(i + 1);
+}
+
+// Name: statsSum()
+// Desc: Adds up the counters of every worker.
+// Arg1: s - filled with the sums.
+// Arg2: active - filled with the number of open control connections.
+// Arg3: dropped - filled with the log lines dropped and not yet reported.
+// Pre : The workers were setup.
+// Post: Each counter is read whole, but the workers keep counting while they are read.
+void statsSum(struct stats* s, int* active, unsigned long long* dropped) {
+
+    unsigned long long *dst, *src;
+    struct stats* w;
+    int i, j;
+
+    memset(s, 0, sizeof(*s));
+    *active = 0;
+    *dropped = 0;
+    for (i = 0; i < cfg.workers; i++) {
+        w = &workerList[i].r.stats;
+        dst = (unsigned long long*)s;
+        src = (unsigned long long*)w;
+        for (j = 0; j < (int)(sizeof(*s) / sizeof(*dst)); j++) { dst[j] += __atomic_load_n(&src[j], __ATOMIC_RELAXED); }
+        *active += __atomic_load_n(&workerList[i].r.active, __ATOMIC_RELAXED);
+        if (workerList[i].r.log != NULL) { *dropped += __atomic_load_n(&workerList[i].r.log->dropped, __ATOMIC_RELAXED); }
+    }
+}
+
+// Name: statsLine()
+// Desc: Builds the reply to STATS: the server's counters and latency percentiles on one line.
+// Arg1: buf - where to build it.
+// Arg2: len - size of buf.
+// Pre : The workers were setup.
+// Post: The line ends in a newline, a line that does not fit is cut.
+// Rtrn: The length of the line.
+int statsLine(char* buf, int len) {
+
+    struct stats s;
+    unsigned long long dropped;
+    int active, n;
+
+    statsSum(&s, &active, &dropped);
+    n = snprintf(buf, len, "STATS active=%d accepted=%llu commands=%llu transfers=%llu uploads=%llu "
+                 "sent=%llu received=%llu cache_hits=%llu cache_misses=%llu "
+                 "ok_us_p50=%llu ok_us_p99=%llu connect_us_p50=%llu connect_us_p99=%llu "
+                 "rate_kbs_p50=%llu rate_kbs_p99=%llu rtt_us_p50=%llu rtt_us_p99=%llu retransmits=%llu "
+                 "throttled=%llu admitted=%d queued=%llu rejected=%llu tls_handshakes=%llu tls_resumed=%llu ktls=%llu "
+                 "log_dropped=%llu\n",
+                 active, s.accepted, s.commands, s.transfers, s.uploads, s.bytesSent, s.bytesRecv,
+                 s.cacheHits, s.cacheMisses, histPct(&s.okLat, 50), histPct(&s.okLat, 99),
+                 histPct(&s.connectLat, 50), histPct(&s.connectLat, 99),
+                 histPct(&s.rate, 50), histPct(&s.rate, 99), histPct(&s.rtt, 50), histPct(&s.rtt, 99),
+                 s.retrans, s.throttled, __atomic_load_n(&admitted, __ATOMIC_RELAXED), s.queued, s.rejected,
+                 s.tlsHandshakes, s.tlsResumed, s.ktls, dropped);
+    if (n >= len) { buf[len - 2] = '\n'; n = len - 1; }
+    return n;
+}
+
+// Name: promAdd()
+// Desc: Appends to the Prometheus text being built.
+// Arg1: buf - the text.
+// Arg2: len - size of buf.
+// Arg3: n - the length of the text so far, updated.
+// Arg4: fmt - printf style format of what to append, followed by its arguments.
+// Pre : None.
+// Post: Once the text does not fit, n stays at len or past it and nothing more is written.
+static void promAdd(char* buf, int len, int* n, const char* fmt, ...) {
+
+    va_list ap;
+
+    if (*n >= len) { return; }
+    va_start(ap, fmt);
+    *n += vsnprintf(buf + *n, len - *n, fmt, ap);
+    va_end(ap);
+}
+
+// Name: statsProm()
+// Desc: Builds the server's counters and histograms in the Prometheus text format.
+// Arg1: buf - where to build it.
+// Arg2: len - size of buf.
+// Pre : The workers were setup.
+// Post: Histograms are given with a bucket per power of two, converted to seconds and bytes.
+// Rtrn: The length of the text, or -1 if it does not fit.
+int statsProm(char* buf, int len) {
+
+    struct stats s;
+    unsigned long long dropped, seen;
+    struct hist* h[4];
+    const char* names[4] = { "ftp_ok_latency_seconds", "ftp_connect_latency_seconds",
+                             "ftp_transfer_rate_bytes_per_second", "ftp_tcp_rtt_seconds" };
+    double scale[4] = { 1e-6, 1e-6, 1024, 1e-6 };
+    int active, n = 0, i, k, idx;
+
+    statsSum(&s, &active, &dropped);
+    h[0] = &s.okLat; h[1] = &s.connectLat; h[2] = &s.rate; h[3] = &s.rtt;
+    promAdd(buf, len, &n, "# TYPE ftp_connections_active gauge\nftp_connections_active %d\n", active);
+    promAdd(buf, len, &n, "# TYPE ftp_connections_accepted_total counter\nftp_connections_accepted_total %llu\n", s.accepted);
+    promAdd(buf, len, &n, "# TYPE ftp_commands_total counter\nftp_commands_total %llu\n", s.commands);
+    promAdd(buf, len, &n, "# TYPE ftp_transfers_total counter\nftp_transfers_total %llu\n", s.transfers);
+    promAdd(buf, len, &n, "# TYPE ftp_uploads_total counter\nftp_uploads_total %llu\n", s.uploads);
+    promAdd(buf, len, &n, "# TYPE ftp_sent_bytes_total counter\nftp_sent_bytes_total %llu\n", s.bytesSent);
+    promAdd(buf, len, &n, "# TYPE ftp_received_bytes_total counter\nftp_received_bytes_total %llu\n", s.bytesRecv);
+    promAdd(buf, len, &n, "# TYPE ftp_cache_hits_total counter\nftp_cache_hits_total %llu\n", s.cacheHits);
+    promAdd(buf, len, &n, "# TYPE ftp_cache_misses_total counter\nftp_cache_misses_total %llu\n", s.cacheMisses);
+    promAdd(buf, len, &n, "# TYPE ftp_log_dropped_total counter\nftp_log_dropped_total %llu\n", dropped);
+    promAdd(buf, len, &n, "# TYPE ftp_tcp_retransmits_total counter\nftp_tcp_retransmits_total %llu\n", s.retrans);
+    promAdd(buf, len, &n, "# TYPE ftp_throttled_total counter\nftp_throttled_total %llu\n", s.throttled);
+    promAdd(buf, len, &n, "# TYPE ftp_sessions_admitted gauge\nftp_sessions_admitted %d\n",
+                __atomic_load_n(&admitted, __ATOMIC_RELAXED));
+    promAdd(buf, len, &n, "# TYPE ftp_sessions_queued_total counter\nftp_sessions_queued_total %llu\n", s.queued);
+    promAdd(buf, len, &n, "# TYPE ftp_sessions_rejected_total counter\nftp_sessions_rejected_total %llu\n", s.rejected);
+    promAdd(buf, len, &n, "# TYPE ftp_tls_handshakes_total counter\nftp_tls_handshakes_total %llu\n", s.tlsHandshakes);
+    promAdd(buf, len, &n, "# TYPE ftp_tls_resumed_total counter\nftp_tls_resumed_total %llu\n", s.tlsResumed);
+    promAdd(buf, len, &n, "# TYPE ftp_ktls_total counter\nftp_ktls_total %llu\n", s.ktls);
+    promAdd(buf, len, &n, "# TYPE ftp_tcp_config_info gauge\nftp_tcp_config_info{congestion=\"%s\",sndbuf=\"%d\","
+                "rcvbuf=\"%d\",nodelay=\"%d\",cork=\"%d\",notsent_lowat=\"%d\",fastopen=\"%d\"} 1\n",
+                cfg.congestion ? cfg.congestion : "default", cfg.sndbuf, cfg.rcvbuf, cfg.nodelay, cfg.cork,
+                cfg.notsentLowat, cfg.fastopen);
+    for (i = 0; i < 4 && n < len; i++) {
+        promAdd(buf, len, &n, "# TYPE %s histogram\n", names[i]);
+        for (k = 0, seen = 0, idx = 0; k < PROM_BUCKETS && n < len; k++) {
+            for (; idx < HIST_BUCKETS && histBound(idx + 1) <= (1ULL << k); idx++) { seen += h[i]->counts[idx]; }
+            promAdd(buf, len, &n, "%s_bucket{le=\"%g\"} %llu\n", names[i], (double)(1ULL << k) * scale[i], seen);
+        }
+        promAdd(buf, len, &n, "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %g\n%s_count %llu\n",
+                names[i], h[i]->count, names[i], h[i]->sum * scale[i], names[i], h[i]->count);
+    }
+    return (n < len) ? n : -1;
+}
+
+// Name: metricsRun()
+// Desc: Thread entry point of the Prometheus endpoint, answers every HTTP request on
+//       --metrics-port with the server's metrics.
+// Arg : arg - unused.
+// Pre : startup() opened metricsSock, or took it over from the old server.
+// Post: Never returns. Scrapes are answered one at a time, off the workers' threads. After accept()
+//       fails the thread waits METRICS_BACKOFF_MS before trying again.
+// Rtrn: Nothing.
+void* metricsRun(void* arg) {
+
+    static char body[1 << 16], head[BUF_LEN];
+    char req[LINE_LEN];
+    struct timeval tv = { 1, 0 };
+    struct timespec backoff = { 0, METRICS_BACKOFF_MS * 1000000L };
+    bool failing = FALSE; // accept() has failed since it last worked, the error is logged once
+    int sock = metricsSock, fd, n;
+
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) & ~O_NONBLOCK);
+    LOG(L_INFO, "Metrics endpoint listening on port: %s\n\n", cfg.metricsPort);
+    while (1) {
+        if ((fd = accept(sock, NULL, NULL)) == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) { continue; }
+            if (!failing) { LOG_ERRNO(L_ERROR, "ERROR, accepting metrics scrape\n\n"); }
+            failing = TRUE;
+            nanosleep(&backoff, NULL); // the error (like EMFILE) lasts, do not spin on it
+            continue;
+        }
+        failing = FALSE;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)); // a scraper that sends nothing is dropped
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        if (recv(fd, req, sizeof(req), 0) > 0 && (n = statsProm(body, sizeof(body))) != -1) {
+            snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                     "Content-Length: %d\r\n\r\n", n);
+            if (sendAll(fd, head, strlen(head)) != -1) { sendAll(fd, body, n); }
+        }
+        close(fd);
+    }
+    return NULL;
+}
@@ -0,0 +1,227 @@
+/*
+ * Name: tls.c
+ * Auth: Andrew Swaim
+ * Date: November 2019
+ * Desc: TLS on the control and data connections with OpenSSL. Once the handshake is done the
+ *       kernel takes over the encryption of what is sent (kTLS) where it can, so the data
+ *       connection keeps sending from the page cache with sendfile(), splice() and io_uring.
+ */
+
+#include "ftpserver.h"
+
+// Name: tlsInit()
+// Desc: Loads the certificate and key and sets up the TLS context every worker shares.
+// Pre : The options were parsed and the descriptor limit raised.
+// Post: tlsCtx is ready if --tls-cert was given. The program exits if the certificate or key
+//       cannot be loaded.
+void tlsInit(void) {
+
+    struct rlimit lim;
+    char ulp[BUF_LEN] = "", err[BUF_LEN];
+    FILE* f;
+
+    if (cfg.tlsCert == NULL) { return; }
+    if ((tlsCtx = SSL_CTX_new(TLS_server_method())) == NULL
+            || SSL_CTX_use_certificate_chain_file(tlsCtx, cfg.tlsCert) != 1
+            || SSL_CTX_use_PrivateKey_file(tlsCtx, cfg.tlsKey ? cfg.tlsKey : cfg.tlsCert, SSL_FILETYPE_PEM) != 1
+            || SSL_CTX_check_private_key(tlsCtx) != 1) {
+        ERR_error_string_n(ERR_get_error(), err, sizeof(err));
+        fprintf(stderr, "ERROR, loading TLS certificate or key: %s\n\n", err);
+        exit(1);
+    }
+    SSL_CTX_set_min_proto_version(tlsCtx, TLS1_2_VERSION);
+
+    // Partial writes let a full socket return what was sent, like send() does. Buffers are
+    // given back while a connection is idle.
+    SSL_CTX_set_options(tlsCtx, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF | SSL_OP_NO_RENEGOTIATION);
+    SSL_CTX_set_mode(tlsCtx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+
+    // A client resumes the control connection's session on every data connection, with the
+    // ticket it got (TLS 1.3) or from the session cache (TLS 1.2). One ticket is all it needs.
+    SSL_CTX_set_session_id_context(tlsCtx, (const unsigned char*)"ftpserver", 9);
+    SSL_CTX_set_session_cache_mode(tlsCtx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_num_tickets(tlsCtx, 1);
+
+    getrlimit(RLIMIT_NOFILE, &lim);
+    tlsMax = (lim.rlim_cur > (1 << 20)) ? (1 << 20) : (int)lim.rlim_cur;
+    if ((tlsFds = calloc(tlsMax, sizeof(*tlsFds))) == NULL) {
+        perror("ERROR, allocating TLS sessions\n\n");
+        exit(1);
+    }
+
+    // A write that only got part of a record out has to be retried with at least that record
+    if (cfg.quantum > 0 && cfg.quantum < TLS_RECORD) {
+        printf("WARNING, quantum raised to %d bytes, one TLS record\n\n", TLS_RECORD);
+        cfg.quantum = TLS_RECORD;
+    }
+    if ((f = fopen("/proc/sys/net/ipv4/tcp_available_ulp", "r")) != NULL) {
+        if (fgets(ulp, sizeof(ulp), f) == NULL) { ulp[0] = '\0'; }
+        fclose(f);
+    }
+    if (strstr(ulp, "tls") == NULL) {
+        printf("WARNING, the kernel has no kTLS, data connections encrypt in user space without sendfile()\n\n");
+    }
+}
+
+// Name: tlsStart()
+// Desc: Starts a TLS session on a socket, the server side of it whoever opened the connection.
+// Arg1: fd - the socket.
+// Arg2: tickets - TRUE to give the client a session ticket to resume with. Only the control
+//       connection hands them out: a data connection resumes the control connection's session,
+//       and a client that closes a data connection with a ticket it never read resets it.
+// Pre : TLS is on and the socket is connected.
+// Post: tlsShake() does the handshake.
+// Rtrn: TRUE on success, FALSE if the session could not be created.
+bool tlsStart(int fd, bool tickets) {
+
+    SSL* ssl;
+
+    if (fd >= tlsMax) { errno = EMFILE; return FALSE; }
+    if ((ssl = SSL_new(tlsCtx)) == NULL) { errno = ENOMEM; return FALSE; }
+    if (SSL_set_fd(ssl, fd) != 1) {
+        SSL_free(ssl);
+        ERR_clear_error();
+        errno = ENOMEM;
+        return FALSE;
+    }
+    SSL_set_accept_state(ssl);
+    if (!tickets) { SSL_set_num_tickets(ssl, 0); }
+    tlsFds[fd].ssl = ssl;
+    tlsFds[fd].ktls = FALSE;
+    tlsFds[fd].failed = FALSE;
+    return TRUE;
+}
+
+// Name: tlsError()
+// Desc: Turns the result of a failed TLS call into what the same socket call would have returned.
+// Arg1: t - the socket's TLS session.
+// Arg2: ret - what the call returned.
+// Pre : The call failed.
+// Post: A fatal error is logged and the OpenSSL error queue is cleared.
+// Rtrn: 0 if the peer closed the session, otherwise -1 with errno EAGAIN if the socket is not
+//       ready or the error.
+static ssize_t tlsError(struct tlsFd* t, int ret) {
+
+    unsigned long e;
+
+    switch (SSL_get_error(t->ssl, ret)) {
+    case SSL_ERROR_ZERO_RETURN: return 0;
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE: errno = EAGAIN; return -1;
+    case SSL_ERROR_SYSCALL: if (errno == 0) { errno = ECONNRESET; } break;
+    default:
+        if ((e = ERR_peek_last_error()) != 0) { LOG(L_WARN, "WARNING, TLS: %s\n\n", ERR_reason_error_string(e)); }
+        errno = EPROTO;
+    }
+    t->failed = TRUE;
+    ERR_clear_error();
+    return -1;
+}
+
+// Name: tlsShake()
+// Desc: Does as much of a TLS handshake as the socket allows.
+// Arg1: r - the reactor the socket belongs to.
+// Arg2: fd - the socket.
+// Arg3: events - set to the events to wait for if the handshake is not done.
+// Pre : tlsStart() was called on the socket.
+// Post: A finished handshake is counted, and the socket is marked for kTLS if the kernel took
+//       over its sends.
+// Rtrn: 1 if the handshake is done, 0 to wait for events, -1 if it failed.
+int tlsShake(struct reactor* r, int fd, unsigned int* events) {
+
+    struct tlsFd* t = &tlsFds[fd];
+    int n;
+
+    if ((n = SSL_do_handshake(t->ssl)) != 1) {
+        if (tlsError(t, n) == -1 && errno == EAGAIN) {
+            *events = (SSL_get_error(t->ssl, n) == SSL_ERROR_WANT_WRITE) ? EPOLLOUT : EPOLLIN;
+            return 0;
+        }
+        if (errno == 0 || errno == EAGAIN) { errno = ECONNRESET; }
+        return -1;
+    }
+
+    t->ktls = BIO_get_ktls_send(SSL_get_wbio(t->ssl)) ? TRUE : FALSE;
+    STAT_ADD(r->stats.tlsHandshakes, 1);
+    if (SSL_session_reused(t->ssl)) { STAT_ADD(r->stats.tlsResumed, 1); }
+    if (t->ktls) { STAT_ADD(r->stats.ktls, 1); }
+    LOG(L_DEBUG, "TLS handshake done: %s %s%s%s\n\n", SSL_get_version(t->ssl), SSL_get_cipher_name(t->ssl),
+        SSL_session_reused(t->ssl) ? ", resumed" : "", t->ktls ? ", kTLS" : "");
+    return 1;
+}
+
+// Name: tlsEnd()
+// Desc: Ends the TLS session of a socket about to be closed.
+// Arg : fd - the socket.
+// Pre : None, a socket without TLS is left alone.
+// Post: A close_notify is sent if the socket has room for it, and the session is freed.
+void tlsEnd(int fd) {
+
+    struct tlsFd* t;
+
+    if (fd == -1 || !TLS_ON(fd)) { return; }
+    t = &tlsFds[fd];
+    if (!t->failed && SSL_is_init_finished(t->ssl)) { SSL_shutdown(t->ssl); }
+    SSL_free(t->ssl);
+    ERR_clear_error();
+    t->ssl = NULL;
+}
+
+// Name: tlsSend()
+// Desc: Sends on a TLS socket whose sends are encrypted in user space, send() for sendFlags().
+// Arg1: fd - the socket.
+// Arg2: buf - the data.
+// Arg3: len - the length of the data.
+// Pre : The handshake is done.
+// Post: Up to one record of the data is sent.
+// Rtrn: The bytes sent, or -1 with errno set (EAGAIN if the socket is full).
+ssize_t tlsSend(int fd, const char* buf, size_t len) {
+
+    struct tlsFd* t = &tlsFds[fd];
+    size_t n;
+    int ret;
+
+    if ((ret = SSL_write_ex(t->ssl, buf, (len < TLS_RECORD) ? len : TLS_RECORD, &n)) == 1) { return n; }
+    if (tlsError(t, ret) == 0) { errno = EPIPE; }
+    return -1;
+}
+
+// Name: tlsRecv()
+// Desc: Receives on a TLS socket, recv() for recvSome().
+// Arg1: fd - the socket.
+// Arg2: buf - where to receive.
+// Arg3: len - the size of buf.
+// Pre : The handshake is done.
+// Post: Data OpenSSL still holds decrypted is returned before the socket is read again.
+// Rtrn: The bytes received, 0 if the peer closed the session, or -1 with errno set.
+ssize_t tlsRecv(int fd, char* buf, size_t len) {
+
+    struct tlsFd* t = &tlsFds[fd];
+    size_t n;
+    int ret;
+
+    if ((ret = SSL_read_ex(t->ssl, buf, len, &n)) == 1) { return n; }
+    return tlsError(t, ret);
+}
+
+// Name: tlsSendfile()
+// Desc: sendfile() on a kTLS socket, the kernel encrypts the file as it sends it.
+// Arg1: fd - the socket.
+// Arg2: file - the file.
+// Arg3: off - the offset in the file to send from, advanced past the data sent.
+// Arg4: len - the number of bytes to send.
+// Pre : The handshake is done and the socket has kTLS.
+// Post: See sendfile().
+// Rtrn: The bytes sent, or -1 with errno set (EAGAIN if the socket is full).
+ssize_t tlsSendfile(int fd, int file, off_t* off, size_t len) {
+
+    struct tlsFd* t = &tlsFds[fd];
+    ossl_ssize_t n;
+
+    if ((n = SSL_sendfile(t->ssl, file, *off, len, 0)) >= 0) {
+        *off += n;
+        return n;
+    }
+    if (tlsError(t, (int)n) == 0) { errno = EPIPE; }
+    return -1;
+}